@@ -0,0 +1,526 @@
+/* Benchmark for bulk tensor construction.
+ *
+ * Builds a tensor from random COO entries with hacoo_build_from_coo at
+ * 1, 2, 4, ... threads up to the OpenMP maximum and reports the build
+ * throughput for each thread count.
+ *
+ * With --stream the entries are inserted one hacoo_set at a time instead,
+ * once with stop-the-world rehashing and once with HACOO_INCREMENTAL, and
+ * the insert latency percentiles are reported.
+ *
+ * With --accumulate the entries are summed into a tensor as events, with a
+ * get+set loop, hacoo_accumulate_batch and hacoo_accumulate_parallel at
+ * each thread count.
+ *
+ * --arena keeps the bucket vectors in a HACOO_ARENA slab arena. The time to
+ * free each tensor is reported alongside its build time.
+ *
+ * --drop-zeros makes every fourth value zero and builds with
+ * HACOO_DROP_ZEROS, first checking the build against a hacoo_set loop.
+ *
+ * --check runs deterministic round trips on a small tensor instead, where
+ * indices repeat often and a quarter of the values are zero: set, remove,
+ * shrink, freeze and thaw against a dense copy, hacoo_accumulate_parallel
+ * against hacoo_accumulate_batch under each combiner, and the build
+ * against a hacoo_set loop, for each storage.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <omp.h>
+#include "hacoo.h"
+
+#define DEFAULT_COUNT (1 << 22)
+#define MAX_MODES 64
+#define CHECK_COUNT 4000
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [--count <nonzeros>] [--dims <I,J,K,...>] "
+           "[--storage chained|flat|frozen] [--arena] [--drop-zeros] "
+           "[--stream | --accumulate | --check]\n", program_name);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Insert the entries one at a time and report per-insert latency */
+static void bench_stream(const char *name, unsigned int ndims, unsigned int *dims,
+                         size_t count, unsigned int *idx, double *vals,
+                         unsigned int flags, double *lat)
+{
+    struct timespec start, end;
+    struct hacoo_tensor *t = hacoo_alloc_flags(ndims, dims, 128, 70, flags);
+    if (!t) {
+        fprintf(stderr, "Error: Allocation failed.\n");
+        return;
+    }
+
+    double total = 0.0;
+    for (size_t z = 0; z < count; z++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        hacoo_set(t, &idx[z * ndims], vals[z]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        lat[z] = (end.tv_sec - start.tv_sec) * 1e6 +
+                 (end.tv_nsec - start.tv_nsec) / 1e3;
+        total += lat[z];
+    }
+
+    unsigned int nnz = t->nnz;
+    size_t nbuckets = t->nbuckets;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    hacoo_free(t);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t_free = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    qsort(lat, count, sizeof(double), compare_double);
+    printf("%-12s %8.3f s   p50 %7.3f us   p99 %7.3f us   p99.9 %9.3f us   "
+           "max %10.1f us   free %8.3f s   (nnz %u, nbuckets %zu)\n",
+           name, total / 1e6, lat[count / 2], lat[count * 99 / 100],
+           lat[count * 999 / 1000], lat[count - 1], t_free, nnz, nbuckets);
+}
+
+static void bench_threads(int threads, unsigned int ndims, unsigned int *dims,
+                          size_t count, unsigned int *idx, double *vals,
+                          unsigned int flags)
+{
+    omp_set_num_threads(threads);
+
+    double start = omp_get_wtime();
+    struct hacoo_tensor *t = hacoo_build_from_coo(ndims, dims, count, idx, vals,
+                                                  flags);
+    double end = omp_get_wtime();
+
+    if (!t) {
+        fprintf(stderr, "Error: Build failed with %d threads.\n", threads);
+        return;
+    }
+
+    unsigned int nnz = t->nnz;
+    size_t nbuckets = t->nbuckets;
+    double free_start = omp_get_wtime();
+    hacoo_free(t);
+    double free_end = omp_get_wtime();
+
+    printf("%4d threads: %8.3f s   %8.2f Mnnz/s   free %8.3f s   "
+           "(nnz %u, nbuckets %zu)\n", threads, end - start,
+           count / (end - start) / 1e6, free_end - free_start, nnz, nbuckets);
+}
+
+/* Check that building from COO stores what a hacoo_set loop over the same
+ * entries does */
+static int check_build(unsigned int ndims, unsigned int *dims, size_t count,
+                       unsigned int *idx, double *vals, unsigned int flags)
+{
+    struct hacoo_tensor *built = hacoo_build_from_coo(ndims, dims, count, idx,
+                                                      vals, flags);
+    struct hacoo_tensor *set = hacoo_alloc_flags(ndims, dims, 128, 70,
+                                                 flags & ~HACOO_FREEZE);
+    if (!built || !set) {
+        fprintf(stderr, "Error: Allocation failed.\n");
+        return 0;
+    }
+
+    for (size_t z = 0; z < count; z++) {
+        hacoo_set(set, &idx[z * ndims], vals[z]);
+    }
+    int ok = built->nnz == set->nnz;
+    for (size_t z = 0; ok && z < count; z++) {
+        ok = hacoo_get(built, &idx[z * ndims]) == hacoo_get(set, &idx[z * ndims]);
+    }
+
+    printf("build against hacoo_set: %s (nnz %u and %u)\n",
+           ok ? "ok" : "MISMATCH", built->nnz, set->nnz);
+    hacoo_free(built);
+    hacoo_free(set);
+    return ok;
+}
+
+/* Check that a and b store the same value at every index, and the same
+ * number of entries */
+static int same_cells(struct hacoo_tensor *a, struct hacoo_tensor *b,
+                      unsigned int ndims, unsigned int *dims)
+{
+    unsigned int index[MAX_MODES] = {0};
+
+    if (a->nnz != b->nnz) {
+        return 0;
+    }
+    for (;;) {
+        if (hacoo_get(a, index) != hacoo_get(b, index)) {
+            return 0;
+        }
+        unsigned int i = 0;
+        while (i < ndims && ++index[i] == dims[i]) {
+            index[i++] = 0;
+        }
+        if (i == ndims) {
+            return 1;
+        }
+    }
+}
+
+/* Check that t holds exactly the nonzeros of dense, indexed with the first
+ * mode fastest */
+static int matches_dense(struct hacoo_tensor *t, unsigned int ndims,
+                         unsigned int *dims, const double *dense)
+{
+    unsigned int index[MAX_MODES] = {0};
+    unsigned int nnz = 0;
+
+    for (size_t c = 0;; c++) {
+        if (hacoo_get(t, index) != dense[c]) {
+            return 0;
+        }
+        nnz += dense[c] != 0.0;
+        unsigned int i = 0;
+        while (i < ndims && ++index[i] == dims[i]) {
+            index[i++] = 0;
+        }
+        if (i == ndims) {
+            return t->nnz == nnz;
+        }
+    }
+}
+
+static size_t dense_cell(unsigned int ndims, unsigned int *dims,
+                         const unsigned int *index)
+{
+    size_t c = 0;
+    for (unsigned int i = ndims; i-- > 0;) {
+        c = c * dims[i] + index[i];
+    }
+    return c;
+}
+
+/* Set every entry, remove every third, then shrink, freeze, thaw and set
+ * half of them again, checking t against a dense copy at each step */
+static int check_round_trip(unsigned int ndims, unsigned int *dims,
+                            size_t count, unsigned int *idx, double *vals,
+                            unsigned int flags)
+{
+    size_t cells = dense_cell(ndims, dims, dims);
+    double *dense = calloc(cells, sizeof(double));
+    struct hacoo_tensor *t = hacoo_alloc_flags(ndims, dims, 16, 70,
+                                               flags | HACOO_DROP_ZEROS);
+    if (!dense || !t) {
+        fprintf(stderr, "Error: Allocation failed.\n");
+        free(dense);
+        return 0;
+    }
+
+    for (size_t z = 0; z < count; z++) {
+        hacoo_set(t, &idx[z * ndims], vals[z]);
+        dense[dense_cell(ndims, dims, &idx[z * ndims])] = vals[z];
+    }
+    int ok = matches_dense(t, ndims, dims, dense);
+    for (size_t z = 0; ok && z < count; z += 3) {
+        double *cell = &dense[dense_cell(ndims, dims, &idx[z * ndims])];
+        ok = hacoo_remove(t, &idx[z * ndims]) == (*cell != 0.0);
+        *cell = 0.0;
+    }
+    ok = ok && matches_dense(t, ndims, dims, dense);
+    ok = ok && hacoo_shrink_to_fit(t) == 0 && matches_dense(t, ndims, dims, dense);
+    ok = ok && hacoo_freeze(t) == 0 && matches_dense(t, ndims, dims, dense);
+    ok = ok && hacoo_thaw(t) == 0 && matches_dense(t, ndims, dims, dense);
+    for (size_t z = 0; ok && z < count / 2; z++) {
+        hacoo_set(t, &idx[z * ndims], vals[z]);
+        dense[dense_cell(ndims, dims, &idx[z * ndims])] = vals[z];
+    }
+    ok = ok && matches_dense(t, ndims, dims, dense);
+
+    printf("  set/remove/shrink/thaw: %s (nnz %u)\n", ok ? "ok" : "MISMATCH",
+           t->nnz);
+    hacoo_free(t);
+    free(dense);
+    return ok;
+}
+
+/* Check that accumulating in parallel stores what the serial batch does,
+ * under each combiner, with and without HACOO_DROP_ZEROS */
+static int check_accumulate(unsigned int ndims, unsigned int *dims,
+                            size_t count, unsigned int *idx, double *vals,
+                            unsigned int flags)
+{
+    hacoo_combiner combine[] = {NULL, hacoo_combine_sum, hacoo_combine_max,
+                                hacoo_combine_min, hacoo_combine_last};
+    const char *names[] = {"set", "sum", "max", "min", "last"};
+    int all = 1;
+
+    for (unsigned int c = 0; c < sizeof(combine) / sizeof(combine[0]); c++) {
+        for (unsigned int drop = 0; drop <= HACOO_DROP_ZEROS;
+             drop += HACOO_DROP_ZEROS) {
+            struct hacoo_tensor *serial = hacoo_alloc_flags(ndims, dims, 16, 70,
+                                                            flags | drop);
+            struct hacoo_tensor *parallel = hacoo_alloc_flags(ndims, dims, 16,
+                                                              70, flags | drop);
+            if (!serial || !parallel) {
+                fprintf(stderr, "Error: Allocation failed.\n");
+                return 0;
+            }
+
+            hacoo_accumulate_batch(serial, count, idx, vals, combine[c]);
+            int ok = hacoo_accumulate_parallel(parallel, count, idx, vals,
+                                               combine[c]) == 0 &&
+                     same_cells(serial, parallel, ndims, dims);
+            printf("  accumulate %s%s: %s (nnz %u and %u)\n", names[c],
+                   drop ? ", dropping zeros" : "", ok ? "ok" : "MISMATCH",
+                   serial->nnz, parallel->nnz);
+            all = all && ok;
+            hacoo_free(serial);
+            hacoo_free(parallel);
+        }
+    }
+    return all;
+}
+
+/* Round trips on a small tensor for each storage. Returns 1 if all pass. */
+static int run_checks(void)
+{
+    unsigned int dims[] = {9, 8, 7, 6};
+    unsigned int ndims = sizeof(dims) / sizeof(dims[0]);
+    unsigned int flags[] = {HACOO_CHAINED, HACOO_FLAT, HACOO_WIDE,
+                            HACOO_INCREMENTAL, HACOO_ARENA};
+    const char *names[] = {"chained", "flat", "wide", "incremental", "arena"};
+    unsigned int *idx = malloc(CHECK_COUNT * ndims * sizeof(unsigned int));
+    double *vals = malloc(CHECK_COUNT * sizeof(double));
+    int ok = 1;
+
+    if (!idx || !vals) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 0;
+    }
+
+    // Small integers, so sums are exact and often come back to zero
+    srand(12345);
+    for (size_t z = 0; z < CHECK_COUNT; z++) {
+        for (unsigned int i = 0; i < ndims; i++) {
+            idx[z * ndims + i] = rand() % dims[i];
+        }
+        vals[z] = z % 4 == 3 ? 0.0 : (double)(rand() % 5 - 2);
+    }
+
+    for (unsigned int s = 0; s < sizeof(flags) / sizeof(flags[0]); s++) {
+        printf("%s storage:\n", names[s]);
+        ok &= check_round_trip(ndims, dims, CHECK_COUNT, idx, vals, flags[s]);
+        ok &= check_accumulate(ndims, dims, CHECK_COUNT, idx, vals, flags[s]);
+        for (unsigned int b = 0; b < 4; b++) {
+            unsigned int drop = b & 1 ? HACOO_DROP_ZEROS : 0;
+            unsigned int freeze = b & 2 ? HACOO_FREEZE : 0;
+            printf("  %s%s", freeze ? "frozen " : "",
+                   drop ? "dropping zeros " : "");
+            ok &= check_build(ndims, dims, CHECK_COUNT, idx, vals,
+                              flags[s] | drop | freeze);
+        }
+    }
+
+    free(idx);
+    free(vals);
+    return ok;
+}
+
+enum accumulate_mode { GET_SET, BATCH, PARALLEL };
+
+/* Sum the events into a fresh tensor and report events per second */
+static void bench_accumulate(const char *name, enum accumulate_mode mode,
+                             int threads, unsigned int ndims,
+                             unsigned int *dims, size_t count, unsigned int *idx,
+                             double *vals, unsigned int flags, double *expected)
+{
+    struct hacoo_tensor *t = hacoo_alloc_flags(ndims, dims, 128, 70, flags);
+    if (!t) {
+        fprintf(stderr, "Error: Allocation failed.\n");
+        return;
+    }
+
+    double start = omp_get_wtime();
+    if (mode == GET_SET) {
+        for (size_t z = 0; z < count; z++) {
+            hacoo_set(t, &idx[z * ndims], hacoo_get(t, &idx[z * ndims]) + vals[z]);
+        }
+    } else if (mode == BATCH) {
+        hacoo_accumulate_batch(t, count, idx, vals, hacoo_combine_sum);
+    } else {
+        omp_set_num_threads(threads);
+        hacoo_accumulate_parallel(t, count, idx, vals, hacoo_combine_sum);
+    }
+    double end = omp_get_wtime();
+
+    // Check against the get+set result, the first run
+    int ok = 1;
+    for (size_t z = 0; z < count; z++) {
+        double v = hacoo_get(t, &idx[z * ndims]);
+        if (mode == GET_SET) {
+            expected[z] = v;
+        } else if (v != expected[z]) {
+            ok = 0;
+        }
+    }
+
+    printf("%-24s %8.3f s   %8.2f Mevents/s   %s (nnz %u)\n", name, end - start,
+           count / (end - start) / 1e6, ok ? "ok" : "MISMATCH", t->nnz);
+    hacoo_free(t);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = DEFAULT_COUNT;
+    unsigned int dims[MAX_MODES] = {183, 24, 1140, 1717};
+    unsigned int ndims = 4;
+    unsigned int flags = HACOO_CHAINED;
+    const char *storage = "chained";
+    int stream = 0;
+    int accumulate = 0;
+    int check = 0;
+    unsigned int arena = 0;
+    unsigned int drop_zeros = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+        {
+            count = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--dims") == 0 && i + 1 < argc)
+        {
+            const char *p = argv[++i];
+            for (ndims = 0; *p && ndims < MAX_MODES; ndims++) {
+                char *next;
+                dims[ndims] = strtoul(p, &next, 10);
+                p = *next == ',' ? next + 1 : next;
+            }
+        }
+        else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc)
+        {
+            storage = argv[++i];
+            if (strcmp(storage, "flat") == 0) {
+                flags = HACOO_FLAT;
+            } else if (strcmp(storage, "frozen") == 0) {
+                flags = HACOO_FREEZE;
+            } else if (strcmp(storage, "chained") != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--arena") == 0)
+        {
+            arena = HACOO_ARENA;
+        }
+        else if (strcmp(argv[i], "--drop-zeros") == 0)
+        {
+            drop_zeros = HACOO_DROP_ZEROS;
+        }
+        else if (strcmp(argv[i], "--accumulate") == 0)
+        {
+            accumulate = 1;
+        }
+        else if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream = 1;
+        }
+        else if (strcmp(argv[i], "--check") == 0)
+        {
+            check = 1;
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (ndims == 0 || count == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (check) {
+        int ok = run_checks();
+        printf("%s\n", ok ? "All checks passed" : "Some checks FAILED");
+        return !ok;
+    }
+
+    unsigned int *idx = malloc(count * ndims * sizeof(unsigned int));
+    double *vals = malloc(count * sizeof(double));
+    if (!idx || !vals) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
+    }
+
+    srand(12345);
+    for (size_t z = 0; z < count; z++) {
+        for (unsigned int i = 0; i < ndims; i++) {
+            unsigned int r = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+            idx[z * ndims + i] = dims[i] ? r % dims[i] : 0;
+        }
+        vals[z] = (double)rand() / RAND_MAX;
+        if (drop_zeros && z % 4 == 3) {
+            vals[z] = 0.0;
+        }
+    }
+
+    if (stream) {
+        double *lat = malloc(count * sizeof(double));
+        if (!lat) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            return 1;
+        }
+        printf("Streaming insert benchmark: %zu nonzeros, %u modes\n", count, ndims);
+        bench_stream("rehash", ndims, dims, count, idx, vals, arena, lat);
+        bench_stream("incremental", ndims, dims, count, idx, vals,
+                     HACOO_INCREMENTAL | arena, lat);
+        free(lat);
+        free(idx);
+        free(vals);
+        return 0;
+    }
+
+    int max_threads = omp_get_max_threads();
+
+    if (accumulate) {
+        double *expected = malloc(count * sizeof(double));
+        char name[64];
+        if (!expected) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            return 1;
+        }
+        printf("Accumulate benchmark: %zu events, %u modes, %s storage\n", count,
+               ndims, storage);
+        flags = (flags & ~HACOO_FREEZE) | arena;
+        bench_accumulate("get+set", GET_SET, 1, ndims, dims, count, idx, vals,
+                         flags, expected);
+        bench_accumulate("accumulate_batch", BATCH, 1, ndims, dims, count, idx,
+                         vals, flags, expected);
+        for (int threads = 1; threads < max_threads; threads *= 2) {
+            sprintf(name, "accumulate_parallel x%d", threads);
+            bench_accumulate(name, PARALLEL, threads, ndims, dims, count, idx,
+                             vals, flags, expected);
+        }
+        sprintf(name, "accumulate_parallel x%d", max_threads);
+        bench_accumulate(name, PARALLEL, max_threads, ndims, dims, count, idx,
+                         vals, flags, expected);
+        free(expected);
+        free(idx);
+        free(vals);
+        return 0;
+    }
+
+    flags |= arena | drop_zeros;
+    printf("Build benchmark: %zu nonzeros, %u modes, %s storage%s%s\n", count,
+           ndims, storage, arena ? " in an arena" : "",
+           drop_zeros ? ", dropping zeros" : "");
+    if (drop_zeros && !check_build(ndims, dims, count, idx, vals, flags)) {
+        return 1;
+    }
+    for (int threads = 1; threads < max_threads; threads *= 2) {
+        bench_threads(threads, ndims, dims, count, idx, vals, flags);
+    }
+    bench_threads(max_threads, ndims, dims, count, idx, vals, flags);
+
+    free(idx);
+    free(vals);
+    return 0;
+}
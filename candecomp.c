@@ -10,7 +10,8 @@
 
 void print_usage(const char *program_name)
 {
-    printf("Usage: %s <filename> [--rank <rank>] [--max_iter <max_iter>]\n", program_name);
+    printf("Usage: %s <filename> [--rank <rank>] [--max_iter <max_iter>] [--memo <MB>]\n",
+           program_name);
 }
 
 int main(int argc, char *argv[])
@@ -36,6 +37,10 @@ int main(int argc, char *argv[])
         {
             max_iter = atoi(argv[++i]);
         }
+        else if (strcmp(argv[i], "--memo") == 0 && i + 1 < argc)
+        {
+            cpd_set_memo_budget(strtoull(argv[++i], NULL, 10) << 20);
+        }
         else
         {
             print_usage(argv[0]);
@@ -56,6 +61,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // CPD only reads the tensor, so pack it for streaming
+    if (hacoo_freeze(tensor))
+    {
+        fprintf(stderr, "Error freezing tensor\n");
+        return 1;
+    }
+
     // Perform CPD
     double tol = 1e-5;
     cpd_result_t *result= cpd(tensor, rank, max_iter, tol);
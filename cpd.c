@@ -1,15 +1,25 @@
 #include <math.h>
+#include <omp.h>
 #include "cpd.h"
 #include "hacoo.h"
 #include "matrix.h"
 #include "mttkrp.h"
+#include "dtree.h"
 
 #define GRAMREG 1e-8
 
+// bytes cpd may spend on a dimension tree, 0 for none
+static size_t memo_budget = 0;
+
 // static helper prototypes
 static void add_diagonal(matrix_t *matrix, double value);
 static void gram_product(matrix_t *res, matrix_t **factor, unsigned int modes, unsigned int mode);
-static cpd_result_t *cpd_alloc(struct hacoo_tensor *t, unsigned int rank);
+static cpd_result_t *cpd_alloc(unsigned int ndims, unsigned int *dims, unsigned int rank);
+static matrix_t *tensor_mttkrp(void *data, matrix_t **u, unsigned int n);
+static matrix_t *dtree_mttkrp(void *data, matrix_t **u, unsigned int n);
+static cpd_result_t *cpd_als(unsigned int ndims, unsigned int *dims, cpd_mttkrp_fn f,
+                             void *data, unsigned int rank, unsigned int max_iter,
+                             double tol, int owns_result);
 static double normalize_column(matrix_t *m, unsigned int col_idx, unsigned int iter);
 static void scale_factor_mode(cpd_result_t *result, unsigned int m, unsigned int iter);
 
@@ -54,16 +64,16 @@ static void gram_product(matrix_t *res, matrix_t **factor, unsigned int modes, u
 }
 
 
-static cpd_result_t *cpd_alloc(struct hacoo_tensor *t, unsigned int rank)
+static cpd_result_t *cpd_alloc(unsigned int ndims, unsigned int *dims, unsigned int rank)
 {
     cpd_result_t *result = calloc(1, sizeof(cpd_result_t));
     if (!result) { goto bad; }
 
     result->rank = rank;
-    result->ndims = t->ndims;
+    result->ndims = ndims;
 
     // Allocate list of pointers for factor matrices
-    result->factors = calloc(t->ndims, sizeof(matrix_t *));
+    result->factors = calloc(ndims, sizeof(matrix_t *));
     if(!result->factors) { goto bad; }
 
     // Allocate the lambda vector
@@ -75,9 +85,9 @@ static cpd_result_t *cpd_alloc(struct hacoo_tensor *t, unsigned int rank)
     }
 
     // Initialize the random arrays
-    for (unsigned int i = 0; i < t->ndims; i++)
+    for (unsigned int i = 0; i < ndims; i++)
     {
-        result->factors[i] = new_random_matrix(t->dims[i], rank, 0, 1);
+        result->factors[i] = new_random_matrix(dims[i], rank, 0, 1);
         if (!result->factors[i]) { goto bad; }
     }
 
@@ -132,26 +142,87 @@ static void scale_factor_mode(cpd_result_t *result, unsigned int m, unsigned int
 
 
 
+// MTTKRP into the workspace's result, which the workspace keeps
+static matrix_t *tensor_mttkrp(void *data, matrix_t **u, unsigned int n)
+{
+    return mttkrp_ws_run(data, u, n);
+}
+
+// MTTKRP from the dimension tree, which keeps the result
+static matrix_t *dtree_mttkrp(void *data, matrix_t **u, unsigned int n)
+{
+    return mttkrp_dtree_run(data, u, n);
+}
+
+void cpd_set_memo_budget(size_t bytes)
+{
+    memo_budget = bytes;
+}
+
+size_t cpd_get_memo_budget(void)
+{
+    return memo_budget;
+}
+
 // compute the canonical polyadic decomposition of a tensor
 cpd_result_t *cpd(struct hacoo_tensor *t, unsigned int rank, unsigned int max_iter, double tol)
+{
+    // memoize through a dimension tree if one fits in the budget
+    if (memo_budget && t->ndims >= 3) {
+        struct mttkrp_dtree *dt = mttkrp_dtree_alloc(t, rank, memo_budget);
+        if (dt) {
+            cpd_result_t *result = cpd_als(t->ndims, t->dims, dtree_mttkrp, dt, rank,
+                                           max_iter, tol, 0);
+            mttkrp_dtree_free(dt);
+            return result;
+        }
+        fprintf(stderr, "Warning: No dimension tree, running every MTTKRP in full.\n");
+    }
+
+    // every MTTKRP of the ALS loop reuses one set of buffers
+    struct mttkrp_ws *ws = mttkrp_ws_alloc(t, rank, omp_get_max_threads());
+    if (!ws) { return NULL; }
+
+    cpd_result_t *result = cpd_als(t->ndims, t->dims, tensor_mttkrp, ws, rank,
+                                   max_iter, tol, 0);
+    mttkrp_ws_free(ws);
+    return result;
+}
+
+// compute the decomposition of anything that can carry out MTTKRP
+cpd_result_t *cpd_generic(unsigned int ndims, unsigned int *dims, cpd_mttkrp_fn f,
+                          void *data, unsigned int rank, unsigned int max_iter,
+                          double tol)
+{
+    return cpd_als(ndims, dims, f, data, rank, max_iter, tol, 1);
+}
+
+// solve the CPD via ALS, freeing each MTTKRP result if f hands it over
+static cpd_result_t *cpd_als(unsigned int ndims, unsigned int *dims, cpd_mttkrp_fn f,
+                             void *data, unsigned int rank, unsigned int max_iter,
+                             double tol, int owns_result)
 {
     // initialize matrices
-    cpd_result_t *result = cpd_alloc(t, rank);
+    cpd_result_t *result = cpd_alloc(ndims, dims, rank);
     matrix_t *gram = new_matrix(rank, rank);
     matrix_t *grami = new_matrix(rank, rank);
-    double norm = frobenius_norm(t);
 
 
     // solve the CPD via ALS
     for (unsigned int iter = 0; iter < max_iter; iter++)
     {
-        for (unsigned int mode = 0; mode < t->ndims; mode++)
+        for (unsigned int mode = 0; mode < ndims; mode++)
         {
             // Compute MTTKRP for the current mode
-            matrix_t *mttkrp_result = mttkrp(t, result->factors, mode);
+            matrix_t *mttkrp_result = f(data, result->factors, mode);
+            if (!mttkrp_result) {
+                cpd_result_free(result);
+                result = NULL;
+                goto done;
+            }
 
             // Compute the gram product and its inverse
-            gram_product(gram, result->factors, t->ndims, mode);
+            gram_product(gram, result->factors, ndims, mode);
             //add_diagonal(gram, GRAMREG);
             invert_matrix(grami, gram);
 
@@ -164,13 +235,16 @@ printf("Iter %u, mode %u: mttkrp_result norm = %f\n", iter, mode, matrix_frobeni
 printf("Iter %u, mode %u: factor norm = %f\n", iter, mode, matrix_frobenius_norm(result->factors[mode]));
 //-- END DEBUGGING
 
-            free(mttkrp_result);
+            if (owns_result) {
+                free_matrix(mttkrp_result);
+            }
         }
 
         // Check for convergence (optional)
         // If converged, break the loop
     }
 
+done:
     free_matrix(gram);
     free_matrix(grami);
 
@@ -21,6 +21,38 @@ typedef struct cpd_result {
  */
 cpd_result_t *cpd(struct hacoo_tensor *t, unsigned int rank, unsigned int max_iter, double tol);
 
+/**
+ * @brief Let cpd memoize MTTKRP through a dimension tree (see dtree.h)
+ * of at most the given size. Tensors of three or more modes whose tree
+ * fits and saves work use it, others run every MTTKRP in full.
+ *
+ * @param bytes Memory the tree may take, 0 to turn memoization off (the default)
+ */
+void cpd_set_memo_budget(size_t bytes);
+size_t cpd_get_memo_budget(void);
+
+/**
+ * @brief MTTKRP of the data being decomposed along mode n, as a new matrix.
+ */
+typedef matrix_t *(*cpd_mttkrp_fn)(void *data, matrix_t **u, unsigned int n);
+
+/**
+ * @brief Compute the decomposition of data that is not a single hacoo
+ * tensor, such as a windowed tensor, through its MTTKRP.
+ *
+ * @param ndims Number of modes
+ * @param dims Size of each mode
+ * @param f MTTKRP of the data
+ * @param data Passed to f
+ * @param rank Number of factors to compute
+ * @param max_iter Maximum number of iterations
+ * @param tol Tolerance for convergence
+ * @return cpd_result_t* The decomposition
+ */
+cpd_result_t *cpd_generic(unsigned int ndims, unsigned int *dims, cpd_mttkrp_fn f,
+                          void *data, unsigned int rank, unsigned int max_iter,
+                          double tol);
+
 /**
  * @brief Free the memory allocated for the CPD result.
  * @param result Pointer to the cpd_result_t structure to free
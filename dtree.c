@@ -0,0 +1,627 @@
+/* File: dtree.c
+ * Purpose: Memoized MTTKRP for CPD-ALS over a two-level dimension tree.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include "dtree.h"
+#include "mttkrp.h"
+
+/* Columns of a rank vector handled at once in the memo and run loops */
+#define DTREE_CHUNK 8
+
+/* Tuples, or rows of a half's first mode, a thread takes at a time */
+#define DTREE_TUPLES 64
+
+typedef void (*memo_fn)(const struct mttkrp_dtree_side *s, matrix_t **u,
+                        unsigned int rank, size_t k0, size_t k1);
+typedef void (*tuples_fn)(const struct mttkrp_dtree_side *s, matrix_t **u,
+                          unsigned int rank, unsigned int j, size_t k0,
+                          size_t k1, matrix_t *res);
+
+/* Helper Function Prototypes */
+static int decode_nonzeros(struct hacoo_tensor *t, unsigned int **idx,
+                           double *value);
+static int side_group(struct hacoo_tensor *t, struct mttkrp_dtree_side *s,
+                      unsigned int first, unsigned int last,
+                      unsigned int **idx, unsigned int *perm,
+                      unsigned int *tmp);
+static size_t side_bytes(struct hacoo_tensor *t, struct mttkrp_dtree_side *s);
+static int side_fill(struct hacoo_tensor *t, struct mttkrp_dtree_side *s,
+                     unsigned int **idx, const double *value,
+                     const unsigned int *perm);
+static int sort_by_mode(const unsigned int *key, unsigned int dim, size_t n,
+                        unsigned int *perm, unsigned int *tmp);
+static void side_free(struct mttkrp_dtree_side *s);
+static void side_memo(struct mttkrp_dtree *dt, struct mttkrp_dtree_side *s,
+                      matrix_t **u);
+static void pick_kernels(memo_fn *memo, tuples_fn *tuples);
+static void side_run(struct mttkrp_dtree *dt, struct mttkrp_dtree_side *s,
+                     matrix_t **u, unsigned int j, matrix_t *res);
+static size_t side_cost(struct hacoo_tensor *t, struct mttkrp_dtree_side *s);
+static inline void memo_chunk(const struct mttkrp_dtree_side *s, matrix_t **u,
+                              size_t z, unsigned int f0, unsigned int w,
+                              double *memo);
+static inline void run_chunk(const struct mttkrp_dtree_side *s, matrix_t **u,
+                             size_t k, unsigned int j, unsigned int f0,
+                             unsigned int w, double *out);
+
+struct mttkrp_dtree *mttkrp_dtree_alloc(struct hacoo_tensor *t,
+                                        unsigned int rank, size_t budget)
+{
+    struct mttkrp_dtree *dt = NULL;
+    unsigned int *idx[t->ndims > 0 ? t->ndims : 1];
+    size_t n = t->nnz ? t->nnz : 1;
+    double *value = malloc(n * sizeof(double));
+    unsigned int *perm[2] = { malloc(n * sizeof(unsigned int)),
+                              malloc(n * sizeof(unsigned int)) };
+    unsigned int *tmp = malloc(n * sizeof(unsigned int));
+    int ok = value && perm[0] && perm[1] && tmp;
+
+    memset(idx, 0, sizeof(idx));
+    if (t->ndims < 2) {
+        fprintf(stderr, "Error: A dimension tree needs two or more modes.\n");
+        goto error;
+    }
+    for (unsigned int d = 0; d < t->ndims; d++) {
+        idx[d] = malloc(n * sizeof(unsigned int));
+        ok = ok && idx[d];
+    }
+    dt = calloc(1, sizeof(struct mttkrp_dtree));
+    if (!ok || !dt || decode_nonzeros(t, idx, value)) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        goto error;
+    }
+
+    dt->t = t;
+    dt->rank = rank;
+    dt->res = calloc(t->ndims, sizeof(matrix_t *));
+    if (!dt->res) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        goto error;
+    }
+
+    // Halves of the modes, the left one the smaller for odd counts. Sorting
+    // them gives the tuple counts, which size everything that follows, so
+    // the checks below run before any of it is allocated.
+    unsigned int split = t->ndims / 2;
+    if (side_group(t, &dt->side[0], 0, split, idx, perm[0], tmp) ||
+        side_group(t, &dt->side[1], split, t->ndims, idx, perm[1], tmp)) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        goto error;
+    }
+
+    // A sweep from the nonzeros takes about ndims + 1 row operations per
+    // nonzero and mode. Halves with nearly a tuple per nonzero save little,
+    // and reading their memo costs more than the nonzeros did.
+    size_t direct = (size_t)t->nnz * t->ndims * (t->ndims + 1);
+    size_t cost = side_cost(t, &dt->side[0]) + side_cost(t, &dt->side[1]);
+    if (cost > direct / 3 * 2) {
+        fprintf(stderr, "Warning: Dimension tree would not save work on "
+                "this tensor.\n");
+        goto error;
+    }
+
+    // Modes after the first of a half scatter into a partial result per
+    // thread, sized for the longest of them
+    unsigned int rows = 1;
+    for (int i = 0; i < 2; i++) {
+        for (unsigned int j = 1; j < dt->side[i].nmodes; j++) {
+            unsigned int dim = t->dims[dt->side[i].mode[j]];
+            rows = dim > rows ? dim : rows;
+        }
+    }
+    dt->nthreads = omp_get_max_threads();
+    // Each side's memo takes a rank vector per tuple on top of its indices
+    dt->bytes = side_bytes(t, &dt->side[0]) + side_bytes(t, &dt->side[1]);
+    dt->bytes += (size_t)(dt->nthreads - 1) * rows * rank * sizeof(double);
+    for (unsigned int d = 0; d < t->ndims; d++) {
+        dt->bytes += (size_t)t->dims[d] * rank * sizeof(double);
+    }
+    for (int i = 0; i < 2; i++) {
+        dt->bytes += dt->side[i].ntuples * rank * sizeof(double);
+    }
+    if (dt->bytes > budget) {
+        fprintf(stderr, "Warning: Dimension tree needs %zu bytes, over the "
+                "budget of %zu.\n", dt->bytes, budget);
+        goto error;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (side_fill(t, &dt->side[i], idx, value, perm[i])) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            goto error;
+        }
+        dt->side[i].memo = new_matrix(dt->side[i].ntuples ? dt->side[i].ntuples : 1,
+                                      rank);
+        if (!dt->side[i].memo) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            goto error;
+        }
+        dt->side[i].stale = 1;
+    }
+    dt->part = calloc(dt->nthreads, sizeof(matrix_t *));
+    if (!dt->part) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        goto error;
+    }
+    for (int i = 1; i < dt->nthreads; i++) {
+        dt->part[i] = new_matrix(rows, rank);
+        if (!dt->part[i]) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            goto error;
+        }
+        memset(dt->part[i]->data, 0, (size_t)rows * rank * sizeof(double));
+    }
+
+    for (unsigned int d = 0; d < t->ndims; d++) {
+        free(idx[d]);
+    }
+    free(value);
+    free(perm[0]);
+    free(perm[1]);
+    free(tmp);
+    return dt;
+
+error:
+    for (unsigned int d = 0; d < t->ndims; d++) {
+        free(idx[d]);
+    }
+    free(value);
+    free(perm[0]);
+    free(perm[1]);
+    free(tmp);
+    if (dt) {
+        mttkrp_dtree_free(dt);
+    }
+    return NULL;
+}
+
+void mttkrp_dtree_free(struct mttkrp_dtree *dt)
+{
+    if (dt->res) {
+        for (unsigned int d = 0; d < dt->t->ndims; d++) {
+            if (dt->res[d]) {
+                free_matrix(dt->res[d]);
+            }
+        }
+    }
+    if (dt->part) {
+        for (int i = 1; i < dt->nthreads; i++) {
+            if (dt->part[i]) {
+                free_matrix(dt->part[i]);
+            }
+        }
+    }
+    side_free(&dt->side[0]);
+    side_free(&dt->side[1]);
+    free(dt->part);
+    free(dt->res);
+    free(dt);
+}
+
+/* A half's memo sums over the other half's factors, so it goes stale once
+ * the factor of a mode of the other half is run and then updated */
+matrix_t *mttkrp_dtree_run(struct mttkrp_dtree *dt, matrix_t **u,
+                           unsigned int n)
+{
+    struct hacoo_tensor *t = dt->t;
+
+    if (n >= t->ndims || u[0]->cols != dt->rank) {
+        fprintf(stderr, "Error: Dimension tree is for rank %u.\n", dt->rank);
+        return NULL;
+    }
+    if (!dt->res[n]) {
+        dt->res[n] = new_matrix(t->dims[n], dt->rank);
+        if (!dt->res[n]) {
+            return NULL;
+        }
+    }
+
+    int i = n >= dt->side[0].nmodes;
+    struct mttkrp_dtree_side *s = &dt->side[i];
+    unsigned int j = n - s->mode[0];
+
+    if (s->stale) {
+        side_memo(dt, s, u);
+        s->stale = 0;
+    }
+    side_run(dt, s, u, j, dt->res[n]);
+    dt->side[!i].stale = 1;
+    return dt->res[n];
+}
+
+void mttkrp_dtree_invalidate(struct mttkrp_dtree *dt)
+{
+    dt->side[0].stale = 1;
+    dt->side[1].stale = 1;
+}
+
+/* Helper function implementations. */
+
+/* Indices and value of every nonzero of t, in hash order */
+static int decode_nonzeros(struct hacoo_tensor *t, unsigned int **idx,
+                           double *value)
+{
+    struct hacoo_block *block = malloc(sizeof(struct hacoo_block));
+    struct hacoo_cursor cursor;
+    unsigned int *out[t->ndims];
+    size_t z = 0;
+
+    if (!block) {
+        return -1;
+    }
+
+    hacoo_finish_rehash(t);
+    hacoo_cursor_init(t, &cursor, 0, t->nbuckets);
+    while (z < t->nnz && hacoo_next_block(t, &cursor, block)) {
+        for (unsigned int d = 0; d < t->ndims; d++) {
+            out[d] = &idx[d][z];
+        }
+        hacoo_block_indices(t, block, out);
+        memcpy(&value[z], block->value, block->count * sizeof(double));
+        z += block->count;
+    }
+
+    free(block);
+    return 0;
+}
+
+/* Sort the nonzeros into perm by tuple of modes first..last-1, the other
+ * modes kept per nonzero, and count the tuples. perm and tmp have room for
+ * every nonzero. Returns 0 on success, -1 on allocation failure. */
+static int side_group(struct hacoo_tensor *t, struct mttkrp_dtree_side *s,
+                      unsigned int first, unsigned int last,
+                      unsigned int **idx, unsigned int *perm,
+                      unsigned int *tmp)
+{
+    size_t nnz = t->nnz;
+
+    s->nmodes = last - first;
+    s->ncomp = t->ndims - s->nmodes;
+    s->mode = malloc(s->nmodes * sizeof(unsigned int));
+    s->comp = malloc(s->ncomp * sizeof(unsigned int));
+    if (!s->mode || !s->comp) {
+        return -1;
+    }
+    for (unsigned int d = 0, j = 0, c = 0; d < t->ndims; d++) {
+        if (d >= first && d < last) {
+            s->mode[j++] = d;
+        } else {
+            s->comp[c++] = d;
+        }
+    }
+
+    // Sort the nonzeros by tuple, one stable counting sort per mode from
+    // the last of the tuple to the first
+    for (size_t z = 0; z < nnz; z++) {
+        perm[z] = z;
+    }
+    for (unsigned int j = s->nmodes; j-- > 0;) {
+        if (sort_by_mode(idx[s->mode[j]], t->dims[s->mode[j]], nnz, perm, tmp)) {
+            return -1;
+        }
+    }
+
+    // Tuples start where any of their indices differ from the last nonzero
+    s->ntuples = 0;
+    for (size_t z = 0; z < nnz; z++) {
+        int fresh = z == 0;
+        for (unsigned int j = 0; !fresh && j < s->nmodes; j++) {
+            fresh = idx[s->mode[j]][perm[z]] != idx[s->mode[j]][perm[z - 1]];
+        }
+        s->ntuples += fresh;
+    }
+    return 0;
+}
+
+/* Bytes side_fill will allocate for a grouped half, not counting the memo */
+static size_t side_bytes(struct hacoo_tensor *t, struct mttkrp_dtree_side *s)
+{
+    size_t n = t->nnz ? t->nnz : 1;
+    size_t nt = s->ntuples ? s->ntuples : 1;
+
+    return n * (s->ncomp * sizeof(unsigned int) + sizeof(double)) +
+           (nt + 1) * sizeof(size_t) + nt * s->nmodes * sizeof(unsigned int) +
+           ((size_t)t->dims[s->mode[0]] + 1) * sizeof(size_t);
+}
+
+/* Lay out a grouped half in the tuple order of perm. Returns 0 on success,
+ * -1 on allocation failure. */
+static int side_fill(struct hacoo_tensor *t, struct mttkrp_dtree_side *s,
+                     unsigned int **idx, const double *value,
+                     const unsigned int *perm)
+{
+    size_t nnz = t->nnz, n = nnz ? nnz : 1;
+    size_t nt = s->ntuples ? s->ntuples : 1;
+    unsigned int first = s->mode[0];
+
+    s->tidx = calloc(s->nmodes, sizeof(unsigned int *));
+    s->cidx = calloc(s->ncomp, sizeof(unsigned int *));
+    s->rptr = calloc((size_t)t->dims[first] + 1, sizeof(size_t));
+    s->tptr = malloc((nt + 1) * sizeof(size_t));
+    s->value = malloc(n * sizeof(double));
+    if (!s->tidx || !s->cidx || !s->rptr || !s->tptr || !s->value) {
+        return -1;
+    }
+    for (unsigned int j = 0; j < s->nmodes; j++) {
+        s->tidx[j] = malloc(nt * sizeof(unsigned int));
+        if (!s->tidx[j]) {
+            return -1;
+        }
+    }
+    for (unsigned int c = 0; c < s->ncomp; c++) {
+        s->cidx[c] = malloc(n * sizeof(unsigned int));
+        if (!s->cidx[c]) {
+            return -1;
+        }
+    }
+
+    size_t tuple = 0;
+    for (size_t z = 0; z < nnz; z++) {
+        size_t p = perm[z];
+        int fresh = z == 0;
+        for (unsigned int j = 0; !fresh && j < s->nmodes; j++) {
+            fresh = idx[s->mode[j]][p] != idx[s->mode[j]][perm[z - 1]];
+        }
+        if (fresh) {
+            for (unsigned int j = 0; j < s->nmodes; j++) {
+                s->tidx[j][tuple] = idx[s->mode[j]][p];
+            }
+            s->tptr[tuple++] = z;
+        }
+        for (unsigned int c = 0; c < s->ncomp; c++) {
+            s->cidx[c][z] = idx[s->comp[c]][p];
+        }
+        s->value[z] = value[p];
+    }
+    s->tptr[s->ntuples] = nnz;
+
+    // Tuples are sorted by the first mode, so its rows are runs of them
+    for (size_t k = 0; k < s->ntuples; k++) {
+        s->rptr[s->tidx[0][k] + 1]++;
+    }
+    for (unsigned int i = 0; i < t->dims[first]; i++) {
+        s->rptr[i + 1] += s->rptr[i];
+    }
+    return 0;
+}
+
+/* Stable counting sort of perm by key[perm[z]] */
+static int sort_by_mode(const unsigned int *key, unsigned int dim, size_t n,
+                        unsigned int *perm, unsigned int *tmp)
+{
+    size_t *count = calloc((size_t)dim + 1, sizeof(size_t));
+
+    if (!count) {
+        return -1;
+    }
+    for (size_t z = 0; z < n; z++) {
+        count[key[perm[z]] + 1]++;
+    }
+    for (unsigned int i = 0; i < dim; i++) {
+        count[i + 1] += count[i];
+    }
+    for (size_t z = 0; z < n; z++) {
+        tmp[count[key[perm[z]]]++] = perm[z];
+    }
+    memcpy(perm, tmp, n * sizeof(unsigned int));
+    free(count);
+    return 0;
+}
+
+static void side_free(struct mttkrp_dtree_side *s)
+{
+    for (unsigned int j = 0; j < s->nmodes; j++) {
+        if (s->tidx) {
+            free(s->tidx[j]);
+        }
+    }
+    for (unsigned int c = 0; s->cidx && c < s->ncomp; c++) {
+        free(s->cidx[c]);
+    }
+    if (s->memo) {
+        free_matrix(s->memo);
+    }
+    free(s->mode);
+    free(s->comp);
+    free(s->tidx);
+    free(s->cidx);
+    free(s->rptr);
+    free(s->tptr);
+    free(s->value);
+}
+
+/* Add nonzero z times its factor rows of the other half into columns
+ * f0..f0+w-1 of memo. Called with w = DTREE_CHUNK the loops have a fixed
+ * length and the product stays in registers. */
+static inline void memo_chunk(const struct mttkrp_dtree_side *s, matrix_t **u,
+                              size_t z, unsigned int f0, unsigned int w,
+                              double *memo)
+{
+    double prod[DTREE_CHUNK];
+
+    for (unsigned int f = 0; f < w; f++) {
+        prod[f] = s->value[z];
+    }
+    for (unsigned int c = 0; c < s->ncomp; c++) {
+        const double *row = &u[s->comp[c]]->vals[s->cidx[c][z]][f0];
+        for (unsigned int f = 0; f < w; f++) {
+            prod[f] *= row[f];
+        }
+    }
+    for (unsigned int f = 0; f < w; f++) {
+        memo[f0 + f] += prod[f];
+    }
+}
+
+/* Add tuple k's memo times its factor rows of the half, but for mode[j],
+ * into columns f0..f0+w-1 of out */
+static inline void run_chunk(const struct mttkrp_dtree_side *s, matrix_t **u,
+                             size_t k, unsigned int j, unsigned int f0,
+                             unsigned int w, double *out)
+{
+    double prod[DTREE_CHUNK];
+    const double *memo = &s->memo->vals[k][f0];
+
+    for (unsigned int f = 0; f < w; f++) {
+        prod[f] = memo[f];
+    }
+    for (unsigned int q = 0; q < s->nmodes; q++) {
+        if (q == j) continue;
+        const double *row = &u[s->mode[q]]->vals[s->tidx[q][k]][f0];
+        for (unsigned int f = 0; f < w; f++) {
+            prod[f] *= row[f];
+        }
+    }
+    for (unsigned int f = 0; f < w; f++) {
+        out[f0 + f] += prod[f];
+    }
+}
+
+/* Loops over a range of tuples, in one version per kernel set so the
+ * fixed length chunks compile to that set's vectors. memo_ sums tuples
+ * k0..k1-1's nonzeros into their memo rows; tuples_ adds the same tuples
+ * along mode[j] into res. */
+#define DTREE_KERNELS(SET, TARGET)                                            \
+TARGET                                                                        \
+static void memo_##SET(const struct mttkrp_dtree_side *s, matrix_t **u,       \
+                       unsigned int rank, size_t k0, size_t k1)               \
+{                                                                             \
+    unsigned int full = rank / DTREE_CHUNK * DTREE_CHUNK;                     \
+                                                                              \
+    for (size_t k = k0; k < k1; k++) {                                        \
+        double *memo = s->memo->vals[k];                                      \
+                                                                              \
+        memset(memo, 0, rank * sizeof(double));                               \
+        for (size_t z = s->tptr[k]; z < s->tptr[k + 1]; z++) {                \
+            for (unsigned int f0 = 0; f0 < full; f0 += DTREE_CHUNK) {         \
+                memo_chunk(s, u, z, f0, DTREE_CHUNK, memo);                   \
+            }                                                                 \
+            if (full < rank) {                                                \
+                memo_chunk(s, u, z, full, rank - full, memo);                 \
+            }                                                                 \
+        }                                                                     \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+TARGET                                                                        \
+static void tuples_##SET(const struct mttkrp_dtree_side *s, matrix_t **u,     \
+                         unsigned int rank, unsigned int j, size_t k0,        \
+                         size_t k1, matrix_t *res)                            \
+{                                                                             \
+    unsigned int full = rank / DTREE_CHUNK * DTREE_CHUNK;                     \
+                                                                              \
+    for (size_t k = k0; k < k1; k++) {                                        \
+        double *out = res->vals[s->tidx[j][k]];                               \
+                                                                              \
+        for (unsigned int f0 = 0; f0 < full; f0 += DTREE_CHUNK) {             \
+            run_chunk(s, u, k, j, f0, DTREE_CHUNK, out);                      \
+        }                                                                     \
+        if (full < rank) {                                                    \
+            run_chunk(s, u, k, j, full, rank - full, out);                    \
+        }                                                                     \
+    }                                                                         \
+}
+
+DTREE_KERNELS(scalar, )
+DTREE_KERNELS(avx2, __attribute__((target("avx2,fma"))))
+DTREE_KERNELS(avx512, __attribute__((target("avx512f"))))
+
+/* Tuple loops of the kernel set mttkrp uses */
+static void pick_kernels(memo_fn *memo, tuples_fn *tuples)
+{
+    switch (mttkrp_get_kernel()) {
+    case MTTKRP_KERNEL_AVX512:
+        *memo = memo_avx512;
+        *tuples = tuples_avx512;
+        break;
+    case MTTKRP_KERNEL_AVX2:
+        *memo = memo_avx2;
+        *tuples = tuples_avx2;
+        break;
+    default:
+        *memo = memo_scalar;
+        *tuples = tuples_scalar;
+        break;
+    }
+}
+
+/* Sum each tuple's nonzeros times their factor rows of the other half.
+ * Tuples own their memo rows, so threads take whole blocks of them. */
+static void side_memo(struct mttkrp_dtree *dt, struct mttkrp_dtree_side *s,
+                      matrix_t **u)
+{
+    memo_fn memo;
+    tuples_fn tuples;
+    size_t nblocks = (s->ntuples + DTREE_TUPLES - 1) / DTREE_TUPLES;
+
+    pick_kernels(&memo, &tuples);
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(dt->nthreads)
+    for (size_t b = 0; b < nblocks; b++) {
+        size_t k0 = b * DTREE_TUPLES;
+        size_t k1 = k0 + DTREE_TUPLES < s->ntuples ? k0 + DTREE_TUPLES : s->ntuples;
+        memo(s, u, dt->rank, k0, k1);
+    }
+}
+
+/* Row operations of a sweep over the modes of a half: rebuilding the memo
+ * and, per mode, a product and add for each tuple. Memo rows are too many
+ * to stay in cache, so writing and reading one counts as two. */
+static size_t side_cost(struct hacoo_tensor *t, struct mttkrp_dtree_side *s)
+{
+    return (size_t)t->nnz * (s->ncomp + 1) +
+           s->ntuples * (s->nmodes * (s->nmodes + 1) + 2 * (s->nmodes + 1));
+}
+
+/* MTTKRP along mode[j] of the half from its memo, which is always read in
+ * tuple order. Tuples are sorted by the first mode, so along it threads
+ * own rows of the result. Along the others threads take ranges of tuples
+ * and add into their own partial results, merged at the end. */
+static void side_run(struct mttkrp_dtree *dt, struct mttkrp_dtree_side *s,
+                     matrix_t **u, unsigned int j, matrix_t *res)
+{
+    unsigned int rank = dt->rank;
+    unsigned int rows = dt->t->dims[s->mode[j]];
+    memo_fn memo;
+    tuples_fn tuples;
+
+    pick_kernels(&memo, &tuples);
+    memset(res->data, 0, (size_t)rows * rank * sizeof(double));
+
+    #pragma omp parallel num_threads(dt->nthreads)
+    {
+        int tid = omp_get_thread_num();
+
+        if (j == 0) {
+            #pragma omp for schedule(dynamic, 1)
+            for (unsigned int i = 0; i < rows; i += DTREE_TUPLES) {
+                unsigned int end = rows - i > DTREE_TUPLES ? i + DTREE_TUPLES : rows;
+                tuples(s, u, rank, 0, s->rptr[i], s->rptr[end], res);
+            }
+        } else {
+            int nth = omp_get_num_threads();
+            size_t k0 = s->ntuples * tid / nth;
+            size_t k1 = s->ntuples * (tid + 1) / nth;
+
+            tuples(s, u, rank, j, k0, k1, tid ? dt->part[tid] : res);
+            #pragma omp barrier
+
+            // Merge the partials into the result, each thread taking a
+            // range of rows
+            #pragma omp for schedule(static)
+            for (unsigned int i = 0; i < rows; i++) {
+                double *out = res->vals[i];
+
+                for (int p = 1; p < dt->nthreads; p++) {
+                    double *row = dt->part[p]->vals[i];
+                    for (unsigned int f = 0; f < rank; f++) {
+                        out[f] += row[f];
+                        row[f] = 0.0;
+                    }
+                }
+            }
+        }
+    }
+}
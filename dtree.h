@@ -0,0 +1,66 @@
+/* File: dtree.h
+ * Purpose: Memoized MTTKRP for CPD-ALS over a two-level dimension tree.
+ *
+ * The modes are split into a left half, modes 0..m-1, and a right half,
+ * modes m..N-1. Each half keeps one row per distinct tuple of its own
+ * indices among the nonzeros, holding the sum of those nonzeros times the
+ * factor rows of the other half. MTTKRP along a mode of a half then only
+ * multiplies each tuple's row by the factor rows of its own half.
+ *
+ * ALS changes one factor after each MTTKRP, so a half's rows stay valid
+ * while the modes of that half are updated, and are rebuilt once per
+ * sweep. That saves work when each half has far fewer distinct tuples
+ * than the tensor has nonzeros, and the tree is not built when it would
+ * not.
+ */
+#ifndef DTREE_H
+#define DTREE_H
+#include "hacoo.h"
+#include "matrix.h"
+
+/* One half of the tree */
+struct mttkrp_dtree_side {
+    unsigned int nmodes; //modes whose indices make a tuple
+    unsigned int *mode;
+    unsigned int ncomp; //modes of the other half, summed into the memo
+    unsigned int *comp;
+    size_t ntuples; //distinct tuples among the nonzeros
+    unsigned int **tidx; //tidx[j][t] is tuple t's index in mode[j]
+    size_t *tptr; //nonzeros of tuple t are tptr[t] to tptr[t+1]
+    unsigned int **cidx; //cidx[c][z] is nonzero z's index in comp[c]
+    double *value; //value of each nonzero, grouped by tuple
+    size_t *rptr; //tuples with index i in mode[0] are rptr[i] to rptr[i+1]
+    matrix_t *memo; //row t is the sum over tuple t's nonzeros
+    int stale; //the memo must be rebuilt before its next use
+};
+
+struct mttkrp_dtree {
+    struct hacoo_tensor *t;
+    unsigned int rank;
+    size_t bytes; //memory held by the tree and its results
+    struct mttkrp_dtree_side side[2]; //left and right halves
+    matrix_t **res; //result of each mode, NULL until its first run
+    int nthreads;
+    matrix_t **part; //partial results of threads 1.. for scattered modes
+};
+
+/* Build the tree of t for the given rank. Returns NULL if t has fewer than
+ * two modes, if the tree would not save work over running every mode from
+ * the nonzeros, if it would take more than budget bytes, or on allocation
+ * failure. */
+struct mttkrp_dtree *mttkrp_dtree_alloc(struct hacoo_tensor *t,
+                                        unsigned int rank, size_t budget);
+void mttkrp_dtree_free(struct mttkrp_dtree *dt);
+
+/* MTTKRP of the tree's tensor along mode n, as mttkrp. The result belongs
+ * to the tree and is overwritten by the next run of the same mode.
+ * Between runs the caller may change only the factor of the mode it last
+ * ran, as ALS does; otherwise call mttkrp_dtree_invalidate. Returns NULL
+ * if u has the wrong rank or a result cannot be made. */
+matrix_t *mttkrp_dtree_run(struct mttkrp_dtree *dt, matrix_t **u,
+                           unsigned int n);
+
+/* Rebuild both halves on their next use */
+void mttkrp_dtree_invalidate(struct mttkrp_dtree *dt);
+
+#endif
@@ -0,0 +1,148 @@
+/* Benchmark for batched lookups.
+ *
+ * Builds a tensor from random COO entries, then looks up a shuffled mix
+ * of stored and absent indices with a loop of hacoo_get and with
+ * hacoo_get_batch, and reports the time per lookup of each.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hacoo.h"
+
+#define DEFAULT_COUNT (1 << 22)
+#define MAX_MODES 64
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [--count <nonzeros>] [--queries <lookups>] "
+           "[--dims <I,J,K,...>] [--storage chained|flat|frozen]\n",
+           program_name);
+}
+
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static unsigned int random_index(unsigned int dim)
+{
+    unsigned int r = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+    return dim ? r % dim : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = DEFAULT_COUNT;
+    size_t queries = DEFAULT_COUNT;
+    unsigned int dims[MAX_MODES] = {183, 24, 1140, 1717};
+    unsigned int ndims = 4;
+    unsigned int flags = HACOO_CHAINED;
+    const char *storage = "chained";
+    struct timespec start, end;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+        {
+            count = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc)
+        {
+            queries = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--dims") == 0 && i + 1 < argc)
+        {
+            const char *p = argv[++i];
+            for (ndims = 0; *p && ndims < MAX_MODES; ndims++) {
+                char *next;
+                dims[ndims] = strtoul(p, &next, 10);
+                p = *next == ',' ? next + 1 : next;
+            }
+        }
+        else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc)
+        {
+            storage = argv[++i];
+            if (strcmp(storage, "flat") == 0) {
+                flags = HACOO_FLAT;
+            } else if (strcmp(storage, "frozen") == 0) {
+                flags = HACOO_FREEZE;
+            } else if (strcmp(storage, "chained") != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (ndims == 0 || count == 0 || queries == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    unsigned int *idx = malloc(count * ndims * sizeof(unsigned int));
+    double *vals = malloc(count * sizeof(double));
+    unsigned int *query = malloc(queries * ndims * sizeof(unsigned int));
+    double *expected = malloc(queries * sizeof(double));
+    double *out = malloc(queries * sizeof(double));
+    if (!idx || !vals || !query || !expected || !out) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
+    }
+
+    srand(12345);
+    for (size_t z = 0; z < count; z++) {
+        for (unsigned int i = 0; i < ndims; i++) {
+            idx[z * ndims + i] = random_index(dims[i]);
+        }
+        vals[z] = (double)rand() / RAND_MAX + 1.0;
+    }
+
+    struct hacoo_tensor *t = hacoo_build_from_coo(ndims, dims, count, idx, vals,
+                                                  flags);
+    if (!t) {
+        fprintf(stderr, "Error: Build failed.\n");
+        return 1;
+    }
+
+    // Three quarters of the lookups hit a stored entry, in random order
+    for (size_t q = 0; q < queries; q++) {
+        size_t z = ((size_t)rand() << 16 ^ (size_t)rand()) % count;
+        for (unsigned int i = 0; i < ndims; i++) {
+            query[q * ndims + i] = rand() % 4 ? idx[z * ndims + i]
+                                              : random_index(dims[i]);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t q = 0; q < queries; q++) {
+        expected[q] = hacoo_get(t, &query[q * ndims]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t_loop = elapsed(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    hacoo_get_batch(t, queries, query, out);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t_batch = elapsed(&start, &end);
+
+    int ok = memcmp(out, expected, queries * sizeof(double)) == 0;
+
+    printf("Lookup benchmark: %zu lookups in %u nonzeros, %u modes, %s storage\n",
+           queries, t->nnz, ndims, storage);
+    printf("hacoo_get       %8.2f ns/lookup\n", t_loop * 1e9 / queries);
+    printf("hacoo_get_batch %8.2f ns/lookup   %.2fx   %s\n",
+           t_batch * 1e9 / queries, t_loop / t_batch, ok ? "ok" : "MISMATCH");
+
+    hacoo_free(t);
+    free(idx);
+    free(vals);
+    free(query);
+    free(expected);
+    free(out);
+    return 0;
+}
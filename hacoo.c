@@ -2,7 +2,9 @@
  * Purpose: Implementation of the hacoo sparse tensor library.
  */
 #include "hacoo.h"
+#include "morton.h"
 #include <math.h>
+#include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -10,29 +12,251 @@
 
 #define LOAD 70
 #define MIN_BUCKETS 128
+#define MAX_DIST 255 /* largest probe distance a flat slot can record */
+#define MIGRATE_BUCKETS 4 /* old buckets moved per write during an incremental rehash */
+#define PREFETCH_AHEAD 8 /* batched lookups between prefetching entries and using them */
+#define RADIX_BITS 8 /* bits of the morton code sorted per Z-order radix pass */
+#define RADIX (1 << RADIX_BITS)
 
 /* Helper Function Prototypes */
 static void hacoo_free_buckets(struct hacoo_tensor *t);
 static void free_buckets(bucket_vector *buckets, size_t nbuckets);
-static uint64_t hacoo_morton(unsigned int n, unsigned int *index);
+static struct hacoo_tensor *hacoo_alloc_meta(unsigned int ndims,
+                                             unsigned int *dims,
+                                             size_t nbuckets, unsigned int load,
+                                             unsigned int flags);
+static uint64_t hacoo_morton(struct hacoo_tensor *t, const unsigned int *index,
+                             uint64_t *hi);
+static size_t hacoo_coo_bucket(struct hacoo_tensor *t, const uint64_t *code,
+                               const uint64_t *code_hi, size_t z);
+static int coo_scatter(struct hacoo_tensor *t, const uint64_t *code,
+                       const uint64_t *code_hi, const double *vals, size_t nnz);
+static size_t coo_sort_part(struct hacoo_tensor *t, const uint64_t *stage,
+                            const uint64_t *stage_hi, const double *stage_value,
+                            size_t first, size_t last, size_t b0, size_t b1);
+static unsigned int *read_dims(FILE *file, unsigned int *ndims);
 static size_t hacoo_bucket_index(struct hacoo_tensor *t,
                                  unsigned long long morton);
+static size_t old_bucket_index(struct hacoo_tensor *t,
+                               unsigned long long morton);
+static size_t shift_hash(unsigned long long morton, unsigned int sx,
+                         unsigned int sy, unsigned int sz, size_t nbuckets);
+static bucket_vector *chained_home(struct hacoo_tensor *t,
+                                   unsigned long long morton);
+static void chained_set(struct hacoo_tensor *t, unsigned long long morton,
+                        double value, hacoo_combiner combine);
+static int chained_resize(struct hacoo_tensor *t, size_t nbuckets);
+static int chained_start_resize(struct hacoo_tensor *t, size_t nbuckets);
+static void chained_migrate(struct hacoo_tensor *t, size_t nmigrate);
+static int bucket_upsert(bucket_vector *vec, unsigned long long morton,
+                         double value, hacoo_combiner combine, int drop_zeros,
+                         struct vector_arena *arena);
+static int wide_bucket_upsert(wide_bucket_vector *vec, const uint64_t *code,
+                              double value, hacoo_combiner combine,
+                              int drop_zeros, struct vector_arena *arena);
+static size_t *group_by_part(struct hacoo_tensor *t, const uint64_t *code,
+                             const uint64_t *code_hi, size_t count,
+                             size_t nparts, size_t *part_start);
+static int bucket_remove(bucket_vector *vec, unsigned long long morton);
+static int wide_bucket_remove(wide_bucket_vector *vec, const uint64_t *code);
+static int flat_remove(struct hacoo_tensor *t, unsigned long long morton);
+static void flat_erase(struct hacoo_tensor *t, struct hacoo_bucket *b);
+static double hacoo_lookup(struct hacoo_tensor *t, uint64_t morton,
+                           uint64_t morton_hi);
+static const void *lookup_head(struct hacoo_tensor *t, uint64_t morton,
+                               uint64_t morton_hi);
+static void prefetch_entries(struct hacoo_tensor *t, const void *head);
 static void hacoo_compute_params(struct hacoo_tensor *t);
+static void drop_indexes(struct hacoo_tensor *t);
+static void drop_prefix(struct hacoo_tensor *t);
+static const size_t *bucket_prefix(struct hacoo_tensor *t);
+static void csf_free(struct hacoo_csf *csf, unsigned int nlevels);
+static void rowpart_free(struct hacoo_rowpart *rp);
+static struct hacoo_rowpart *rowpart_build(struct hacoo_tensor *t,
+                                           unsigned int mode,
+                                           unsigned int nparts);
+static struct hacoo_csf *csf_build(struct hacoo_tensor *t, unsigned int root);
+static int csf_fill(struct hacoo_csf *csf, const uint64_t *key,
+                    const uint64_t *key_hi, const unsigned int *shift,
+                    const unsigned int *width, size_t nnz);
+static void zorder_gather(struct hacoo_tensor *t, uint64_t *morton,
+                          uint64_t *morton_hi, double *value);
+static void radix_pass(size_t nnz, const uint64_t *key,
+                       const uint64_t *key_hi, const double *value,
+                       uint64_t *out, uint64_t *out_hi, double *out_value,
+                       unsigned int bit, size_t *count);
+static int radix_sort(size_t nnz, uint64_t **key, uint64_t **key_hi,
+                      double **value, unsigned int bits);
+static unsigned int code_bits(struct hacoo_tensor *t);
+static size_t bucket_size(struct hacoo_tensor *t, size_t i);
 static struct hacoo_bucket *hacoo_bucket_search(bucket_vector *vec,
                                                 unsigned long long morton);
-static size_t hacoo_max_bits(unsigned int n);
+static struct hacoo_bucket *flat_search(struct hacoo_tensor *t,
+                                        unsigned long long morton);
+static int flat_insert(struct hacoo_tensor *t, struct hacoo_bucket *b);
+static void flat_set(struct hacoo_tensor *t, unsigned long long morton,
+                     double value, hacoo_combiner combine);
+static int flat_resize(struct hacoo_tensor *t, size_t nslots);
+static double *frozen_search(struct hacoo_tensor *t, unsigned long long morton);
+static unsigned int hacoo_mode_bits(unsigned int ndims, unsigned int *dims,
+                                    unsigned int *bits);
+static void hacoo_fit_bits(unsigned int ndims, unsigned int *bits,
+                           unsigned int total);
+static size_t wide_bucket_index(struct hacoo_tensor *t, const uint64_t *code);
+static struct hacoo_wide_bucket *wide_bucket_search(wide_bucket_vector *vec,
+                                                    const uint64_t *code);
+static double *frozen_search_wide(struct hacoo_tensor *t, const uint64_t *code);
+static void wide_set(struct hacoo_tensor *t, const uint64_t *code,
+                     double value, hacoo_combiner combine);
+static int wide_resize(struct hacoo_tensor *t, size_t nbuckets);
 
 /* Allocation and deallocation functions */
 struct hacoo_tensor *hacoo_alloc(unsigned int ndims, unsigned int *dims,
                                  size_t nbuckets, unsigned int load)
 {
-  struct hacoo_tensor *t = malloc(sizeof(struct hacoo_tensor));
+  return hacoo_alloc_flags(ndims, dims, nbuckets, load, HACOO_CHAINED);
+}
+
+struct hacoo_tensor *hacoo_alloc_flags(unsigned int ndims, unsigned int *dims,
+                                       size_t nbuckets, unsigned int load,
+                                       unsigned int flags)
+{
+  struct hacoo_tensor *t = hacoo_alloc_meta(ndims, dims, nbuckets, load, flags);
+
+  if (t == NULL) {
+    return NULL;
+  }
+
+  if (t->flags & HACOO_WIDE) {
+    t->wide_buckets = malloc(nbuckets * sizeof(wide_bucket_vector));
+    if (!t->wide_buckets) {
+      goto error;
+    }
+    // Arena buckets start empty and take their first block on first insert
+    for (size_t i = 0; i < nbuckets; ++i) {
+      t->wide_buckets[i] = t->arena ? (wide_bucket_vector){0}
+                                    : wide_bucket_vector_create();
+    }
+  } else if (t->arena) {
+    t->buckets = calloc(nbuckets, sizeof(bucket_vector));
+    if (!t->buckets) {
+      goto error;
+    }
+  } else if (t->flags & HACOO_FLAT) {
+    // One contiguous table of slots, all initially empty
+    t->slots = malloc(nbuckets * sizeof(struct hacoo_bucket));
+    t->dist = calloc(nbuckets, sizeof(unsigned char));
+    if (!t->slots || !t->dist) {
+      goto error;
+    }
+  } else {
+    // Allocate array of bucket_vector structs
+    t->buckets = malloc(nbuckets * sizeof(bucket_vector));
+    if (!t->buckets) {
+      goto error;
+    }
+
+    // Initialize each bucket_vector
+    for (size_t i = 0; i < nbuckets; ++i) {
+      t->buckets[i] = bucket_vector_create();
+    }
+  }
+
+  return t;
+
+error:
+  hacoo_free(t);
+  return NULL;
+}
+
+/* Build a tensor from nnz COO entries. The table is sized from nnz once,
+ * every index is encoded and hashed in a counting pass and then scattered
+ * into the packed layout of a frozen tensor, so nothing is rehashed. */
+struct hacoo_tensor *hacoo_build_from_coo(unsigned int ndims, unsigned int *dims,
+                                          size_t nnz, const unsigned int *idx,
+                                          const double *vals, unsigned int flags)
+{
+  size_t nbuckets = (size_t)((double)nnz * 100.0 / LOAD) + 1;
+  if (nbuckets < MIN_BUCKETS) {
+    nbuckets = MIN_BUCKETS;
+  }
+
+  struct hacoo_tensor *t = hacoo_alloc_meta(ndims, dims, nbuckets, LOAD,
+                                            flags & ~HACOO_FREEZE);
+  if (t == NULL) {
+    return NULL;
+  }
+
+  // Robin Hood placement is sequential, but the presized table never grows
+  if (t->flags & HACOO_FLAT) {
+    t->slots = malloc(nbuckets * sizeof(struct hacoo_bucket));
+    t->dist = calloc(nbuckets, sizeof(unsigned char));
+    if (!t->slots || !t->dist) {
+      goto error;
+    }
+    for (size_t z = 0; z < nnz; z++) {
+      // Setting a zero is a removal, as in hacoo_set
+      flat_set(t, hacoo_morton(t, &idx[z * ndims], NULL), vals[z], NULL);
+    }
+    if ((flags & HACOO_FREEZE) && hacoo_freeze(t)) {
+      goto error;
+    }
+    return t;
+  }
+
+  int wide = (t->flags & HACOO_WIDE) != 0;
+  size_t n = nnz ? nnz : 1;
+  uint64_t *code = malloc(n * sizeof(uint64_t));
+  uint64_t *code_hi = wide ? malloc(n * sizeof(uint64_t)) : NULL;
+  if (!code || (wide && !code_hi)) {
+    free(code);
+    free(code_hi);
+    goto error;
+  }
+
+  // Encoding is independent per entry
+  #pragma omp parallel for schedule(static)
+  for (size_t z = 0; z < nnz; z++) {
+    code[z] = hacoo_morton(t, &idx[z * ndims], wide ? &code_hi[z] : NULL);
+  }
+
+  int rc = coo_scatter(t, code, code_hi, vals, nnz);
+  free(code);
+  free(code_hi);
+  if (rc) {
+    goto error;
+  }
+
+  if (!(flags & HACOO_FREEZE) && hacoo_thaw(t)) {
+    goto error;
+  }
+  return t;
+
+error:
+  fprintf(stderr, "Error: Failed to build tensor from COO arrays.\n");
+  hacoo_free(t);
+  return NULL;
+}
+
+/* Allocate a tensor and its code layout, but no storage for entries */
+static struct hacoo_tensor *hacoo_alloc_meta(unsigned int ndims,
+                                             unsigned int *dims,
+                                             size_t nbuckets, unsigned int load,
+                                             unsigned int flags)
+{
+  struct hacoo_tensor *t = calloc(1, sizeof(struct hacoo_tensor));
+  unsigned int bits[MORTON_MAX_MODES];
 
   /* handle allocation error */
   if (t == NULL) {
     goto error;
   }
 
+  if (ndims == 0 || ndims > MORTON_MAX_MODES) {
+    fprintf(stderr, "Error: Tensors must have 1 to %d modes.\n", MORTON_MAX_MODES);
+    goto error;
+  }
+
   /* initialize tensor fields */
   t->ndims = ndims;
   t->dims = calloc(ndims, sizeof(unsigned int));
@@ -41,135 +265,2186 @@ struct hacoo_tensor *hacoo_alloc(unsigned int ndims, unsigned int *dims,
   }
   memcpy(t->dims, dims, sizeof(unsigned int) * ndims);
 
+  // Give each mode only the bits its size needs. Codes that do not fit in
+  // 64 bits switch to two words, which always use chained buckets.
+  unsigned int total = hacoo_mode_bits(ndims, dims, bits);
+  if (total > 64) {
+    flags |= HACOO_WIDE;
+  }
+  if (flags & HACOO_WIDE) {
+    flags &= ~HACOO_FLAT;
+  }
+  if (total > 128) {
+    fprintf(stderr, "Warning: %u-mode indices need %u bits but morton codes "
+            "hold 128, some indices will collide.\n", ndims, total);
+    hacoo_fit_bits(ndims, bits, 128);
+  }
+
+  t->layout = malloc(sizeof(struct morton_layout));
+  if (!t->layout || morton_layout_init(t->layout, ndims, bits)) {
+    goto error;
+  }
+
+  // Flat tables have no bucket vectors to put in an arena
+  if ((flags & HACOO_ARENA) && !(flags & HACOO_FLAT)) {
+    t->arena = malloc(sizeof(struct vector_arena));
+    if (!t->arena) {
+      goto error;
+    }
+    vector_arena_init(t->arena);
+  }
+
+  t->flags = flags;
   t->nbuckets = nbuckets;
   t->load = load;
   t->nnz = 0;
 
-  // Allocate array of bucket_vector structs
-  t->buckets = malloc(nbuckets * sizeof(bucket_vector));
-  if (!t->buckets) {
+  hacoo_compute_params(t);
+  return t;
+
+error:
+  if (t) {
+    hacoo_free(t);
+  }
+  return NULL;
+}
+
+void hacoo_free(struct hacoo_tensor *t)
+{
+  if (t->dims) {free(t->dims);}
+  free(t->layout);
+  if (t->buckets || t->slots || t->wide_buckets) {hacoo_free_buckets(t);}
+  free(t->arena);
+  drop_indexes(t);
+  if (t->offsets) {
+    free(t->packed_morton);
+    free(t->packed_morton_hi);
+    free(t->packed_value);
+    free(t->offsets);
+  }
+  free(t);
+}
+
+/* Access functions */
+void hacoo_set(struct hacoo_tensor *t, unsigned int *index, double value)
+{
+  hacoo_accumulate(t, index, value, NULL);
+}
+
+void hacoo_accumulate(struct hacoo_tensor *t, unsigned int *index,
+                      double value, hacoo_combiner combine)
+{
+  // Writes go to the mutable storage
+  if (t->offsets && hacoo_thaw(t)) {
+    fprintf(stderr, "Failed to thaw frozen tensor.\n");
+    return;
+  }
+  drop_indexes(t);
+
+  // Under HACOO_DROP_ZEROS the set functions erase an entry that comes
+  // to zero from the slot they found it in
+  if (t->flags & HACOO_WIDE) {
+    uint64_t code[2];
+    code[0] = hacoo_morton(t, index, &code[1]);
+    wide_set(t, code, value, combine);
+  } else if (t->flags & HACOO_FLAT) {
+    flat_set(t, hacoo_morton(t, index, NULL), value, combine);
+  } else {
+    chained_set(t, hacoo_morton(t, index, NULL), value, combine);
+  }
+}
+
+int hacoo_remove(struct hacoo_tensor *t, unsigned int *index)
+{
+  int removed;
+
+  if (t->offsets && hacoo_thaw(t)) {
+    fprintf(stderr, "Failed to thaw frozen tensor.\n");
+    return -1;
+  }
+  drop_indexes(t);
+
+  if (t->flags & HACOO_WIDE) {
+    uint64_t code[2];
+    code[0] = hacoo_morton(t, index, &code[1]);
+    removed = wide_bucket_remove(&t->wide_buckets[wide_bucket_index(t, code)],
+                                 code);
+  } else if (t->flags & HACOO_FLAT) {
+    removed = flat_remove(t, hacoo_morton(t, index, NULL));
+  } else {
+    unsigned long long morton = hacoo_morton(t, index, NULL);
+    if (t->old_buckets) {
+      chained_migrate(t, MIGRATE_BUCKETS);
+    }
+    removed = bucket_remove(chained_home(t, morton), morton);
+  }
+
+  t->nnz -= removed;
+  return removed;
+}
+
+int hacoo_shrink_to_fit(struct hacoo_tensor *t)
+{
+  // A frozen tensor already holds exactly its entries
+  if (t->offsets) {
+    return 0;
+  }
+  hacoo_finish_rehash(t);
+
+  size_t nbuckets = (size_t)((double)t->nnz * 100.0 / t->load) + 1;
+  if (nbuckets < MIN_BUCKETS) {
+    nbuckets = MIN_BUCKETS;
+  }
+  if (nbuckets < t->nbuckets) {
+    int rc;
+    if (t->flags & HACOO_WIDE) {
+      rc = wide_resize(t, nbuckets);
+    } else if (t->flags & HACOO_FLAT) {
+      rc = flat_resize(t, nbuckets);
+    } else {
+      rc = chained_resize(t, nbuckets);
+    }
+    if (rc) {
+      return -1;
+    }
+  }
+
+  if (t->flags & HACOO_FLAT) {
+    return 0;
+  }
+
+  // Arena buckets move into a fresh arena so all the old slabs can go
+  if (t->arena) {
+    struct vector_arena fresh;
+    vector_arena_init(&fresh);
+    for (size_t i = 0; i < t->nbuckets; i++) {
+      if (t->flags & HACOO_WIDE) {
+        wide_bucket_vector *old = &t->wide_buckets[i];
+        wide_bucket_vector vec = {0};
+        if (wide_bucket_vector_reserve_in(&vec, old->size, &fresh)) {
+          goto error;
+        }
+        // An empty bucket reserves nothing and has no data to copy
+        if (old->size) {
+          memcpy(vec.data, old->data, old->size * sizeof(struct hacoo_wide_bucket));
+        }
+        vec.size = old->size;
+        *old = vec;
+      } else {
+        bucket_vector *old = &t->buckets[i];
+        bucket_vector vec = {0};
+        if (bucket_vector_reserve_in(&vec, old->size, &fresh)) {
+          goto error;
+        }
+        // An empty bucket reserves nothing and has no data to copy
+        if (old->size) {
+          memcpy(vec.data, old->data, old->size * sizeof(struct hacoo_bucket));
+        }
+        vec.size = old->size;
+        *old = vec;
+      }
+    }
+    vector_arena_clear(t->arena);
+    *t->arena = fresh;
+    return 0;
+
+error:
+    // Buckets already moved live in the fresh slabs, which the tensor
+    // takes over alongside its own
+    while (fresh.slabs) {
+      struct vector_slab *slab = fresh.slabs;
+      fresh.slabs = slab->next;
+      slab->next = t->arena->slabs;
+      t->arena->slabs = slab;
+      t->arena->nslabs++;
+    }
+    fprintf(stderr, "Failed to compact bucket arena.\n");
+    return -1;
+  }
+
+  for (size_t i = 0; i < t->nbuckets; i++) {
+    if (t->flags & HACOO_WIDE) {
+      wide_bucket_vector_shrink_to_fit(&t->wide_buckets[i]);
+    } else {
+      bucket_vector_shrink_to_fit(&t->buckets[i]);
+    }
+  }
+  return 0;
+}
+
+void hacoo_accumulate_batch(struct hacoo_tensor *t, size_t count,
+                            const unsigned int *indices, const double *values,
+                            hacoo_combiner combine)
+{
+  for (size_t z = 0; z < count; z++) {
+    hacoo_accumulate(t, (unsigned int *)&indices[z * t->ndims], values[z],
+                     combine);
+  }
+}
+
+/* Events are grouped by bucket range as in hacoo_build_from_coo, then each
+ * range is applied by one thread in input order. The table is grown up
+ * front so no insert has to rehash while the threads run. */
+int hacoo_accumulate_parallel(struct hacoo_tensor *t, size_t count,
+                              const unsigned int *indices,
+                              const double *values, hacoo_combiner combine)
+{
+  // Flat tables probe past the end of a range and an arena hands out blocks
+  // one thread at a time, so both stay serial
+  if ((t->flags & HACOO_FLAT) || t->arena) {
+    hacoo_accumulate_batch(t, count, indices, values, combine);
+    return 0;
+  }
+
+  if (t->offsets && hacoo_thaw(t)) {
+    return -1;
+  }
+  hacoo_finish_rehash(t);
+  drop_indexes(t);
+
+  // Enough buckets for every event to be a new entry
+  int wide = (t->flags & HACOO_WIDE) != 0;
+  size_t need = (size_t)((double)(t->nnz + count) * 100.0 / t->load) + 1;
+  if (need > t->nbuckets) {
+    size_t nbuckets = t->nbuckets;
+    while (nbuckets < need) {
+      nbuckets *= 2;
+    }
+    if (wide ? wide_resize(t, nbuckets) : chained_resize(t, nbuckets)) {
+      return -1;
+    }
+  }
+
+  size_t n = count ? count : 1;
+  size_t max_threads = omp_get_max_threads();
+  size_t nparts = max_threads * 4 < t->nbuckets ? max_threads * 4 : t->nbuckets;
+  uint64_t *code = malloc(n * sizeof(uint64_t));
+  uint64_t *code_hi = wide ? malloc(n * sizeof(uint64_t)) : NULL;
+  size_t *part_start = malloc((nparts + 1) * sizeof(size_t));
+  size_t *order = NULL;
+  long added = 0;
+  int drop_zeros = (t->flags & HACOO_DROP_ZEROS) != 0;
+
+  if (!code || (wide && !code_hi) || !part_start) {
     goto error;
   }
 
-  // Initialize each bucket_vector
-  for (size_t i = 0; i < nbuckets; ++i) {
-    t->buckets[i] = bucket_vector_create();
+  #pragma omp parallel for schedule(static)
+  for (size_t z = 0; z < count; z++) {
+    code[z] = hacoo_morton(t, &indices[z * t->ndims], wide ? &code_hi[z] : NULL);
+  }
+
+  order = group_by_part(t, code, code_hi, count, nparts, part_start);
+  if (!order) {
+    goto error;
+  }
+
+  #pragma omp parallel for schedule(dynamic, 1) reduction(+:added)
+  for (size_t p = 0; p < nparts; p++) {
+    for (size_t r = part_start[p]; r < part_start[p + 1]; r++) {
+      size_t z = order[r];
+      if (wide) {
+        uint64_t c[2] = {code[z], code_hi[z]};
+        wide_bucket_vector *vec = &t->wide_buckets[wide_bucket_index(t, c)];
+        added += wide_bucket_upsert(vec, c, values[z], combine, drop_zeros,
+                                    NULL);
+      } else {
+        bucket_vector *vec = &t->buckets[hacoo_bucket_index(t, code[z])];
+        added += bucket_upsert(vec, code[z], values[z], combine, drop_zeros,
+                               NULL);
+      }
+    }
+  }
+  t->nnz += added;
+
+  free(code);
+  free(code_hi);
+  free(part_start);
+  free(order);
+  return 0;
+
+error:
+  free(code);
+  free(code_hi);
+  free(part_start);
+  free(order);
+  return -1;
+}
+
+double hacoo_combine_sum(double stored, double value)
+{
+  return stored + value;
+}
+
+double hacoo_combine_max(double stored, double value)
+{
+  return value > stored ? value : stored;
+}
+
+double hacoo_combine_min(double stored, double value)
+{
+  return value < stored ? value : stored;
+}
+
+double hacoo_combine_last(double stored, double value)
+{
+  (void)stored;
+  return value;
+}
+
+void hacoo_rehash(struct hacoo_tensor **t)
+{
+  if ((*t)->offsets && hacoo_thaw(*t)) {
+    fprintf(stderr, "Failed to thaw frozen tensor during rehash.\n");
+    return;
+  }
+
+  if ((*t)->flags & HACOO_WIDE) {
+    if (wide_resize(*t, (*t)->nbuckets * 2)) {
+      fprintf(stderr, "Failed to grow wide buckets during rehash.\n");
+    }
+    return;
+  }
+
+  // Flat tables move their slots in place
+  if ((*t)->flags & HACOO_FLAT) {
+    if (flat_resize(*t, (*t)->nbuckets * 2)) {
+      fprintf(stderr, "Failed to grow flat table during rehash.\n");
+    }
+    return;
+  }
+
+  // Move every entry straight to its new bucket, no re-encoding needed
+  hacoo_finish_rehash(*t);
+  if (chained_resize(*t, (*t)->nbuckets * 2)) {
+    fprintf(stderr, "Failed to grow buckets during rehash.\n");
+  }
+}
+
+/* Move all remaining buckets of an incremental rehash */
+void hacoo_finish_rehash(struct hacoo_tensor *t)
+{
+  if (t->old_buckets) {
+    chained_migrate(t, t->old_nbuckets);
+  }
+}
+
+double hacoo_get(struct hacoo_tensor *t, unsigned int *index)
+{
+  uint64_t hi;
+  uint64_t lo = hacoo_morton(t, index, &hi);
+
+  return hacoo_lookup(t, lo, hi);
+}
+
+/* Codes, bucket heads and then entries are all worked out for a block of
+ * queries before any is resolved, so the misses of one query overlap with
+ * those of the queries after it. */
+void hacoo_get_batch(struct hacoo_tensor *t, size_t count,
+                     const unsigned int *indices, double *out)
+{
+  uint64_t lo[HACOO_BLOCK], hi[HACOO_BLOCK];
+  const void *head[HACOO_BLOCK];
+
+  for (size_t base = 0; base < count; base += HACOO_BLOCK) {
+    size_t n = count - base < HACOO_BLOCK ? count - base : HACOO_BLOCK;
+
+    for (size_t k = 0; k < n; k++) {
+      lo[k] = hacoo_morton(t, &indices[(base + k) * t->ndims], &hi[k]);
+      head[k] = lookup_head(t, lo[k], hi[k]);
+    }
+
+    // Bucket heads are fetched twice as far ahead as the entries they
+    // point to, which can only be found once the head has arrived. The
+    // first entries are left to their lookups rather than waiting on a
+    // head that was only just requested.
+    for (size_t k = 0; k < n && k < 2 * PREFETCH_AHEAD; k++) {
+      __builtin_prefetch(head[k]);
+    }
+
+    for (size_t k = 0; k < n; k++) {
+      if (k + 2 * PREFETCH_AHEAD < n) {
+        __builtin_prefetch(head[k + 2 * PREFETCH_AHEAD]);
+      }
+      if (k + PREFETCH_AHEAD < n) {
+        prefetch_entries(t, head[k + PREFETCH_AHEAD]);
+      }
+      out[base + k] = hacoo_lookup(t, lo[k], hi[k]);
+    }
+  }
+}
+
+/* Pack all buckets into contiguous morton and value arrays, releasing the
+ * per-bucket storage. Bucket i keeps its entries at offsets[i]..offsets[i+1].
+ * The offsets are the bucket prefix sum, and each thread packs the range
+ * of buckets hacoo_split_buckets gives it, so the pages of a range are
+ * first touched by the thread that walks it in a balanced MTTKRP. */
+int hacoo_freeze(struct hacoo_tensor *t)
+{
+  if (t->offsets) {
+    return 0;
+  }
+  hacoo_finish_rehash(t);
+
+  int wide = (t->flags & HACOO_WIDE) != 0;
+  int nthreads = omp_get_max_threads();
+  size_t n = t->nnz ? t->nnz : 1;
+  uint64_t *morton = malloc(n * sizeof(uint64_t));
+  uint64_t *morton_hi = wide ? malloc(n * sizeof(uint64_t)) : NULL;
+  double *value = malloc(n * sizeof(double));
+  size_t *first = malloc((nthreads + 1) * sizeof(size_t));
+  if (!morton || (wide && !morton_hi) || !value || !first ||
+      hacoo_split_buckets(t, nthreads, first)) {
+    free(morton);
+    free(morton_hi);
+    free(value);
+    free(first);
+    return -1;
+  }
+  const size_t *offsets = t->bucket_prefix;
+
+  #pragma omp parallel num_threads(nthreads)
+  {
+    for (int p = omp_get_thread_num(); p < nthreads; p += omp_get_num_threads()) {
+      for (size_t i = first[p]; i < first[p + 1]; i++) {
+        size_t z = offsets[i];
+
+        if (wide) {
+          wide_bucket_vector *vec = &t->wide_buckets[i];
+          for (size_t j = 0; j < vec->size; j++, z++) {
+            morton[z] = vec->data[j].morton[0];
+            morton_hi[z] = vec->data[j].morton[1];
+            value[z] = vec->data[j].value;
+          }
+          continue;
+        }
+
+        size_t count;
+        struct hacoo_bucket *entries = hacoo_bucket_entries(t, i, &count);
+        for (size_t j = 0; j < count; j++, z++) {
+          morton[z] = entries[j].morton;
+          value[z] = entries[j].value;
+        }
+      }
+    }
+  }
+  free(first);
+
+  // The prefix sum becomes the offsets
+  t->offsets = t->bucket_prefix;
+  t->bucket_prefix = NULL;
+  hacoo_free_buckets(t);
+  t->packed_morton = morton;
+  t->packed_morton_hi = morton_hi;
+  t->packed_value = value;
+  return 0;
+}
+
+/* Rebuild the mutable storage of a frozen tensor. The bucket count and
+ * hash parameters are unchanged, so every entry goes back where it was. */
+int hacoo_thaw(struct hacoo_tensor *t)
+{
+  int failed = 0;
+
+  if (!t->offsets) {
+    return 0;
+  }
+
+  if (t->flags & HACOO_WIDE) {
+    t->wide_buckets = calloc(t->nbuckets, sizeof(wide_bucket_vector));
+    if (!t->wide_buckets) {
+      goto error;
+    }
+    // An arena hands out blocks one thread at a time, ahead of the copy
+    for (size_t i = 0; t->arena && i < t->nbuckets; i++) {
+      failed |= wide_bucket_vector_reserve_in(&t->wide_buckets[i],
+                                              t->offsets[i + 1] - t->offsets[i],
+                                              t->arena);
+    }
+    #pragma omp parallel for schedule(static) reduction(|:failed)
+    for (size_t i = 0; i < t->nbuckets; i++) {
+      wide_bucket_vector *vec = &t->wide_buckets[i];
+      size_t count = t->offsets[i + 1] - t->offsets[i];
+      if (!t->arena && wide_bucket_vector_reserve_in(vec, count, NULL)) {
+        failed = 1;
+        continue;
+      }
+      for (size_t j = 0; j < count; j++) {
+        vec->data[j].morton[0] = t->packed_morton[t->offsets[i] + j];
+        vec->data[j].morton[1] = t->packed_morton_hi[t->offsets[i] + j];
+        vec->data[j].value = t->packed_value[t->offsets[i] + j];
+      }
+      vec->size = count;
+    }
+  } else if (t->flags & HACOO_FLAT) {
+    t->slots = malloc(t->nbuckets * sizeof(struct hacoo_bucket));
+    t->dist = calloc(t->nbuckets, sizeof(unsigned char));
+    if (!t->slots || !t->dist) {
+      goto error;
+    }
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < t->nbuckets; i++) {
+      if (t->offsets[i] == t->offsets[i + 1]) {
+        continue;
+      }
+      t->slots[i].morton = t->packed_morton[t->offsets[i]];
+      t->slots[i].value = t->packed_value[t->offsets[i]];
+      size_t home = hacoo_bucket_index(t, t->slots[i].morton);
+      t->dist[i] = (i + t->nbuckets - home) % t->nbuckets + 1;
+    }
+  } else {
+    t->buckets = calloc(t->nbuckets, sizeof(bucket_vector));
+    if (!t->buckets) {
+      goto error;
+    }
+    for (size_t i = 0; t->arena && i < t->nbuckets; i++) {
+      failed |= bucket_vector_reserve_in(&t->buckets[i],
+                                         t->offsets[i + 1] - t->offsets[i],
+                                         t->arena);
+    }
+    #pragma omp parallel for schedule(static) reduction(|:failed)
+    for (size_t i = 0; i < t->nbuckets; i++) {
+      bucket_vector *vec = &t->buckets[i];
+      size_t count = t->offsets[i + 1] - t->offsets[i];
+      if (!t->arena && bucket_vector_reserve_in(vec, count, NULL)) {
+        failed = 1;
+        continue;
+      }
+      for (size_t j = 0; j < count; j++) {
+        vec->data[j].morton = t->packed_morton[t->offsets[i] + j];
+        vec->data[j].value = t->packed_value[t->offsets[i] + j];
+      }
+      vec->size = count;
+    }
+  }
+  if (failed) {
+    goto error;
+  }
+
+  free(t->packed_morton);
+  free(t->packed_morton_hi);
+  free(t->packed_value);
+  free(t->offsets);
+  t->packed_morton = NULL;
+  t->packed_morton_hi = NULL;
+  t->packed_value = NULL;
+  t->offsets = NULL;
+  return 0;
+
+error:
+  if (t->slots || t->buckets || t->wide_buckets) {
+    hacoo_free_buckets(t);
+  }
+  free(t->dist);
+  t->dist = NULL;
+  return -1;
+}
+
+/* Copy the nonzeros out in storage order, then radix sort the copy by
+ * morton code a digit at a time, least significant first. Only the digits
+ * holding bits of the layout are sorted, so a tensor whose modes need 40
+ * bits between them takes five passes. */
+int hacoo_zorder(struct hacoo_tensor *t)
+{
+  if (t->zorder_value) {
+    return 0;
+  }
+  hacoo_finish_rehash(t);
+
+  int wide = (t->flags & HACOO_WIDE) != 0;
+  size_t n = t->nnz ? t->nnz : 1;
+  uint64_t *morton = malloc(n * sizeof(uint64_t));
+  uint64_t *morton_hi = wide ? malloc(n * sizeof(uint64_t)) : NULL;
+  double *value = malloc(n * sizeof(double));
+  if (!morton || (wide && !morton_hi) || !value) {
+    goto error;
+  }
+
+  zorder_gather(t, morton, morton_hi, value);
+  if (radix_sort(t->nnz, &morton, &morton_hi, &value, code_bits(t))) {
+    goto error;
+  }
+
+  t->zorder_morton = morton;
+  t->zorder_morton_hi = morton_hi;
+  t->zorder_value = value;
+  return 0;
+
+error:
+  free(morton);
+  free(morton_hi);
+  free(value);
+  return -1;
+}
+
+/* Build the index from scratch, see csf_build */
+struct hacoo_csf *hacoo_csf(struct hacoo_tensor *t, unsigned int mode)
+{
+  if (mode >= t->ndims) {
+    fprintf(stderr, "Error: Mode %u out of range.\n", mode);
+    return NULL;
+  }
+
+  if (!t->csf) {
+    t->csf = calloc(t->ndims, sizeof(struct hacoo_csf *));
+    if (!t->csf) {
+      return NULL;
+    }
+  }
+  if (!t->csf[mode]) {
+    hacoo_finish_rehash(t);
+    t->csf[mode] = csf_build(t, mode);
+  }
+  return t->csf[mode];
+}
+
+struct hacoo_rowpart *hacoo_rowpart(struct hacoo_tensor *t, unsigned int mode,
+                                    unsigned int nparts)
+{
+  if (mode >= t->ndims || nparts == 0) {
+    fprintf(stderr, "Error: Invalid mode or part count.\n");
+    return NULL;
+  }
+
+  if (!t->rowpart) {
+    t->rowpart = calloc(t->ndims, sizeof(struct hacoo_rowpart *));
+    if (!t->rowpart) {
+      return NULL;
+    }
+  }
+
+  struct hacoo_rowpart **rp = &t->rowpart[mode];
+  if (*rp && (*rp)->nparts != nparts) {
+    rowpart_free(*rp);
+    *rp = NULL;
+  }
+  if (!*rp) {
+    hacoo_finish_rehash(t);
+    *rp = rowpart_build(t, mode, nparts);
+  }
+  return *rp;
+}
+
+/* Extract the index from a bucket */
+void hacoo_extract_index(struct hacoo_tensor *t, struct hacoo_bucket *b,
+                         unsigned int *index)
+{
+    hacoo_morton_decode(t, b->morton, index);
+}
+
+/* Extract the index from a bare morton code */
+void hacoo_morton_decode(struct hacoo_tensor *t, unsigned long long morton,
+                         unsigned int *index)
+{
+    morton_layout_decode(t->layout, morton, 0, index);
+}
+
+/* Extract the indices of a block of morton codes */
+void hacoo_extract_indices_batch(struct hacoo_tensor *t, const uint64_t *mortons,
+                                 size_t count, unsigned int *out_soa[])
+{
+    morton_layout_decode_batch(t->layout, mortons, NULL, count, out_soa);
+}
+
+/* Extract the indices of a block of t, which may hold wide codes */
+void hacoo_block_indices(struct hacoo_tensor *t, const struct hacoo_block *b,
+                         unsigned int *out_soa[])
+{
+    morton_layout_decode_batch(t->layout, b->morton, b->morton_hi, b->count,
+                               out_soa);
+}
+
+/* Start a walk over buckets [start, end) */
+void hacoo_cursor_init(struct hacoo_tensor *t, struct hacoo_cursor *c,
+                       size_t start, size_t end)
+{
+  if (end > t->nbuckets) {
+    end = t->nbuckets;
+  }
+  if (start > end) {
+    start = end;
+  }
+
+  c->bucket = start;
+  c->zorder = 0;
+  if (t->offsets) {
+    c->pos = t->offsets[start];
+    c->end = t->offsets[end];
+  } else {
+    c->pos = 0;
+    c->end = end;
+  }
+}
+
+/* Cuts come from a binary search of the cached prefix sum */
+int hacoo_split_buckets(struct hacoo_tensor *t, size_t nparts, size_t *first)
+{
+  const size_t *prefix = bucket_prefix(t);
+
+  if (!prefix) {
+    return -1;
+  }
+
+  // Part p starts at the first bucket with p / nparts of the nonzeros
+  // before it
+  size_t total = prefix[t->nbuckets];
+  first[0] = 0;
+  for (size_t p = 1; p < nparts; p++) {
+    size_t target = total * p / nparts;
+    size_t lo = first[p - 1], hi = t->nbuckets;
+
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (prefix[mid] < target) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    first[p] = lo;
+  }
+  first[nparts] = t->nbuckets;
+  return 0;
+}
+
+/* Start a walk over nonzeros [first, last) of the Z-order stream */
+void hacoo_zorder_cursor_init(struct hacoo_tensor *t, struct hacoo_cursor *c,
+                              size_t first, size_t last)
+{
+  if (last > t->nnz) {
+    last = t->nnz;
+  }
+  if (first > last) {
+    first = last;
+  }
+
+  c->bucket = 0;
+  c->pos = first;
+  c->end = last;
+  c->zorder = 1;
+}
+
+/* Fetch the next block of nonzeros. The Z-order stream and frozen tensors
+ * hand out their arrays directly; other storage is copied into the block's
+ * buffers. */
+size_t hacoo_next_block(struct hacoo_tensor *t, struct hacoo_cursor *c,
+                        struct hacoo_block *b)
+{
+  if (c->zorder) {
+    b->count = c->end - c->pos < HACOO_BLOCK ? c->end - c->pos : HACOO_BLOCK;
+    b->morton = &t->zorder_morton[c->pos];
+    b->morton_hi = t->zorder_morton_hi ? &t->zorder_morton_hi[c->pos] : NULL;
+    b->value = &t->zorder_value[c->pos];
+    c->pos += b->count;
+    return b->count;
+  }
+
+  if (t->offsets) {
+    b->count = c->end - c->pos < HACOO_BLOCK ? c->end - c->pos : HACOO_BLOCK;
+    b->morton = &t->packed_morton[c->pos];
+    b->morton_hi = t->packed_morton_hi ? &t->packed_morton_hi[c->pos] : NULL;
+    b->value = &t->packed_value[c->pos];
+    c->pos += b->count;
+    return b->count;
+  }
+
+  b->count = 0;
+  b->morton = b->morton_buf;
+  b->morton_hi = NULL;
+  b->value = b->value_buf;
+
+  if (t->flags & HACOO_WIDE) {
+    b->morton_hi = b->morton_hi_buf;
+    while (c->bucket < c->end && b->count < HACOO_BLOCK) {
+      wide_bucket_vector *vec = &t->wide_buckets[c->bucket];
+
+      while (c->pos < vec->size && b->count < HACOO_BLOCK) {
+        b->morton_buf[b->count] = vec->data[c->pos].morton[0];
+        b->morton_hi_buf[b->count] = vec->data[c->pos].morton[1];
+        b->value_buf[b->count] = vec->data[c->pos].value;
+        b->count++;
+        c->pos++;
+      }
+
+      if (c->pos == vec->size) {
+        c->bucket++;
+        c->pos = 0;
+      }
+    }
+    return b->count;
+  }
+
+  while (c->bucket < c->end && b->count < HACOO_BLOCK) {
+    size_t count;
+    struct hacoo_bucket *entries = hacoo_bucket_entries(t, c->bucket, &count);
+
+    while (c->pos < count && b->count < HACOO_BLOCK) {
+      b->morton_buf[b->count] = entries[c->pos].morton;
+      b->value_buf[b->count] = entries[c->pos].value;
+      b->count++;
+      c->pos++;
+    }
+
+    if (c->pos == count) {
+      c->bucket++;
+      c->pos = 0;
+    }
+  }
+
+  return b->count;
+}
+
+/* Helper function implementations. */
+
+/* free buckets given a specific hacoo tensor*/
+static void hacoo_free_buckets(struct hacoo_tensor *t)
+{
+  // Arena buckets all go at once with their slabs
+  if (t->arena) {
+    vector_arena_clear(t->arena);
+    free(t->wide_buckets);
+    free(t->buckets);
+    free(t->old_buckets);
+    t->wide_buckets = NULL;
+    t->buckets = NULL;
+    t->old_buckets = NULL;
+    return;
+  }
+
+  if (t->flags & HACOO_WIDE) {
+    for (size_t i = 0; i < t->nbuckets; i++) {
+      wide_bucket_vector_free(&t->wide_buckets[i]);
+    }
+    free(t->wide_buckets);
+    t->wide_buckets = NULL;
+    return;
+  }
+
+  if (t->flags & HACOO_FLAT) {
+    free(t->slots);
+    free(t->dist);
+    t->slots = NULL;
+    t->dist = NULL;
+    return;
+  }
+
+  for (size_t i = 0; i < t->nbuckets; i++) {
+    bucket_vector_free(&t->buckets[i]);
+  }
+  free(t->buckets);
+  t->buckets = NULL;
+
+  if (t->old_buckets) {
+    for (size_t i = t->migrated; i < t->old_nbuckets; i++) {
+      bucket_vector_free(&t->old_buckets[i]);
+    }
+    free(t->old_buckets);
+    t->old_buckets = NULL;
+  }
+}
+
+/* Sort nnz codes and their values by the low bits of the codes, *key_hi
+ * being NULL if the codes take one word. The arrays passed in are freed
+ * and replaced by sorted ones. Returns -1 on allocation failure, leaving
+ * them as they were. */
+static int radix_sort(size_t nnz, uint64_t **key, uint64_t **key_hi,
+                      double **value, unsigned int bits)
+{
+  size_t n = nnz ? nnz : 1;
+  uint64_t *k[2] = {*key, malloc(n * sizeof(uint64_t))};
+  uint64_t *k_hi[2] = {*key_hi, *key_hi ? malloc(n * sizeof(uint64_t)) : NULL};
+  double *v[2] = {*value, malloc(n * sizeof(double))};
+  size_t *count = malloc(omp_get_max_threads() * RADIX * sizeof(size_t));
+
+  if (!k[1] || (*key_hi && !k_hi[1]) || !v[1] || !count) {
+    free(k[1]);
+    free(k_hi[1]);
+    free(v[1]);
+    free(count);
+    return -1;
+  }
+
+  // Each pass moves the entries from one buffer to the other
+  int cur = 0;
+  for (unsigned int bit = 0; bit < bits; bit += RADIX_BITS, cur ^= 1) {
+    radix_pass(nnz, k[cur], k_hi[cur], v[cur], k[cur ^ 1], k_hi[cur ^ 1],
+               v[cur ^ 1], bit, count);
+  }
+
+  *key = k[cur];
+  *key_hi = k_hi[cur];
+  *value = v[cur];
+  free(k[cur ^ 1]);
+  free(k_hi[cur ^ 1]);
+  free(v[cur ^ 1]);
+  free(count);
+  return 0;
+}
+
+/* free only buckets */
+static void free_buckets(bucket_vector *buckets, size_t nbuckets)
+{
+  for (size_t i = 0; i < nbuckets; ++i) {
+    bucket_vector_free(&buckets[i]);
+  }
+  free(buckets);
+}
+
+// Encodes index with the tensor's layout, returns morton code
+// hi: receives the high word of a wide code, may be NULL
+static uint64_t hacoo_morton(struct hacoo_tensor *t, const unsigned int *index,
+                             uint64_t *hi)
+{
+    return morton_layout_encode(t->layout, index, hi);
+}
+
+/* Buckets are split into nparts ranges for parallel construction. Range p
+ * holds the buckets b with b * nparts / nbuckets == p. */
+#define COO_PART(b, nparts, nbuckets) ((b) * (nparts) / (nbuckets))
+#define COO_PART_FIRST(p, nparts, nbuckets) \
+  (((p) * (nbuckets) + (nparts) - 1) / (nparts))
+
+/* Order count codes by bucket range, keeping input order within a range.
+ * Returns the positions of the codes in that order, with range p taking
+ * [part_start[p], part_start[p + 1]). */
+static size_t *group_by_part(struct hacoo_tensor *t, const uint64_t *code,
+                             const uint64_t *code_hi, size_t count,
+                             size_t nparts, size_t *part_start)
+{
+  size_t nbuckets = t->nbuckets;
+  size_t max_threads = omp_get_max_threads();
+  size_t *order = malloc((count ? count : 1) * sizeof(size_t));
+  size_t *counts = calloc(max_threads * nparts, sizeof(size_t));
+
+  if (!order || !counts) {
+    free(order);
+    free(counts);
+    return NULL;
+  }
+
+  #pragma omp parallel
+  {
+    size_t tid = omp_get_thread_num();
+    size_t nthreads = omp_get_num_threads();
+    size_t chunk = (count + nthreads - 1) / nthreads;
+    size_t z0 = tid * chunk < count ? tid * chunk : count;
+    size_t z1 = z0 + chunk < count ? z0 + chunk : count;
+    size_t *mine = &counts[tid * nparts];
+
+    for (size_t z = z0; z < z1; z++) {
+      mine[COO_PART(hacoo_coo_bucket(t, code, code_hi, z), nparts, nbuckets)]++;
+    }
+    #pragma omp barrier
+
+    #pragma omp single
+    {
+      size_t pos = 0;
+      for (size_t p = 0; p < nparts; p++) {
+        part_start[p] = pos;
+        for (size_t th = 0; th < nthreads; th++) {
+          size_t c = counts[th * nparts + p];
+          counts[th * nparts + p] = pos;
+          pos += c;
+        }
+      }
+      part_start[nparts] = pos;
+    }
+
+    for (size_t z = z0; z < z1; z++) {
+      order[mine[COO_PART(hacoo_coo_bucket(t, code, code_hi, z), nparts,
+                          nbuckets)]++] = z;
+    }
+  }
+
+  free(counts);
+  return order;
+}
+
+/* Free the Z-order stream and fiber indexes, which no longer match the
+ * entries */
+static void drop_indexes(struct hacoo_tensor *t)
+{
+  drop_prefix(t);
+
+  free(t->zorder_morton);
+  free(t->zorder_morton_hi);
+  free(t->zorder_value);
+  t->zorder_morton = NULL;
+  t->zorder_morton_hi = NULL;
+  t->zorder_value = NULL;
+
+  if (t->csf) {
+    for (size_t i = 0; i < t->ndims; i++) {
+      if (t->csf[i]) {
+        csf_free(t->csf[i], t->ndims);
+      }
+    }
+    free(t->csf);
+    t->csf = NULL;
+  }
+
+  if (t->rowpart) {
+    for (size_t i = 0; i < t->ndims; i++) {
+      if (t->rowpart[i]) {
+        rowpart_free(t->rowpart[i]);
+      }
+    }
+    free(t->rowpart);
+    t->rowpart = NULL;
+  }
+}
+
+/* Number of entries in bucket i of a tensor that is not frozen */
+static size_t bucket_size(struct hacoo_tensor *t, size_t i)
+{
+  if (t->flags & HACOO_WIDE) {
+    return t->wide_buckets[i].size;
+  }
+  if (t->flags & HACOO_FLAT) {
+    return t->dist[i] != 0;
+  }
+  return t->buckets[i].size;
+}
+
+static void drop_prefix(struct hacoo_tensor *t)
+{
+  free(t->bucket_prefix);
+  t->bucket_prefix = NULL;
+}
+
+/* Prefix sum of the bucket sizes, built on first use. It is taken in two
+ * parallel passes: each thread sums the sizes of a static range of
+ * buckets, then adds the totals of the ranges before its own. Frozen
+ * tensors already hold it in offsets. */
+static const size_t *bucket_prefix(struct hacoo_tensor *t)
+{
+  if (t->offsets) {
+    return t->offsets;
+  }
+  if (t->bucket_prefix) {
+    return t->bucket_prefix;
+  }
+
+  int nthreads = omp_get_max_threads();
+  size_t *prefix = malloc((t->nbuckets + 1) * sizeof(size_t));
+  size_t *totals = calloc(nthreads + 1, sizeof(size_t));
+
+  if (!prefix || !totals) {
+    fprintf(stderr, "Error: Memory allocation failed.\n");
+    free(prefix);
+    free(totals);
+    return NULL;
+  }
+
+  prefix[0] = 0;
+  #pragma omp parallel num_threads(nthreads)
+  {
+    int tid = omp_get_thread_num();
+    int team = omp_get_num_threads();
+    size_t lo = t->nbuckets * tid / team;
+    size_t hi = t->nbuckets * (tid + 1) / team;
+    size_t sum = 0;
+
+    for (size_t i = lo; i < hi; i++) {
+      sum += bucket_size(t, i);
+      prefix[i + 1] = sum;
+    }
+    totals[tid + 1] = sum;
+
+    #pragma omp barrier
+    size_t before = 0;
+    for (int p = 0; p <= tid; p++) {
+      before += totals[p];
+    }
+    for (size_t i = lo; i < hi; i++) {
+      prefix[i + 1] += before;
+    }
+  }
+
+  free(totals);
+  t->bucket_prefix = prefix;
+  return prefix;
+}
+
+/* Bits of a code in t's layout */
+static unsigned int code_bits(struct hacoo_tensor *t)
+{
+  return t->layout->width;
+}
+
+/* Put the width-bit value v at bit shift of a two-word key */
+static inline void key_put(uint64_t *lo, uint64_t *hi, unsigned int shift,
+                           unsigned int width, uint64_t v)
+{
+  if (shift >= 64) {
+    *hi |= v << (shift - 64);
+    return;
+  }
+  *lo |= v << shift;
+  if (shift > 0 && shift + width > 64) {
+    *hi |= v >> (64 - shift);
+  }
+}
+
+/* Get the width-bit value at bit shift of a two-word key */
+static inline unsigned int key_get(uint64_t lo, uint64_t hi,
+                                   unsigned int shift, unsigned int width)
+{
+  uint64_t v;
+
+  if (shift >= 64) {
+    v = hi >> (shift - 64);
+  } else {
+    v = lo >> shift;
+    if (shift > 0 && shift + width > 64) {
+      v |= hi << (64 - shift);
+    }
+  }
+  return v & ((1ULL << width) - 1);
+}
+
+/* Sort the nonzeros of t by a key that packs their indices level by level,
+ * the root in the most significant bits and each level with as many bits
+ * as its mode has in a morton code. Runs of equal leading levels are then
+ * the fibers. */
+static struct hacoo_csf *csf_build(struct hacoo_tensor *t, unsigned int root)
+{
+  unsigned int nd = t->ndims;
+  size_t nnz = t->nnz, n = nnz ? nnz : 1;
+  unsigned int shift[MORTON_MAX_MODES], width[MORTON_MAX_MODES];
+  uint64_t *morton = NULL, *morton_hi = NULL, *key = NULL, *key_hi = NULL;
+  double *value = NULL;
+  struct hacoo_csf *csf = calloc(1, sizeof(struct hacoo_csf));
+
+  if (!csf) {
+    goto error;
+  }
+  csf->nlevels = nd;
+  csf->mode = malloc(nd * sizeof(unsigned int));
+  csf->nfibers = calloc(nd, sizeof(size_t));
+  csf->fids = calloc(nd, sizeof(unsigned int *));
+  csf->fptr = calloc(nd, sizeof(size_t *));
+  if (!csf->mode || !csf->nfibers || !csf->fids || !csf->fptr) {
+    goto error;
+  }
+
+  // Root first, then the other modes from the shortest to the longest, so
+  // the levels near the root share the most fibers
+  unsigned int levels = 1;
+  csf->mode[0] = root;
+  for (unsigned int i = 0; i < nd; i++) {
+    if (i == root) {
+      continue;
+    }
+    unsigned int l = levels++;
+    while (l > 1 && t->dims[csf->mode[l - 1]] > t->dims[i]) {
+      csf->mode[l] = csf->mode[l - 1];
+      l--;
+    }
+    csf->mode[l] = i;
+  }
+
+  unsigned int bits = 0;
+  for (int l = nd - 1; l >= 0; l--) {
+    width[l] = t->layout->bits[csf->mode[l]];
+    shift[l] = bits;
+    bits += width[l];
+  }
+
+  morton = malloc(n * sizeof(uint64_t));
+  morton_hi = (t->flags & HACOO_WIDE) ? malloc(n * sizeof(uint64_t)) : NULL;
+  value = malloc(n * sizeof(double));
+  key = malloc(n * sizeof(uint64_t));
+  key_hi = bits > 64 ? malloc(n * sizeof(uint64_t)) : NULL;
+  if (!morton || ((t->flags & HACOO_WIDE) && !morton_hi) || !value || !key ||
+      (bits > 64 && !key_hi)) {
+    goto error;
+  }
+  zorder_gather(t, morton, morton_hi, value);
+
+  // Decode a block of codes at a time and repack the indices
+  #pragma omp parallel
+  {
+    unsigned int buf[nd * HACOO_BLOCK];
+    unsigned int *idx[MORTON_MAX_MODES];
+    for (unsigned int i = 0; i < nd; i++) {
+      idx[i] = &buf[i * HACOO_BLOCK];
+    }
+
+    #pragma omp for schedule(static)
+    for (size_t first = 0; first < nnz; first += HACOO_BLOCK) {
+      size_t count = nnz - first < HACOO_BLOCK ? nnz - first : HACOO_BLOCK;
+      morton_layout_decode_batch(t->layout, &morton[first],
+                                 morton_hi ? &morton_hi[first] : NULL, count,
+                                 idx);
+      for (size_t k = 0; k < count; k++) {
+        uint64_t lo = 0, hi = 0;
+        for (unsigned int l = 0; l < nd; l++) {
+          key_put(&lo, &hi, shift[l], width[l], idx[csf->mode[l]][k]);
+        }
+        key[first + k] = lo;
+        if (key_hi) {
+          key_hi[first + k] = hi;
+        }
+      }
+    }
+  }
+  free(morton);
+  free(morton_hi);
+  morton = morton_hi = NULL;
+
+  if (radix_sort(nnz, &key, &key_hi, &value, bits) ||
+      csf_fill(csf, key, key_hi, shift, width, nnz)) {
+    goto error;
+  }
+  csf->value = value;
+  free(key);
+  free(key_hi);
+  return csf;
+
+error:
+  fprintf(stderr, "Error: Failed to build fiber index of mode %u.\n", root);
+  if (csf) {
+    csf_free(csf, nd);
+  }
+  free(morton);
+  free(morton_hi);
+  free(key);
+  free(key_hi);
+  free(value);
+  return NULL;
+}
+
+/* First level at which sorted nonzero z starts new nodes */
+static unsigned int csf_first_new(const struct hacoo_csf *csf,
+                                  const uint64_t *key, const uint64_t *key_hi,
+                                  const unsigned int *shift,
+                                  const unsigned int *width, size_t z)
+{
+  if (z == 0) {
+    return 0;
+  }
+
+  uint64_t hi = key_hi ? key_hi[z] : 0, prev_hi = key_hi ? key_hi[z - 1] : 0;
+  for (unsigned int l = 0; l + 1 < csf->nlevels; l++) {
+    if (key_get(key[z], hi, shift[l], width[l]) !=
+        key_get(key[z - 1], prev_hi, shift[l], width[l])) {
+      return l;
+    }
+  }
+  return csf->nlevels - 1;
+}
+
+/* Lay out the levels from sorted keys. A nonzero whose key first differs
+ * from the one before at level l starts a node at l and every level
+ * below it. */
+static int csf_fill(struct hacoo_csf *csf, const uint64_t *key,
+                    const uint64_t *key_hi, const unsigned int *shift,
+                    const unsigned int *width, size_t nnz)
+{
+  unsigned int nd = csf->nlevels;
+  size_t next[MORTON_MAX_MODES] = {0};
+
+  for (size_t z = 0; z < nnz; z++) {
+    for (unsigned int l = csf_first_new(csf, key, key_hi, shift, width, z);
+         l < nd; l++) {
+      csf->nfibers[l]++;
+    }
+  }
+
+  for (unsigned int l = 0; l < nd; l++) {
+    csf->fids[l] = malloc((csf->nfibers[l] ? csf->nfibers[l] : 1) *
+                          sizeof(unsigned int));
+    if (!csf->fids[l]) {
+      return -1;
+    }
+    if (l + 1 < nd) {
+      csf->fptr[l] = malloc((csf->nfibers[l] + 1) * sizeof(size_t));
+      if (!csf->fptr[l]) {
+        return -1;
+      }
+      csf->fptr[l][csf->nfibers[l]] = csf->nfibers[l + 1];
+    }
+  }
+
+  for (size_t z = 0; z < nnz; z++) {
+    uint64_t hi = key_hi ? key_hi[z] : 0;
+    for (unsigned int l = csf_first_new(csf, key, key_hi, shift, width, z);
+         l < nd; l++) {
+      csf->fids[l][next[l]] = key_get(key[z], hi, shift[l], width[l]);
+      if (l + 1 < nd) {
+        csf->fptr[l][next[l]] = next[l + 1];
+      }
+      next[l]++;
+    }
+  }
+  return 0;
+}
+
+/* Cut the rows of mode into parts holding about nnz / nparts nonzeros
+ * each, then copy the nonzeros out grouped by part. Within a part they
+ * keep their storage order, or Z-order for a HACOO_ZORDER tensor. */
+static struct hacoo_rowpart *rowpart_build(struct hacoo_tensor *t,
+                                           unsigned int mode,
+                                           unsigned int nparts)
+{
+  size_t nnz = t->nnz, n = nnz ? nnz : 1;
+  unsigned int rows = t->dims[mode];
+  int wide = (t->flags & HACOO_WIDE) != 0;
+  size_t nthreads = omp_get_max_threads();
+  uint64_t *morton = malloc(n * sizeof(uint64_t));
+  uint64_t *morton_hi = wide ? malloc(n * sizeof(uint64_t)) : NULL;
+  double *value = malloc(n * sizeof(double));
+  unsigned int *row = malloc(n * sizeof(unsigned int));
+  unsigned int *part_of = malloc((rows ? rows : 1) * sizeof(unsigned int));
+  size_t *row_count = calloc(rows + 1, sizeof(size_t));
+  size_t *count = malloc(nthreads * nparts * sizeof(size_t));
+  struct hacoo_rowpart *rp = calloc(1, sizeof(struct hacoo_rowpart));
+
+  if (!morton || (wide && !morton_hi) || !value || !row || !part_of ||
+      !row_count || !count || !rp) {
+    goto error;
+  }
+  rp->nparts = nparts;
+  rp->row_start = malloc((nparts + 1) * sizeof(unsigned int));
+  rp->start = malloc((nparts + 1) * sizeof(size_t));
+  rp->morton = malloc(n * sizeof(uint64_t));
+  rp->morton_hi = wide ? malloc(n * sizeof(uint64_t)) : NULL;
+  rp->value = malloc(n * sizeof(double));
+  if (!rp->row_start || !rp->start || !rp->morton || (wide && !rp->morton_hi) ||
+      !rp->value) {
+    goto error;
+  }
+
+  if ((t->flags & HACOO_ZORDER) && hacoo_zorder(t) == 0) {
+    memcpy(morton, t->zorder_morton, nnz * sizeof(uint64_t));
+    if (wide) {
+      memcpy(morton_hi, t->zorder_morton_hi, nnz * sizeof(uint64_t));
+    }
+    memcpy(value, t->zorder_value, nnz * sizeof(double));
+  } else {
+    zorder_gather(t, morton, morton_hi, value);
+  }
+
+  // Rows of the nonzeros, decoded a block at a time
+  #pragma omp parallel
+  {
+    unsigned int buf[t->ndims * HACOO_BLOCK];
+    unsigned int *idx[MORTON_MAX_MODES];
+    for (size_t i = 0; i < t->ndims; i++) {
+      idx[i] = &buf[i * HACOO_BLOCK];
+    }
+
+    #pragma omp for schedule(static)
+    for (size_t first = 0; first < nnz; first += HACOO_BLOCK) {
+      size_t len = nnz - first < HACOO_BLOCK ? nnz - first : HACOO_BLOCK;
+      morton_layout_decode_batch(t->layout, &morton[first],
+                                 morton_hi ? &morton_hi[first] : NULL, len, idx);
+      memcpy(&row[first], idx[mode], len * sizeof(unsigned int));
+    }
+  }
+
+  // Each part starts at the first row where the nonzeros before it reach
+  // its share
+  for (size_t z = 0; z < nnz; z++) {
+    row_count[row[z]]++;
+  }
+  unsigned int r = 0;
+  size_t seen = 0;
+  for (unsigned int p = 0; p < nparts; p++) {
+    size_t share = nnz * p / nparts;
+    while (r < rows && seen < share) {
+      seen += row_count[r++];
+    }
+    rp->row_start[p] = r;
+    rp->start[p] = seen;
+  }
+  rp->row_start[nparts] = rows;
+  rp->start[nparts] = nnz;
+  for (unsigned int p = 0; p < nparts; p++) {
+    for (r = rp->row_start[p]; r < rp->row_start[p + 1]; r++) {
+      part_of[r] = p;
+    }
+  }
+
+  // Stable scatter by part, as a pass of radix_pass
+  #pragma omp parallel
+  {
+    int tid = omp_get_thread_num();
+    int nth = omp_get_num_threads();
+    size_t first = nnz * tid / nth;
+    size_t last = nnz * (tid + 1) / nth;
+    size_t *mine = &count[tid * nparts];
+
+    memset(mine, 0, nparts * sizeof(size_t));
+    for (size_t z = first; z < last; z++) {
+      mine[part_of[row[z]]]++;
+    }
+    #pragma omp barrier
+
+    #pragma omp single
+    {
+      for (unsigned int p = 0; p < nparts; p++) {
+        size_t pos = rp->start[p];
+        for (int i = 0; i < nth; i++) {
+          size_t c = count[i * nparts + p];
+          count[i * nparts + p] = pos;
+          pos += c;
+        }
+      }
+    }
+
+    for (size_t z = first; z < last; z++) {
+      size_t pos = mine[part_of[row[z]]]++;
+      rp->morton[pos] = morton[z];
+      if (wide) {
+        rp->morton_hi[pos] = morton_hi[z];
+      }
+      rp->value[pos] = value[z];
+    }
+  }
+
+  free(morton);
+  free(morton_hi);
+  free(value);
+  free(row);
+  free(part_of);
+  free(row_count);
+  free(count);
+  return rp;
+
+error:
+  fprintf(stderr, "Error: Failed to partition the rows of mode %u.\n", mode);
+  if (rp) {
+    rowpart_free(rp);
+  }
+  free(morton);
+  free(morton_hi);
+  free(value);
+  free(row);
+  free(part_of);
+  free(row_count);
+  free(count);
+  return NULL;
+}
+
+static void rowpart_free(struct hacoo_rowpart *rp)
+{
+  free(rp->row_start);
+  free(rp->start);
+  free(rp->morton);
+  free(rp->morton_hi);
+  free(rp->value);
+  free(rp);
+}
+
+static void csf_free(struct hacoo_csf *csf, unsigned int nlevels)
+{
+  for (unsigned int l = 0; csf->fids && l < nlevels; l++) {
+    free(csf->fids[l]);
+  }
+  for (unsigned int l = 0; csf->fptr && l < nlevels; l++) {
+    free(csf->fptr[l]);
+  }
+  free(csf->fids);
+  free(csf->fptr);
+  free(csf->mode);
+  free(csf->nfibers);
+  free(csf->value);
+  free(csf);
+}
+
+/* Copy every nonzero of t into the arrays in storage order. Each thread
+ * copies a range of buckets, starting where the ranges before it end. */
+static void zorder_gather(struct hacoo_tensor *t, uint64_t *morton,
+                          uint64_t *morton_hi, double *value)
+{
+  if (t->offsets) {
+    memcpy(morton, t->packed_morton, t->nnz * sizeof(uint64_t));
+    if (morton_hi) {
+      memcpy(morton_hi, t->packed_morton_hi, t->nnz * sizeof(uint64_t));
+    }
+    memcpy(value, t->packed_value, t->nnz * sizeof(double));
+    return;
+  }
+
+  size_t nparts = omp_get_max_threads();
+  size_t part_start[nparts + 1];
+
+  #pragma omp parallel for schedule(static)
+  for (size_t p = 0; p < nparts; p++) {
+    size_t count = 0;
+    for (size_t i = COO_PART_FIRST(p, nparts, t->nbuckets);
+         i < COO_PART_FIRST(p + 1, nparts, t->nbuckets); i++) {
+      if (t->flags & HACOO_WIDE) {
+        count += t->wide_buckets[i].size;
+      } else {
+        size_t size;
+        hacoo_bucket_entries(t, i, &size);
+        count += size;
+      }
+    }
+    part_start[p + 1] = count;
+  }
+  part_start[0] = 0;
+  for (size_t p = 0; p < nparts; p++) {
+    part_start[p + 1] += part_start[p];
+  }
+
+  #pragma omp parallel for schedule(static)
+  for (size_t p = 0; p < nparts; p++) {
+    struct hacoo_cursor c;
+    struct hacoo_block *b = malloc(sizeof(struct hacoo_block));
+    size_t z = part_start[p];
+
+    hacoo_cursor_init(t, &c, COO_PART_FIRST(p, nparts, t->nbuckets),
+                      COO_PART_FIRST(p + 1, nparts, t->nbuckets));
+    while (hacoo_next_block(t, &c, b)) {
+      memcpy(&morton[z], b->morton, b->count * sizeof(uint64_t));
+      if (morton_hi) {
+        memcpy(&morton_hi[z], b->morton_hi, b->count * sizeof(uint64_t));
+      }
+      memcpy(&value[z], b->value, b->count * sizeof(double));
+      z += b->count;
+    }
+    free(b);
+  }
+}
+
+/* One stable counting sort pass of a radix sort on the digit of the codes
+ * starting at bit, which is in the high word from bit 64 on. Each thread
+ * counts the digits of its slice of the input, the counts are turned into
+ * starting positions digit by digit and thread by thread, and each thread
+ * then scatters its slice. count holds RADIX entries per thread. */
+static void radix_pass(size_t nnz, const uint64_t *key,
+                       const uint64_t *key_hi, const double *value,
+                       uint64_t *out, uint64_t *out_hi, double *out_value,
+                       unsigned int bit, size_t *count)
+{
+  const uint64_t *digits = bit < 64 ? key : key_hi;
+  unsigned int shift = bit % 64;
+
+  #pragma omp parallel
+  {
+    int tid = omp_get_thread_num();
+    int nthreads = omp_get_num_threads();
+    size_t first = nnz * tid / nthreads;
+    size_t last = nnz * (tid + 1) / nthreads;
+    size_t *mine = &count[tid * RADIX];
+
+    memset(mine, 0, RADIX * sizeof(size_t));
+    for (size_t z = first; z < last; z++) {
+      mine[(digits[z] >> shift) & (RADIX - 1)]++;
+    }
+    #pragma omp barrier
+
+    #pragma omp single
+    {
+      size_t pos = 0;
+      for (size_t d = 0; d < RADIX; d++) {
+        for (int i = 0; i < nthreads; i++) {
+          size_t c = count[i * RADIX + d];
+          count[i * RADIX + d] = pos;
+          pos += c;
+        }
+      }
+    }
+
+    for (size_t z = first; z < last; z++) {
+      size_t pos = mine[(digits[z] >> shift) & (RADIX - 1)]++;
+      out[pos] = key[z];
+      if (key_hi) {
+        out_hi[pos] = key_hi[z];
+      }
+      out_value[pos] = value[z];
+    }
+  }
+}
+
+/* Group a list of codes by bucket into the packed arrays of t, which must
+ * hold no other storage.
+ *
+ * Each thread moves its slice of the input into a staging area grouped by
+ * bucket range, then every range is sorted into its buckets on its own.
+ * Both moves are stable, so a bucket keeps its entries in input order and
+ * the last of a repeated index wins, as with hacoo_set. */
+static int coo_scatter(struct hacoo_tensor *t, const uint64_t *code,
+                       const uint64_t *code_hi, const double *vals, size_t nnz)
+{
+  int wide = code_hi != NULL;
+  size_t nbuckets = t->nbuckets;
+  size_t max_threads = omp_get_max_threads();
+  size_t nparts = max_threads * 4 < nbuckets ? max_threads * 4 : nbuckets;
+  size_t n = nnz ? nnz : 1;
+
+  uint64_t *stage = malloc(n * sizeof(uint64_t));
+  uint64_t *stage_hi = wide ? malloc(n * sizeof(uint64_t)) : NULL;
+  double *stage_value = malloc(n * sizeof(double));
+  size_t *counts = calloc(max_threads * nparts, sizeof(size_t));
+  size_t *part_start = malloc((nparts + 1) * sizeof(size_t));
+  size_t *kept = malloc(nparts * sizeof(size_t));
+  t->packed_morton = malloc(n * sizeof(uint64_t));
+  t->packed_morton_hi = wide ? malloc(n * sizeof(uint64_t)) : NULL;
+  t->packed_value = malloc(n * sizeof(double));
+  t->offsets = calloc(nbuckets + 1, sizeof(size_t));
+
+  if (!stage || (wide && !stage_hi) || !stage_value || !counts ||
+      !part_start || !kept || !t->packed_morton ||
+      (wide && !t->packed_morton_hi) || !t->packed_value || !t->offsets) {
+    free(t->packed_morton);
+    free(t->packed_morton_hi);
+    free(t->packed_value);
+    free(t->offsets);
+    t->packed_morton = t->packed_morton_hi = NULL;
+    t->packed_value = NULL;
+    t->offsets = NULL;
+    free(stage);
+    free(stage_hi);
+    free(stage_value);
+    free(counts);
+    free(part_start);
+    free(kept);
+    return -1;
+  }
+
+  #pragma omp parallel
+  {
+    size_t tid = omp_get_thread_num();
+    size_t nthreads = omp_get_num_threads();
+    size_t chunk = (nnz + nthreads - 1) / nthreads;
+    size_t z0 = tid * chunk < nnz ? tid * chunk : nnz;
+    size_t z1 = z0 + chunk < nnz ? z0 + chunk : nnz;
+    size_t *mine = &counts[tid * nparts];
+
+    // Count this thread's entries per range
+    for (size_t z = z0; z < z1; z++) {
+      mine[COO_PART(hacoo_coo_bucket(t, code, code_hi, z), nparts, nbuckets)]++;
+    }
+    #pragma omp barrier
+
+    // Ranges are laid out in order, and threads in order within a range
+    #pragma omp single
+    {
+      size_t pos = 0;
+      for (size_t p = 0; p < nparts; p++) {
+        part_start[p] = pos;
+        for (size_t th = 0; th < nthreads; th++) {
+          size_t c = counts[th * nparts + p];
+          counts[th * nparts + p] = pos;
+          pos += c;
+        }
+      }
+      part_start[nparts] = pos;
+    }
+
+    for (size_t z = z0; z < z1; z++) {
+      size_t pos = mine[COO_PART(hacoo_coo_bucket(t, code, code_hi, z),
+                                 nparts, nbuckets)]++;
+      stage[pos] = code[z];
+      if (wide) {
+        stage_hi[pos] = code_hi[z];
+      }
+      stage_value[pos] = vals[z];
+    }
+    #pragma omp barrier
+
+    #pragma omp for schedule(dynamic, 1)
+    for (size_t p = 0; p < nparts; p++) {
+      kept[p] = coo_sort_part(t, stage, stage_hi, stage_value, part_start[p],
+                              part_start[p + 1],
+                              COO_PART_FIRST(p, nparts, nbuckets),
+                              COO_PART_FIRST(p + 1, nparts, nbuckets));
+    }
+  }
+
+  // Close the gaps left by repeated indices, using the staging area as the
+  // new packed arrays
+  size_t total = 0;
+  for (size_t p = 0; p < nparts; p++) {
+    total += kept[p];
+  }
+
+  if (total != nnz) {
+    size_t *new_start = counts;
+    for (size_t p = 0, pos = 0; p < nparts; p++) {
+      new_start[p] = pos;
+      pos += kept[p];
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t p = 0; p < nparts; p++) {
+      size_t from = part_start[p], to = new_start[p];
+      memcpy(&stage[to], &t->packed_morton[from], kept[p] * sizeof(uint64_t));
+      if (wide) {
+        memcpy(&stage_hi[to], &t->packed_morton_hi[from],
+               kept[p] * sizeof(uint64_t));
+      }
+      memcpy(&stage_value[to], &t->packed_value[from], kept[p] * sizeof(double));
+      for (size_t b = COO_PART_FIRST(p, nparts, nbuckets);
+           b < COO_PART_FIRST(p + 1, nparts, nbuckets); b++) {
+        t->offsets[b] -= from - to;
+      }
+    }
+
+    uint64_t *swap = t->packed_morton;
+    t->packed_morton = stage;
+    stage = swap;
+    swap = t->packed_morton_hi;
+    t->packed_morton_hi = stage_hi;
+    stage_hi = swap;
+    double *swap_value = t->packed_value;
+    t->packed_value = stage_value;
+    stage_value = swap_value;
+  }
+  t->offsets[nbuckets] = total;
+  t->nnz = total;
+
+  free(stage);
+  free(stage_hi);
+  free(stage_value);
+  free(counts);
+  free(part_start);
+  free(kept);
+  return 0;
+}
+
+/* Sort staged entries [first, last), which all hash to buckets [b0, b1),
+ * into the packed arrays of t at the same positions, dropping repeated
+ * indices, and zeros under HACOO_DROP_ZEROS. Returns the number of entries
+ * kept, which start at first. */
+static size_t coo_sort_part(struct hacoo_tensor *t, const uint64_t *stage,
+                            const uint64_t *stage_hi, const double *stage_value,
+                            size_t first, size_t last, size_t b0, size_t b1)
+{
+  uint64_t *lo = t->packed_morton, *hi = t->packed_morton_hi;
+  double *value = t->packed_value;
+  size_t *offsets = t->offsets;
+  int wide = stage_hi != NULL;
+
+  // Count the entries of each bucket, then turn counts into start offsets
+  for (size_t r = first; r < last; r++) {
+    offsets[hacoo_coo_bucket(t, stage, stage_hi, r)]++;
+  }
+  for (size_t b = b0, pos = first; b < b1; b++) {
+    size_t c = offsets[b];
+    offsets[b] = pos;
+    pos += c;
+  }
+
+  // Scatter in staged order. offsets[b] walks up to the start of bucket
+  // b + 1, so shift them back afterwards.
+  for (size_t r = first; r < last; r++) {
+    size_t pos = offsets[hacoo_coo_bucket(t, stage, stage_hi, r)]++;
+    lo[pos] = stage[r];
+    if (wide) {
+      hi[pos] = stage_hi[r];
+    }
+    value[pos] = stage_value[r];
+  }
+  for (size_t b = b1; b > b0 + 1; b--) {
+    offsets[b - 1] = offsets[b - 2];
+  }
+  if (b1 > b0) {
+    offsets[b0] = first;
+  }
+
+  // Repeated indices keep their last value
+  size_t w = first;
+  for (size_t b = b0; b < b1; b++) {
+    size_t start = w, end = b + 1 < b1 ? offsets[b + 1] : last;
+
+    for (size_t r = offsets[b]; r < end; r++) {
+      size_t d;
+      for (d = start; d < w; d++) {
+        if (lo[d] == lo[r] && (!wide || hi[d] == hi[r])) {
+          break;
+        }
+      }
+      if (d < w) {
+        value[d] = value[r];
+        continue;
+      }
+      lo[w] = lo[r];
+      if (wide) {
+        hi[w] = hi[r];
+      }
+      value[w] = value[r];
+      w++;
+    }
+
+    // Entries whose last value is zero are removals
+    if (t->flags & HACOO_DROP_ZEROS) {
+      size_t k = start;
+      for (size_t r = start; r < w; r++) {
+        if (value[r] == 0.0) {
+          continue;
+        }
+        lo[k] = lo[r];
+        if (wide) {
+          hi[k] = hi[r];
+        }
+        value[k] = value[r];
+        k++;
+      }
+      w = k;
+    }
+    offsets[b] = start;
+  }
+  return w - first;
+}
+
+/* Bucket of entry z of a list of codes, code_hi is NULL unless wide */
+static size_t hacoo_coo_bucket(struct hacoo_tensor *t, const uint64_t *code,
+                               const uint64_t *code_hi, size_t z)
+{
+  if (code_hi) {
+    uint64_t c[2] = {code[z], code_hi[z]};
+    return wide_bucket_index(t, c);
+  }
+  return hacoo_bucket_index(t, code[z]);
+}
+
+static size_t hacoo_bucket_index(struct hacoo_tensor *t,
+                                 unsigned long long morton)
+{
+  return shift_hash(morton, t->sx, t->sy, t->sz, t->nbuckets);
+}
+
+/* Bucket of morton in the table an incremental rehash is moving from */
+static size_t old_bucket_index(struct hacoo_tensor *t,
+                               unsigned long long morton)
+{
+  return shift_hash(morton, t->old_sx, t->old_sy, t->old_sz, t->old_nbuckets);
+}
+
+static size_t shift_hash(unsigned long long morton, unsigned int sx,
+                         unsigned int sy, unsigned int sz, size_t nbuckets)
+{
+  unsigned long long hash = morton;
+
+  hash = hash + (hash << sx);
+  hash = hash ^ (hash >> sy);
+  hash = hash + (hash << sz);
+  return hash % nbuckets;
+}
+
+/* Bits each mode needs for its largest index, returns their sum. A mode
+ * of size d is given the bits of d itself so one-based indices fit too. */
+static unsigned int hacoo_mode_bits(unsigned int ndims, unsigned int *dims,
+                                    unsigned int *bits)
+{
+  unsigned int total = 0;
+
+  for (unsigned int i = 0; i < ndims; i++) {
+    bits[i] = 0;
+    while (bits[i] < 32 && (dims[i] >> bits[i])) {
+      bits[i]++;
+    }
+    total += bits[i];
+  }
+  return total;
+}
+
+/* Take bits from the widest modes until the sum is at most total */
+static void hacoo_fit_bits(unsigned int ndims, unsigned int *bits,
+                           unsigned int total)
+{
+  unsigned int sum = 0;
+
+  for (unsigned int i = 0; i < ndims; i++) {
+    sum += bits[i];
+  }
+  while (sum > total) {
+    unsigned int widest = 0;
+    for (unsigned int i = 1; i < ndims; i++) {
+      if (bits[i] > bits[widest]) {
+        widest = i;
+      }
+    }
+    bits[widest]--;
+    sum--;
+  }
+}
+
+/* Fold the high word in before the usual shift hash */
+static size_t wide_bucket_index(struct hacoo_tensor *t, const uint64_t *code)
+{
+  return hacoo_bucket_index(t, code[0] ^ (code[1] * 0x9e3779b97f4a7c15ULL));
+}
+
+static void hacoo_compute_params(struct hacoo_tensor *t)
+{
+  unsigned int bits;
+
+  bits = ceil(log(t->nbuckets) / log(2));
+  t->sx = ceil(bits / 8) - 1;
+  t->sy = 4 * t->sx - 1;
+  if (t->sy < 1)
+  {
+    t->sy = 1;
+  }
+  t->sz = ceil(bits / 2);
+}
+
+
+static struct hacoo_bucket *hacoo_bucket_search(bucket_vector *vec,
+                                                unsigned long long morton)
+{
+  for (size_t i = 0; i < vec->size; i++) {
+    if (vec->data[i].morton == morton) {
+      return &vec->data[i];
+    }
+  }
+  return NULL;
+}
+
+/* Find the slot holding morton in a flat table. Robin Hood ordering lets
+ * the probe stop as soon as it reaches a slot closer to its home than we
+ * are to ours. */
+static struct hacoo_bucket *flat_search(struct hacoo_tensor *t,
+                                        unsigned long long morton)
+{
+  size_t i = hacoo_bucket_index(t, morton);
+
+  for (unsigned int d = 1; d <= t->dist[i]; d++) {
+    if (t->slots[i].morton == morton) {
+      return &t->slots[i];
+    }
+    if (++i == t->nbuckets) {
+      i = 0;
+    }
+  }
+  return NULL;
+}
+
+/* Empty the slot holding morton. Returns 1 if there was one. */
+static int flat_remove(struct hacoo_tensor *t, unsigned long long morton)
+{
+  struct hacoo_bucket *b = flat_search(t, morton);
+  if (!b) {
+    return 0;
+  }
+  flat_erase(t, b);
+  return 1;
+}
+
+/* Empty slot b. The entries after it in the same probe run move back one
+ * slot, so no probe stops early at the hole. */
+static void flat_erase(struct hacoo_tensor *t, struct hacoo_bucket *b)
+{
+  size_t i = b - t->slots;
+  for (;;) {
+    size_t next = i + 1 == t->nbuckets ? 0 : i + 1;
+    if (t->dist[next] <= 1) {
+      break;
+    }
+    t->slots[i] = t->slots[next];
+    t->dist[i] = t->dist[next] - 1;
+    i = next;
+  }
+  t->dist[i] = 0;
+}
+
+/* Find the value stored for morton in a frozen tensor. A frozen flat table keeps one entry per
+ * slot, so we probe slots until we reach an empty one. */
+static double *frozen_search(struct hacoo_tensor *t, unsigned long long morton)
+{
+  size_t i = hacoo_bucket_index(t, morton);
+
+  if (!(t->flags & HACOO_FLAT)) {
+    for (size_t z = t->offsets[i]; z < t->offsets[i + 1]; z++) {
+      if (t->packed_morton[z] == morton) {
+        return &t->packed_value[z];
+      }
+    }
+    return NULL;
   }
 
-  hacoo_compute_params(t);
-  return t;
-
-error:
-  if (t) {
-    hacoo_free(t);
+  while (t->offsets[i] != t->offsets[i + 1]) {
+    if (t->packed_morton[t->offsets[i]] == morton) {
+      return &t->packed_value[t->offsets[i]];
+    }
+    if (++i == t->nbuckets) {
+      i = 0;
+    }
   }
   return NULL;
 }
 
-void hacoo_free(struct hacoo_tensor *t)
+/* The bucket that holds or would hold morton. While an incremental rehash
+ * runs, old buckets that have not moved yet still own their entries. */
+static bucket_vector *chained_home(struct hacoo_tensor *t,
+                                   unsigned long long morton)
 {
-  if (t->dims) {free(t->dims);}
-  if (t->buckets) {hacoo_free_buckets(t);}
-  free(t);
+  if (t->old_buckets) {
+    size_t i = old_bucket_index(t, morton);
+    if (i >= t->migrated) {
+      return &t->old_buckets[i];
+    }
+  }
+  return &t->buckets[hacoo_bucket_index(t, morton)];
 }
 
-/* Access functions */
-void hacoo_set(struct hacoo_tensor *t, unsigned int *index, double value)
+static void chained_set(struct hacoo_tensor *t, unsigned long long morton,
+                        double value, hacoo_combiner combine)
 {
-  unsigned long long morton = hacoo_morton(t->ndims, index);
-  size_t i = hacoo_bucket_index(t, morton);
-
-  bucket_vector *vec = &t->buckets[i];
-
-  // Search for existing bucket with same morton code
-  struct hacoo_bucket *b = hacoo_bucket_search(vec, morton);
-
-  // If not found, insert new bucket
-  if (!b) {
-    struct hacoo_bucket new_bucket;
-    new_bucket.morton = morton;
-    new_bucket.value = value;
+  // Every write moves a few more buckets of a rehash in progress
+  if (t->old_buckets) {
+    chained_migrate(t, MIGRATE_BUCKETS);
+  }
 
-    bucket_vector_push_back(vec, new_bucket);
-    t->nnz++; // Increment number of nonzeros
+  int added = bucket_upsert(chained_home(t, morton), morton, value, combine,
+                            (t->flags & HACOO_DROP_ZEROS) != 0, t->arena);
+  if (added <= 0) {
+    t->nnz += added;
     return;
   }
-
-  // If found, update value
-  b->value = value;
+  t->nnz++;
 
   // Check if we need to rehash
-  if (t->nbuckets > 0 &&
-      ((double)t->nnz / (double)t->nbuckets) > ((double)t->load / 100.0)) {
-    hacoo_rehash(&t);
-    if (t == NULL) {
-      fprintf(stderr, "Rehash failed, exiting.\n");
+  if ((double)t->nnz / (double)t->nbuckets <= (double)t->load / 100.0) {
+    return;
+  }
+  if (t->flags & HACOO_INCREMENTAL) {
+    hacoo_finish_rehash(t);
+    if (chained_start_resize(t, t->nbuckets * 2) == 0) {
       return;
     }
   }
+  if (chained_resize(t, t->nbuckets * 2)) {
+    fprintf(stderr, "Failed to grow buckets.\n");
+  }
 }
 
-void hacoo_rehash(struct hacoo_tensor **t)
+/* Combine value into the entry for morton in vec, adding the entry if
+ * there is none. With drop_zeros an entry that comes to zero is erased,
+ * and a zero adds none. Returns the change in entries: 1, 0 or -1. */
+static int bucket_upsert(bucket_vector *vec, unsigned long long morton,
+                         double value, hacoo_combiner combine, int drop_zeros,
+                         struct vector_arena *arena)
 {
-  // Step 1: Allocate new tensor with 2x buckets
-  struct hacoo_tensor *dummy = hacoo_alloc((*t)->ndims, (*t)->dims, (*t)->nbuckets * 2, (*t)->load);
-  if (dummy == NULL) {
-    fprintf(stderr, "Failed to allocate dummy tensor during rehash.\n");
-    return;
-  }
-
-  hacoo_compute_params(dummy);
+  struct hacoo_bucket *b = hacoo_bucket_search(vec, morton);
 
-  unsigned int *index = malloc(sizeof(unsigned int) * (*t)->ndims);
-  if (!index) {
-    fprintf(stderr, "Error: Failed to allocate index array during rehash.\n");
-    hacoo_free(dummy);
-    return;
+  // If found, update value
+  if (b) {
+    b->value = combine ? combine(b->value, value) : value;
+    if (drop_zeros && b->value == 0.0) {
+      bucket_vector_erase(vec, b - vec->data);
+      return -1;
+    }
+    return 0;
+  }
+  if (drop_zeros && value == 0.0) {
+    return 0;
   }
 
-  int nnz = 0;
+  struct hacoo_bucket new_bucket;
+  new_bucket.morton = morton;
+  new_bucket.value = value;
+  bucket_vector_push_back_in(vec, new_bucket, arena);
+  return 1;
+}
 
-  // Reinsert all elements from old tensor into new one
-  for (size_t i = 0; i < (*t)->nbuckets; i++) {
-    bucket_vector *vec = &(*t)->buckets[i];
-    for (size_t j = 0; j < vec->size; ++j) {
-      struct hacoo_bucket *b = &vec->data[j];
-      hacoo_extract_index(b, (*t)->ndims, index);
-      hacoo_set(dummy, index, b->value);
-      nnz++;
+/* Remove the entry for morton from vec. Returns 1 if there was one. */
+static int bucket_remove(bucket_vector *vec, unsigned long long morton)
+{
+  for (size_t i = 0; i < vec->size; i++) {
+    if (vec->data[i].morton == morton) {
+      bucket_vector_erase(vec, i);
+      return 1;
     }
   }
+  return 0;
+}
+
+/* Move every entry of a chained tensor into nbuckets new buckets */
+static int chained_resize(struct hacoo_tensor *t, size_t nbuckets)
+{
+  if (chained_start_resize(t, nbuckets)) {
+    return -1;
+  }
+  hacoo_finish_rehash(t);
+  return 0;
+}
 
-  if ((*t)->nnz != nnz) {
-    printf("Something went wrong. Only %d nnz copied when there were originally %d nnz.\n", nnz, (*t)->nnz);
+/* Swap in nbuckets empty buckets and keep the current ones as the old
+ * table. Entries move over in chained_migrate. The new vectors start
+ * zeroed, so nothing here grows with the table size apart from calloc. */
+static int chained_start_resize(struct hacoo_tensor *t, size_t nbuckets)
+{
+  bucket_vector *buckets = calloc(nbuckets, sizeof(bucket_vector));
+  if (!buckets) {
+    return -1;
   }
+  drop_prefix(t);
+
+  t->old_buckets = t->buckets;
+  t->old_nbuckets = t->nbuckets;
+  t->old_sx = t->sx;
+  t->old_sy = t->sy;
+  t->old_sz = t->sz;
+  t->migrated = 0;
 
-  // Copy important fields
-  (*t)->sx = dummy->sx;
-  (*t)->sy = dummy->sy;
-  (*t)->sz = dummy->sz;
+  t->buckets = buckets;
+  t->nbuckets = nbuckets;
+  hacoo_compute_params(t);
+  return 0;
+}
 
-  // Free old bucket vectors
-  hacoo_free_buckets(*t);
+/* Move up to nmigrate old buckets into the new table */
+static void chained_migrate(struct hacoo_tensor *t, size_t nmigrate)
+{
+  size_t end = t->migrated + nmigrate;
+  if (end > t->old_nbuckets || end < t->migrated) {
+    end = t->old_nbuckets;
+  }
 
-  // Swap buckets and metadata from dummy
-  (*t)->buckets = dummy->buckets;
-  (*t)->nbuckets = dummy->nbuckets;
-  (*t)->nnz = dummy->nnz;
+  for (; t->migrated < end; t->migrated++) {
+    bucket_vector *vec = &t->old_buckets[t->migrated];
+    for (size_t j = 0; j < vec->size; j++) {
+      bucket_vector_push_back_in(&t->buckets[hacoo_bucket_index(t, vec->data[j].morton)],
+                                 vec->data[j], t->arena);
+    }
+    bucket_vector_free_in(vec, t->arena);
+  }
 
-  dummy->buckets = NULL; // Prevent double free
-  hacoo_free(dummy);
-  free(index);
+  if (t->migrated == t->old_nbuckets) {
+    free(t->old_buckets);
+    t->old_buckets = NULL;
+    t->old_nbuckets = 0;
+  }
 }
 
-double hacoo_get(struct hacoo_tensor *t, unsigned int *index)
+/* Value stored for a code, or 0 if there is none */
+static double hacoo_lookup(struct hacoo_tensor *t, uint64_t morton,
+                           uint64_t morton_hi)
 {
-  unsigned long long morton = hacoo_morton(t->ndims, index);
-  unsigned int i = hacoo_bucket_index(t, morton);
-  bucket_vector *vec = &t->buckets[i];
+  if (t->flags & HACOO_WIDE) {
+    uint64_t code[2] = {morton, morton_hi};
+    double *v;
+    if (t->offsets) {
+      v = frozen_search_wide(t, code);
+    } else {
+      struct hacoo_wide_bucket *wb =
+          wide_bucket_search(&t->wide_buckets[wide_bucket_index(t, code)], code);
+      v = wb ? &wb->value : NULL;
+    }
+    return v ? *v : 0.0;
+  }
+
+  struct hacoo_bucket *b;
+
+  if (t->offsets) {
+    double *v = frozen_search(t, morton);
+    return v ? *v : 0.0;
+  } else if (t->flags & HACOO_FLAT) {
+    b = flat_search(t, morton);
+  } else {
+    // Search for existing bucket with same morton code, which may not have
+    // moved yet if a rehash is in progress
+    b = hacoo_bucket_search(chained_home(t, morton), morton);
+  }
 
-  // Search for existing bucket with same morton code
-  struct hacoo_bucket *b = hacoo_bucket_search(vec, morton);
   if (b)
   {
     return b->value;
@@ -178,105 +2453,271 @@ double hacoo_get(struct hacoo_tensor *t, unsigned int *index)
   return 0.0;
 }
 
-/* Extract the index from a bucket */
-void hacoo_extract_index(struct hacoo_bucket *b, unsigned int n,
-                         unsigned int *index)
+/* First thing a lookup of a code reads: its bucket vector, flat slot or
+ * frozen offset */
+static const void *lookup_head(struct hacoo_tensor *t, uint64_t morton,
+                               uint64_t morton_hi)
 {
-    size_t max_bits = hacoo_max_bits(n);
+  size_t i;
 
-    // Initialize the index array
-    for (unsigned int i = 0; i < n; i++) {
-        index[i] = 0;
-    }
+  if (t->flags & HACOO_WIDE) {
+    uint64_t code[2] = {morton, morton_hi};
+    i = wide_bucket_index(t, code);
+    return t->offsets ? (const void *)&t->offsets[i]
+                      : (const void *)&t->wide_buckets[i];
+  }
+  if (!t->offsets && !(t->flags & HACOO_FLAT)) {
+    return chained_home(t, morton);
+  }
 
-    // De-interleave the Morton code bits into the index array
-    for (unsigned int bit = 0; bit < max_bits; bit++) {
-        for (unsigned int i = 0; i < n; i++) {
-            index[i] |= ((b->morton >> (bit * n + i)) & 1) << bit;
-        }
+  i = hacoo_bucket_index(t, morton);
+  if (t->offsets) {
+    return &t->offsets[i];
+  }
+  __builtin_prefetch(&t->dist[i]);
+  return &t->slots[i];
+}
+
+/* Prefetch the entries a lookup head points to */
+static void prefetch_entries(struct hacoo_tensor *t, const void *head)
+{
+  if (t->offsets) {
+    size_t z = *(const size_t *)head;
+    __builtin_prefetch(&t->packed_morton[z]);
+    __builtin_prefetch(&t->packed_value[z]);
+    if (t->packed_morton_hi) {
+      __builtin_prefetch(&t->packed_morton_hi[z]);
     }
+  } else if (t->flags & HACOO_WIDE) {
+    __builtin_prefetch(((const wide_bucket_vector *)head)->data);
+  } else if (!(t->flags & HACOO_FLAT)) {
+    __builtin_prefetch(((const bucket_vector *)head)->data);
+  }
 }
 
-/* Helper function implementations. */
+static struct hacoo_wide_bucket *wide_bucket_search(wide_bucket_vector *vec,
+                                                    const uint64_t *code)
+{
+  for (size_t i = 0; i < vec->size; i++) {
+    if (vec->data[i].morton[0] == code[0] && vec->data[i].morton[1] == code[1]) {
+      return &vec->data[i];
+    }
+  }
+  return NULL;
+}
 
-/* free buckets given a specific hacoo tensor*/
-static void hacoo_free_buckets(struct hacoo_tensor *t)
+static double *frozen_search_wide(struct hacoo_tensor *t, const uint64_t *code)
 {
-  for (size_t i = 0; i < t->nbuckets; i++) {
-    bucket_vector_free(&t->buckets[i]);
+  size_t i = wide_bucket_index(t, code);
+
+  for (size_t z = t->offsets[i]; z < t->offsets[i + 1]; z++) {
+    if (t->packed_morton[z] == code[0] && t->packed_morton_hi[z] == code[1]) {
+      return &t->packed_value[z];
+    }
   }
-  free(t->buckets);
-  t->buckets = NULL;
+  return NULL;
 }
 
-/* free only buckets */
-static void free_buckets(bucket_vector *buckets, size_t nbuckets)
+static void wide_set(struct hacoo_tensor *t, const uint64_t *code,
+                     double value, hacoo_combiner combine)
 {
-  for (size_t i = 0; i < nbuckets; ++i) {
-    bucket_vector_free(&buckets[i]);
+  int added = wide_bucket_upsert(&t->wide_buckets[wide_bucket_index(t, code)],
+                                 code, value, combine,
+                                 (t->flags & HACOO_DROP_ZEROS) != 0, t->arena);
+  if (added <= 0) {
+    t->nnz += added;
+    return;
+  }
+  t->nnz++;
+
+  if ((double)t->nnz / (double)t->nbuckets > (double)t->load / 100.0 &&
+      wide_resize(t, t->nbuckets * 2)) {
+    fprintf(stderr, "Failed to grow wide buckets.\n");
   }
-  free(buckets);
 }
 
-// Encodes index, returns morton code
-// n: ndimensions
-static uint64_t hacoo_morton(unsigned int n, unsigned int *index)
+/* bucket_upsert for a wide bucket */
+static int wide_bucket_upsert(wide_bucket_vector *vec, const uint64_t *code,
+                              double value, hacoo_combiner combine,
+                              int drop_zeros, struct vector_arena *arena)
 {
-    uint64_t m = 0;
-    size_t max_bits = hacoo_max_bits(n);
+  struct hacoo_wide_bucket *b = wide_bucket_search(vec, code);
 
-    for (unsigned int bit = 0; bit < max_bits; bit++) {
-        for (unsigned int i = 0; i < n; i++) {
-            m |= ((uint64_t)((index[i] >> bit) & 1)) << (bit * n + i);
-        }
+  if (b) {
+    b->value = combine ? combine(b->value, value) : value;
+    if (drop_zeros && b->value == 0.0) {
+      wide_bucket_vector_erase(vec, b - vec->data);
+      return -1;
     }
+    return 0;
+  }
+  if (drop_zeros && value == 0.0) {
+    return 0;
+  }
 
-    return m;
+  struct hacoo_wide_bucket nb;
+  nb.morton[0] = code[0];
+  nb.morton[1] = code[1];
+  nb.value = value;
+  wide_bucket_vector_push_back_in(vec, nb, arena);
+  return 1;
 }
 
-static size_t hacoo_bucket_index(struct hacoo_tensor *t,
-                                 unsigned long long morton)
+static int wide_bucket_remove(wide_bucket_vector *vec, const uint64_t *code)
 {
-  unsigned long long hash = morton;
-
-  hash = hash + (hash << t->sx);
-  hash = hash ^ (hash >> t->sy);
-  hash = hash + (hash << t->sz);
-  return hash % t->nbuckets;
+  for (size_t i = 0; i < vec->size; i++) {
+    if (vec->data[i].morton[0] == code[0] && vec->data[i].morton[1] == code[1]) {
+      wide_bucket_vector_erase(vec, i);
+      return 1;
+    }
+  }
+  return 0;
 }
 
-static void hacoo_compute_params(struct hacoo_tensor *t)
+/* Move every entry of a wide tensor into nbuckets new buckets */
+static int wide_resize(struct hacoo_tensor *t, size_t nbuckets)
 {
-  unsigned int bits;
+  wide_bucket_vector *old = t->wide_buckets;
+  size_t old_n = t->nbuckets;
 
-  bits = ceil(log(t->nbuckets) / log(2));
-  t->sx = ceil(bits / 8) - 1;
-  t->sy = 4 * t->sx - 1;
-  if (t->sy < 1)
-  {
-    t->sy = 1;
+  drop_prefix(t);
+
+  t->wide_buckets = calloc(nbuckets, sizeof(wide_bucket_vector));
+  if (!t->wide_buckets) {
+    t->wide_buckets = old;
+    return -1;
   }
-  t->sz = ceil(bits / 2);
+  t->nbuckets = nbuckets;
+  hacoo_compute_params(t);
+
+  for (size_t i = 0; i < old_n; i++) {
+    for (size_t j = 0; j < old[i].size; j++) {
+      struct hacoo_wide_bucket *b = &old[i].data[j];
+      wide_bucket_vector_push_back_in(&t->wide_buckets[wide_bucket_index(t, b->morton)],
+                                      *b, t->arena);
+    }
+    wide_bucket_vector_free_in(&old[i], t->arena);
+  }
+  free(old);
+  return 0;
 }
 
+/* Place a new entry in a flat table, displacing entries that are closer to
+ * their home slot. Returns -1 if a probe distance outgrows MAX_DIST, in
+ * which case b holds the displaced entry that still needs a slot. */
+static int flat_insert(struct hacoo_tensor *t, struct hacoo_bucket *b)
+{
+  size_t i = hacoo_bucket_index(t, b->morton);
+  unsigned int d = 1;
+
+  for (;;) {
+    if (t->dist[i] == 0) {
+      t->slots[i] = *b;
+      t->dist[i] = d;
+      return 0;
+    }
+
+    // Rich entry gives up its slot to the poorer one we carry
+    if (t->dist[i] < d) {
+      struct hacoo_bucket tmp = t->slots[i];
+      unsigned int td = t->dist[i];
+      t->slots[i] = *b;
+      t->dist[i] = d;
+      *b = tmp;
+      d = td;
+    }
 
-static struct hacoo_bucket *hacoo_bucket_search(bucket_vector *vec,
-                                                unsigned long long morton)
+    if (++i == t->nbuckets) {
+      i = 0;
+    }
+    if (++d > MAX_DIST) {
+      return -1;
+    }
+  }
+}
+
+static void flat_set(struct hacoo_tensor *t, unsigned long long morton,
+                     double value, hacoo_combiner combine)
 {
-  for (size_t i = 0; i < vec->size; i++) {
-    if (vec->data[i].morton == morton) {
-      return &vec->data[i];
+  struct hacoo_bucket *b = flat_search(t, morton);
+  int drop_zeros = (t->flags & HACOO_DROP_ZEROS) != 0;
+
+  if (b) {
+    b->value = combine ? combine(b->value, value) : value;
+    if (drop_zeros && b->value == 0.0) {
+      flat_erase(t, b);
+      t->nnz--;
     }
+    return;
   }
-  return NULL;
+  if (drop_zeros && value == 0.0) {
+    return;
+  }
+
+  struct hacoo_bucket nb;
+  nb.morton = morton;
+  nb.value = value;
+
+  // Grow before the table passes its load limit
+  if ((double)(t->nnz + 1) / (double)t->nbuckets > (double)t->load / 100.0 &&
+      flat_resize(t, t->nbuckets * 2)) {
+    fprintf(stderr, "Failed to grow flat table.\n");
+    return;
+  }
+
+  while (flat_insert(t, &nb)) {
+    if (flat_resize(t, t->nbuckets * 2)) {
+      fprintf(stderr, "Failed to grow flat table.\n");
+      return;
+    }
+  }
+  t->nnz++;
 }
 
-static size_t hacoo_max_bits(unsigned int n)
+/* Move every entry of a flat table into a new table of nslots slots */
+static int flat_resize(struct hacoo_tensor *t, size_t nslots)
 {
-    size_t b1 = sizeof(uint64_t) * 8 / n;
-    size_t b2 = sizeof(unsigned int) * 8;
+  struct hacoo_bucket *old_slots = t->slots;
+  unsigned char *old_dist = t->dist;
+  size_t old_n = t->nbuckets;
+  size_t i;
+
+  drop_prefix(t);
+
+  for (;;) {
+    t->slots = malloc(nslots * sizeof(struct hacoo_bucket));
+    t->dist = calloc(nslots, sizeof(unsigned char));
+    if (!t->slots || !t->dist) {
+      free(t->slots);
+      free(t->dist);
+      t->slots = old_slots;
+      t->dist = old_dist;
+      t->nbuckets = old_n;
+      hacoo_compute_params(t);
+      return -1;
+    }
+    t->nbuckets = nslots;
+    hacoo_compute_params(t);
+
+    for (i = 0; i < old_n; i++) {
+      struct hacoo_bucket b = old_slots[i];
+      if (old_dist[i] && flat_insert(t, &b)) {
+        break;
+      }
+    }
+    if (i == old_n) {
+      break;
+    }
+
+    // a probe ran too long, start over in a bigger table
+    free(t->slots);
+    free(t->dist);
+    nslots *= 2;
+  }
 
-    return b1 < b2 ? b1 : b2;
+  free(old_slots);
+  free(old_dist);
+  return 0;
 }
 
 /*Allocate a new hacoo bucket.*/
@@ -321,21 +2762,120 @@ struct hacoo_tensor *read_tensor_file(FILE *file)
 /* Merge this with regular function at later time */
 struct hacoo_tensor *read_tensor_file_with_base(FILE *file, int zero_base)
 {
-  struct hacoo_tensor *t = file_init(file);
+  return read_tensor_file_flags(file, zero_base, HACOO_CHAINED);
+}
 
-  while(!feof(file)) {
-    file_entry_with_base(t, file, zero_base);
+/* Read a tensor from a tns file into the storage selected by flags */
+struct hacoo_tensor *read_tensor_file_flags(FILE *file, int zero_base,
+                                            unsigned int flags)
+{
+  unsigned int ndims;
+  unsigned int *dims = read_dims(file, &ndims);
+  if (!dims) {
+    return NULL;
+  }
+
+  // Collect the entries first so the tensor is built at its final size
+  size_t nnz = 0, capacity = 1024;
+  unsigned int *idx = malloc(capacity * ndims * sizeof(unsigned int));
+  double *vals = malloc(capacity * sizeof(double));
+  if (!idx || !vals) {
+    goto nomem;
+  }
+
+  for (;;) {
+    if (nnz == capacity) {
+      capacity *= 2;
+      unsigned int *new_idx = realloc(idx, capacity * ndims * sizeof(unsigned int));
+      double *new_vals = realloc(vals, capacity * sizeof(double));
+      if (new_idx) {
+        idx = new_idx;
+      }
+      if (new_vals) {
+        vals = new_vals;
+      }
+      if (!new_idx || !new_vals) {
+        goto nomem;
+      }
+    }
+
+    /* read the index */
+    unsigned int *index = &idx[nnz * ndims];
+    int negative = 0;
+    long long v;
+    unsigned int i;
+    for (i = 0; i < ndims; i++) {
+      if (fscanf(file, "%lld", &v) != 1) {
+        break;
+      }
+
+      /*if indexes are one-based, like FROSTT tensors,
+      then subtract 1 from everything*/
+      if (!zero_base) {
+        if (v == 0) {
+          fprintf(stderr, "Error: Tensor uses base-1 indexing but has index 0 in mode %u\n", i);
+          exit(EXIT_FAILURE);
+        }
+        v -= 1;
+      }
+      if (v < 0) {
+        fprintf(stderr, "Error: Negative index after base adjustment at mode %u: %lld\n", i, v);
+        negative = 1;
+      }
+      index[i] = (unsigned int) v;
+    }
+
+    /* read the value */
+    if (i < ndims || fscanf(file, "%lf", &vals[nnz]) != 1) {
+      break;
+    }
+    if (!negative) {
+      nnz++;
+    }
   }
 
+  struct hacoo_tensor *t = hacoo_build_from_coo(ndims, dims, nnz, idx, vals, flags);
+  free(dims);
+  free(idx);
+  free(vals);
   return t;
+
+nomem:
+  fprintf(stderr, "Error: Failed to allocate memory for tensor entries.\n");
+  free(dims);
+  free(idx);
+  free(vals);
+  return NULL;
 }
 
 /* Initialize a tensor from a file */
 struct hacoo_tensor *file_init(FILE *file) {
+  return file_init_flags(file, HACOO_CHAINED);
+}
+
+struct hacoo_tensor *file_init_flags(FILE *file, unsigned int flags) {
+  unsigned int count;
+  unsigned int *dims = read_dims(file, &count);
+  if (!dims)
+    return NULL;
+
+  // Allocate the tensor using the parsed dimensions
+  struct hacoo_tensor *t = hacoo_alloc_flags(count, dims, MIN_BUCKETS, LOAD,
+                                             flags);
+
+  // Free the allocated memory for the dimensions array
+  free(dims);
+
+  return t;
+}
+
+/* Parse the dimension line at the top of a tns file */
+static unsigned int *read_dims(FILE *file, unsigned int *ndims) {
 
   // Buffer to read the input line
   char buffer[1024];
-  fgets(buffer, sizeof(buffer), file);
+  if (!fgets(buffer, sizeof(buffer), file))
+    return NULL;
 
   // Count the number of integers in the line
   unsigned int count = 0;
@@ -357,13 +2897,8 @@ struct hacoo_tensor *file_init(FILE *file) {
     token = strtok(NULL, " ");
   }
 
-  // Allocate the tensor using the parsed dimensions
-  struct hacoo_tensor *t = hacoo_alloc(count, dims, MIN_BUCKETS, LOAD);
-
-  // Free the allocated memory for the dimensions array
-  free(dims);
-
-  return t;
+  *ndims = count;
+  return dims;
 }
 
 /* Read an entry from a file */
@@ -455,24 +2990,42 @@ void print_status(struct hacoo_tensor *t) {
 /* Print the tensor hash table with COO listings */
 void print_tensor(struct hacoo_tensor *t)
 {
-  unsigned int index[t->ndims];
+  struct hacoo_cursor c;
+  struct hacoo_block b;
+  unsigned int soa[t->ndims * HACOO_BLOCK];
+  unsigned int *index[t->ndims];
+
+  hacoo_finish_rehash(t);
+
+  for (unsigned int k = 0; k < t->ndims; k++) {
+    index[k] = &soa[k * HACOO_BLOCK];
+  }
 
   for (size_t i = 0; i < t->nbuckets; i++) {
-    bucket_vector *vec = &t->buckets[i];
+    int empty = 1;
 
-    if (vec->size == 0)
-      continue;
+    hacoo_cursor_init(t, &c, i, i + 1);
+    while (hacoo_next_block(t, &c, &b)) {
+      if (empty) {
+        printf("\nBucket %zu\n=============\n", i);
+        empty = 0;
+      }
 
-    printf("\nBucket %zu\n=============\n", i);
+      // Decode the block of codes at once
+      hacoo_block_indices(t, &b, index);
 
-    for (size_t j = 0; j < vec->size; j++) {
-      struct hacoo_bucket *b = &vec->data[j];
-      hacoo_extract_index(b, t->ndims, index);
-      printf("0x%llx: ", b->morton);
-      for (unsigned int k = 0; k < t->ndims; k++) {
-        printf("%u ", index[k]);
+      for (size_t j = 0; j < b.count; j++) {
+        if (b.morton_hi && b.morton_hi[j]) {
+          printf("0x%llx%016llx: ", (unsigned long long)b.morton_hi[j],
+                 (unsigned long long)b.morton[j]);
+        } else {
+          printf("0x%llx: ", (unsigned long long)b.morton[j]);
+        }
+        for (unsigned int k = 0; k < t->ndims; k++) {
+          printf("%u ", index[k][j]);
+        }
+        printf("%f\n", b.value[j]);
       }
-      printf("%f\n", b->value);
     }
   }
 }
@@ -481,16 +3034,97 @@ void print_tensor(struct hacoo_tensor *t)
 double frobenius_norm(struct hacoo_tensor *t)
 {
     double norm = 0.0;
+
+    hacoo_finish_rehash(t);
+
+    // Frozen tensors only need to stream the value array
+    if (t->offsets) {
+      double *value = t->packed_value;
+      size_t nnz = t->offsets[t->nbuckets];
+
+      #pragma omp simd reduction(+:norm)
+      for (size_t z = 0; z < nnz; z++) {
+        norm += value[z] * value[z];
+      }
+      return sqrt(norm);
+    }
+
     for (size_t i = 0; i < t->nbuckets; i++) {
-      bucket_vector *vec = &t->buckets[i];
-      for (size_t j = 0; j < vec->size; j++) {
-        struct hacoo_bucket *b = &vec->data[j];
+      if (t->flags & HACOO_WIDE) {
+        wide_bucket_vector *vec = &t->wide_buckets[i];
+        for (size_t j = 0; j < vec->size; j++) {
+          norm += vec->data[j].value * vec->data[j].value;
+        }
+        continue;
+      }
+
+      size_t count;
+      struct hacoo_bucket *entries = hacoo_bucket_entries(t, i, &count);
+      for (size_t j = 0; j < count; j++) {
+        struct hacoo_bucket *b = &entries[j];
         norm += b->value * b->value;
       }
     }
     return sqrt(norm);
 }
 
+/* Multiply every value in the tensor by alpha */
+void hacoo_scale(struct hacoo_tensor *t, double alpha)
+{
+    hacoo_finish_rehash(t);
+
+    // The Z-order stream, fiber indexes and row partitions stay in step
+    if (t->zorder_value) {
+      #pragma omp simd
+      for (size_t z = 0; z < t->nnz; z++) {
+        t->zorder_value[z] *= alpha;
+      }
+    }
+    for (size_t i = 0; t->csf && i < t->ndims; i++) {
+      if (t->csf[i]) {
+        #pragma omp simd
+        for (size_t z = 0; z < t->nnz; z++) {
+          t->csf[i]->value[z] *= alpha;
+        }
+      }
+    }
+    for (size_t i = 0; t->rowpart && i < t->ndims; i++) {
+      if (t->rowpart[i]) {
+        #pragma omp simd
+        for (size_t z = 0; z < t->nnz; z++) {
+          t->rowpart[i]->value[z] *= alpha;
+        }
+      }
+    }
+
+    if (t->offsets) {
+      double *value = t->packed_value;
+      size_t nnz = t->offsets[t->nbuckets];
+
+      #pragma omp simd
+      for (size_t z = 0; z < nnz; z++) {
+        value[z] *= alpha;
+      }
+      return;
+    }
+
+    for (size_t i = 0; i < t->nbuckets; i++) {
+      if (t->flags & HACOO_WIDE) {
+        wide_bucket_vector *vec = &t->wide_buckets[i];
+        for (size_t j = 0; j < vec->size; j++) {
+          vec->data[j].value *= alpha;
+        }
+        continue;
+      }
+
+      size_t count;
+      struct hacoo_bucket *entries = hacoo_bucket_entries(t, i, &count);
+      for (size_t j = 0; j < count; j++) {
+        entries[j].value *= alpha;
+      }
+    }
+}
+
 /*Debugging print functions */
 /* Print the nth nonzero element in the tensor */
 /*
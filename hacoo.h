@@ -5,9 +5,9 @@
 #define HACOO_H
 #include <stddef.h>
 #include <stdint.h>
-#include <stdint.h>
 #include <stdio.h>
 #include "vector.h"
+#include "morton.h"
 
 struct hacoo_bucket {
   unsigned long long morton;
@@ -16,35 +16,258 @@ struct hacoo_bucket {
 
 DEFINE_VECTOR_TYPE(struct hacoo_bucket, bucket_vector)
 
+/* Entry of a tensor whose morton codes need two words */
+struct hacoo_wide_bucket {
+  uint64_t morton[2]; //low word, high word
+  double value;
+};
+
+DEFINE_VECTOR_TYPE(struct hacoo_wide_bucket, wide_bucket_vector)
+
+/* Storage flags, passed to hacoo_alloc_flags */
+#define HACOO_CHAINED 0x0 /* one bucket_vector per bucket (default) */
+#define HACOO_FLAT    0x1 /* one open-addressed table, Robin Hood probing */
+#define HACOO_WIDE    0x2 /* 128-bit morton codes in chained buckets, set
+                             automatically when the modes need more than
+                             64 bits between them */
+#define HACOO_FREEZE  0x4 /* hacoo_build_from_coo: return the tensor frozen */
+#define HACOO_INCREMENTAL 0x8 /* grow chained buckets a few at a time on each
+                                 write instead of all at once */
+#define HACOO_ARENA   0x10 /* keep bucket vectors in slabs freed all at once */
+#define HACOO_DROP_ZEROS 0x20 /* setting or combining to zero removes the entry */
+#define HACOO_ZORDER  0x40 /* MTTKRP walks the nonzeros in morton order, see
+                             hacoo_zorder */
+#define HACOO_CSF     0x80 /* MTTKRP works row by row over fiber indexes, see
+                             hacoo_csf */
+
+/* Compressed sparse fiber index of a tensor rooted at one mode. Level 0
+ * holds one node per nonempty row of the root mode, each level below splits
+ * its parent's nonzeros by the index in the next mode, and the last level
+ * holds the nonzeros themselves. */
+struct hacoo_csf {
+  unsigned int nlevels; //modes of the tensor
+  unsigned int *mode; //mode[l] is the mode of level l, mode[0] the root
+  size_t *nfibers; //nodes in each level, the last has one per nonzero
+  unsigned int **fids; //fids[l][f] is node f of level l's index in mode[l]
+  size_t **fptr; //children of node f of level l are fptr[l][f] to
+                 //fptr[l][f+1] of level l+1, for all but the last level
+  double *value; //value of each node of the last level
+};
+
+/* Nonzeros of a tensor grouped by ranges of rows of one mode, one range
+ * per part. The ranges are cut to give the parts about the same number
+ * of nonzeros. */
+struct hacoo_rowpart {
+  unsigned int nparts;
+  unsigned int *row_start; //part p owns rows row_start[p] to row_start[p+1]
+  size_t *start; //and nonzeros start[p] to start[p+1] of the arrays below
+  uint64_t *morton;
+  uint64_t *morton_hi; //high words of wide codes, NULL otherwise
+  double *value;
+};
+
 struct hacoo_tensor {
   size_t ndims;
   unsigned int *dims;
+  struct morton_layout *layout; //bits each mode gets in a morton code
+  unsigned int flags;
   bucket_vector *buckets; //vector of hacoo_buckets
-  size_t nbuckets;
+  struct hacoo_bucket *slots; //open-addressed table (HACOO_FLAT)
+  unsigned char *dist; //probe distance + 1 of each slot, 0 if empty
+  wide_bucket_vector *wide_buckets; //buckets of a HACOO_WIDE tensor
+  struct vector_arena *arena; //storage of the bucket vectors if HACOO_ARENA
+  size_t nbuckets; //number of buckets, or slots in a flat table
+  bucket_vector *old_buckets; //buckets an incremental rehash is moving from
+  size_t old_nbuckets;
+  size_t migrated; //old buckets below this one have been moved
+  uint64_t *packed_morton; //frozen morton codes, grouped by bucket
+  uint64_t *packed_morton_hi; //frozen high words of wide codes
+  double *packed_value; //frozen values, parallel to packed_morton
+  size_t *offsets; //bucket i is packed_*[offsets[i]..offsets[i+1]), NULL unless frozen
+  uint64_t *zorder_morton; //nonzeros sorted by morton code, NULL until built
+  uint64_t *zorder_morton_hi; //high words of wide codes
+  double *zorder_value; //values, parallel to zorder_morton
+  struct hacoo_csf **csf; //fiber index rooted at each mode, NULL until built
+  struct hacoo_rowpart **rowpart; //row partition of each mode, NULL until built
+  size_t *bucket_prefix; //entries before each bucket, NULL until built
   unsigned int load;
   unsigned int nnz;
   unsigned int sx;
   unsigned int sy;
   unsigned int sz;
+  unsigned int old_sx, old_sy, old_sz; //hash parameters of old_buckets
   //unsigned int base; //index base
 };
 
 /* Allocation and deallocation functions */
 struct hacoo_tensor *hacoo_alloc(unsigned int ndims, unsigned int *dims,
                                  size_t nbuckets, unsigned int load);
+struct hacoo_tensor *hacoo_alloc_flags(unsigned int ndims, unsigned int *dims,
+                                       size_t nbuckets, unsigned int load,
+                                       unsigned int flags);
 void hacoo_free(struct hacoo_tensor *t);
 
+/* Build a tensor from nnz zero-based COO entries, idx[z * ndims + i] being
+ * mode i of entry z. The table is sized once, repeated indices keep their
+ * last value, and under HACOO_DROP_ZEROS entries left at zero are dropped
+ * as hacoo_set would. Returns NULL on failure. */
+struct hacoo_tensor *hacoo_build_from_coo(unsigned int ndims, unsigned int *dims,
+                                          size_t nnz, const unsigned int *idx,
+                                          const double *vals, unsigned int flags);
+
 /* Rehash tensor that has exceeded load limit to new tensor */
 void hacoo_rehash(struct hacoo_tensor **t);
 
+/* Complete an incremental rehash (HACOO_INCREMENTAL). Until then lookups
+ * check both tables; whole-tensor operations finish it first. */
+void hacoo_finish_rehash(struct hacoo_tensor *t);
+
+/* Pack all buckets into contiguous read-only morton and value arrays
+ * (structure of arrays, CSR by bucket).
+ * Writes to a frozen tensor thaw it back to its mutable storage first.
+ * Both return 0 on success and -1 on allocation failure. */
+int hacoo_freeze(struct hacoo_tensor *t);
+int hacoo_thaw(struct hacoo_tensor *t);
+
+/* Sort the nonzeros by morton code into a stream cached on the tensor, so
+ * they can be walked in Z-order with hacoo_zorder_cursor_init. The sort is
+ * a parallel radix sort over the bits the code layout uses. The stream
+ * takes another copy of every code and value, and any write drops it.
+ * Returns 0 on success and -1 on allocation failure. */
+int hacoo_zorder(struct hacoo_tensor *t);
+
+/* Fiber index rooted at mode, built on first use and cached on the tensor.
+ * Levels below the root go from the shortest mode to the longest. Any
+ * write drops the indexes. Returns NULL on allocation failure. */
+struct hacoo_csf *hacoo_csf(struct hacoo_tensor *t, unsigned int mode);
+
+/* Row partition of mode into nparts parts, built on first use and cached
+ * on the tensor. Asking for a different number of parts rebuilds it, and
+ * any write drops it. Returns NULL on failure. */
+struct hacoo_rowpart *hacoo_rowpart(struct hacoo_tensor *t, unsigned int mode,
+                                    unsigned int nparts);
+
+/* Combines a value being added into the value already stored */
+typedef double (*hacoo_combiner)(double stored, double value);
+
 /* Access functions */
 void hacoo_set(struct hacoo_tensor *t, unsigned int *index, double value);
 double hacoo_get(struct hacoo_tensor *t, unsigned int *index);
 
-/* extract the index from a bucket */
-void hacoo_extract_index(struct hacoo_bucket *b, unsigned int n,
+/* Combine value into the entry at index in a single probe. An index with no
+ * entry takes value as it is. A NULL combiner overwrites, as hacoo_set. */
+void hacoo_accumulate(struct hacoo_tensor *t, unsigned int *index,
+                      double value, hacoo_combiner combine);
+
+/* Remove the entry at index. Returns 1 if there was one, 0 if not and -1
+ * if a frozen tensor could not be thawed. */
+int hacoo_remove(struct hacoo_tensor *t, unsigned int *index);
+
+/* Shrink the table to what its entries need at the load limit and give
+ * back unused bucket capacity. Returns 0 on success, -1 on failure. */
+int hacoo_shrink_to_fit(struct hacoo_tensor *t);
+
+/* Accumulate count events, ndims indices per event, in order */
+void hacoo_accumulate_batch(struct hacoo_tensor *t, size_t count,
+                            const unsigned int *indices, const double *values,
+                            hacoo_combiner combine);
+
+/* Same result as hacoo_accumulate_batch, with the events applied by all
+ * threads. The table is first grown as if every event were new. Flat and
+ * arena tensors fall back to the serial batch. Returns 0 on success and -1
+ * on allocation failure. */
+int hacoo_accumulate_parallel(struct hacoo_tensor *t, size_t count,
+                              const unsigned int *indices,
+                              const double *values, hacoo_combiner combine);
+
+/* Combiners */
+double hacoo_combine_sum(double stored, double value);
+double hacoo_combine_max(double stored, double value);
+double hacoo_combine_min(double stored, double value);
+double hacoo_combine_last(double stored, double value);
+
+/* Look up count indices at once. indices holds ndims entries per index,
+ * one index after another, and out receives their values. Lookups in a
+ * block are interleaved with prefetches so their cache misses overlap. */
+void hacoo_get_batch(struct hacoo_tensor *t, size_t count,
+                     const unsigned int *indices, double *out);
+
+/* Get the entries stored in bucket i of a tensor that is neither frozen
+ * nor wide and has no rehash in progress. A flat table holds at most one
+ * entry per slot. */
+static inline struct hacoo_bucket *hacoo_bucket_entries(struct hacoo_tensor *t,
+                                                        size_t i,
+                                                        size_t *count)
+{
+  if (t->flags & HACOO_FLAT) {
+    *count = t->dist[i] != 0;
+    return &t->slots[i];
+  }
+  *count = t->buckets[i].size;
+  return t->buckets[i].data;
+}
+
+/* extract the index from a bucket of t */
+void hacoo_extract_index(struct hacoo_tensor *t, struct hacoo_bucket *b,
                          unsigned int *index);
 
+/* extract the index from a bare morton code of t */
+void hacoo_morton_decode(struct hacoo_tensor *t, unsigned long long morton,
+                         unsigned int *index);
+
+/* extract the indices of count morton codes of t at once, one array per
+ * mode: out_soa[i][z] receives mode i of mortons[z] */
+void hacoo_extract_indices_batch(struct hacoo_tensor *t, const uint64_t *mortons,
+                                 size_t count, unsigned int *out_soa[]);
+
+/* Block-at-a-time traversal of the nonzeros in a range of buckets */
+#define HACOO_BLOCK 256
+
+struct hacoo_block {
+  size_t count;
+  const uint64_t *morton; //points into a frozen tensor or at morton_buf
+  const uint64_t *morton_hi; //high words of wide codes, NULL otherwise
+  const double *value;
+  uint64_t morton_buf[HACOO_BLOCK];
+  uint64_t morton_hi_buf[HACOO_BLOCK];
+  double value_buf[HACOO_BLOCK];
+};
+
+struct hacoo_cursor {
+  size_t bucket; //next bucket to visit
+  size_t pos; //next entry within it, or in the packed arrays if frozen
+  size_t end; //one past the last bucket, or packed entry if frozen
+  int zorder; //pos and end index the Z-order stream
+};
+
+/* Start a walk over buckets [start, end). An incremental rehash must be
+ * finished first. */
+void hacoo_cursor_init(struct hacoo_tensor *t, struct hacoo_cursor *c,
+                       size_t start, size_t end);
+
+/* Cut the buckets into nparts ranges holding about the same number of
+ * nonzeros, from a prefix sum of the bucket sizes that is cached on the
+ * tensor until the next write or resize. Range p is buckets
+ * first[p] to first[p+1], so first has nparts + 1 entries. A bucket is
+ * never split, so a range can be empty or hold more than its share. An
+ * incremental rehash must be finished first. Returns 0 on success and -1
+ * on allocation failure. */
+int hacoo_split_buckets(struct hacoo_tensor *t, size_t nparts, size_t *first);
+
+/* Start a walk over nonzeros [first, last) of the Z-order stream, which
+ * hacoo_zorder must have built */
+void hacoo_zorder_cursor_init(struct hacoo_tensor *t, struct hacoo_cursor *c,
+                              size_t first, size_t last);
+
+/* Fetch the next block of nonzeros. Returns the number in the block, 0 when
+ * the walk is done. */
+size_t hacoo_next_block(struct hacoo_tensor *t, struct hacoo_cursor *c,
+                        struct hacoo_block *b);
+
+/* Decode the indices of a block of t, out_soa[i][z] receives mode i */
+void hacoo_block_indices(struct hacoo_tensor *t, const struct hacoo_block *b,
+                         unsigned int *out_soa[]);
+
 /* Allocate a new bucket */
 struct hacoo_bucket *hacoo_new_bucket();
 
@@ -60,8 +283,13 @@ struct hacoo_tensor *read_tensor_file(FILE *file);
 /* Delete this later */
 struct hacoo_tensor *read_tensor_file_with_base(FILE *file, int zero_base);
 
+/* Read a tensor from a tns file into the storage selected by flags */
+struct hacoo_tensor *read_tensor_file_flags(FILE *file, int zero_base,
+                                            unsigned int flags);
+
 /* Initialize a tensor from a file */
 struct hacoo_tensor *file_init(FILE *file);
+struct hacoo_tensor *file_init_flags(FILE *file, unsigned int flags);
 
 /* Read an entry from a file */
 void file_entry(struct hacoo_tensor *t, FILE *file);
@@ -83,4 +311,7 @@ void print_tensor(struct hacoo_tensor *t);
 /* Calculate the frobenius norm of the tensor */
 double frobenius_norm(struct hacoo_tensor *t);
 
+/* Multiply every value in the tensor by alpha */
+void hacoo_scale(struct hacoo_tensor *t, double alpha);
+
 #endif
@@ -27,6 +27,8 @@ int suite_cleanup(void);
 /* Functions for benchmarking MTTRKP */
 int generate_factor_matrices();
 void CUnit_mttkrp_bench(const char *tensor_file, int alg, int zero_base, int target_mode, int rank);
+void print_busy_times(int mode);
+void print_node_work(int mode, int rank);
 
 /* Globals */
 struct hacoo_tensor *global_tensor = NULL;
@@ -35,6 +37,10 @@ matrix_t **global_mttkrp_expected = NULL;
 int global_matrix_count = 0;
 char *global_factor_file = NULL;
 char *global_mttkrp_expected_file = NULL;
+unsigned int global_storage_flags = HACOO_CHAINED;
+int global_freeze = 0;
+int global_zorder = 0;
+int global_csf = 0;
 
 
 /* CUnit test to verify if this libary's MTTKRP answers are correct */
@@ -52,9 +58,21 @@ void print_usage(const char *progname) {
     printf("  -z or --zero-based     Assume input tensor is zero-based (default: one-based)\n");
     printf("  -r or --rank           Rank (default: 16)\n");
     printf("  -m or --target-mode    Target mode of tensor (default: all modes)\n");
-    printf("  -a or --algorithm      (-2: sequential, default; -1: OpenMP parallel)\n");
+    printf("  -a or --algorithm      (-2: sequential, default; -1: OpenMP parallel;\n"
+           "                         -3: owner-computes parallel; -4: all modes in one pass)\n");
     printf("  -b or --bench          Run benchmark mode\n");
     printf("  -d or --dims           Dimensions (I,J,K)\n");
+    printf("  -s or --storage        Tensor storage (chained: default; flat: open addressing)\n");
+    printf("  -F or --freeze         Freeze the tensor into its packed read-only layout\n");
+    printf("  -Z or --zorder         Walk the nonzeros in morton (Z-)order\n");
+    printf("  -C or --csf            Work row by row over per-mode fiber indexes\n");
+    printf("  -S or --strategy       Parallel MTTKRP update strategy (auto: default;\n"
+           "                         privatize, tiled, atomic)\n");
+    printf("  -P or --schedule       Split of the nonzeros among threads (balanced: default;\n"
+           "                         dynamic, static)\n");
+    printf("  -k or --kernel         MTTKRP kernel set (auto: default; scalar, avx2, avx512)\n");
+    printf("  -N or --numa           Factor placement across NUMA nodes (off: default;\n"
+           "                         interleave, replicate)\n");
     printf("  -h or --help           Display this help message\n");
     printf("OpenMP options:\n");
     printf("  -t or --number-threads Number of threads (default: 1)      \n");
@@ -76,7 +94,7 @@ int main(int argc, char *argv[]) {
     int num_threads = 1;
 
     int opt;
-    const char* const short_opt = "hi:za:r:m:d:bt:f:e:";
+    const char* const short_opt = "hi:za:r:m:d:bt:f:e:s:FZCS:k:P:N:";
     static struct option long_options[] = {
         {"help",        no_argument,       0, 'h'},
         {"input",       required_argument, 0, 'i'},
@@ -89,6 +107,14 @@ int main(int argc, char *argv[]) {
         {"dims",        required_argument, 0, 'd'},
         {"bench",       no_argument,       0, 'b'},
         {"number-threads", required_argument, 0, 't'},  // number of threads
+        {"storage",     required_argument, 0, 's'},
+        {"freeze",      no_argument,       0, 'F'},
+        {"zorder",      no_argument,       0, 'Z'},
+        {"csf",         no_argument,       0, 'C'},
+        {"strategy",    required_argument, 0, 'S'},
+        {"kernel",      required_argument, 0, 'k'},
+        {"schedule",    required_argument, 0, 'P'},
+        {"numa",        required_argument, 0, 'N'},
         {0, 0, 0, 0}
     };
 
@@ -124,6 +150,83 @@ int main(int argc, char *argv[]) {
             case 'b':
                 run_bench = 1;
                 break;
+            case 'F':
+                global_freeze = 1;
+                break;
+            case 'Z':
+                global_zorder = 1;
+                break;
+            case 'C':
+                global_csf = 1;
+                break;
+            case 'S':
+                if (strcmp(optarg, "auto") == 0) {
+                    mttkrp_set_strategy(MTTKRP_AUTO);
+                } else if (strcmp(optarg, "privatize") == 0) {
+                    mttkrp_set_strategy(MTTKRP_PRIVATIZE);
+                } else if (strcmp(optarg, "tiled") == 0) {
+                    mttkrp_set_strategy(MTTKRP_TILED);
+                } else if (strcmp(optarg, "atomic") == 0) {
+                    mttkrp_set_strategy(MTTKRP_ATOMIC);
+                } else {
+                    fprintf(stderr, "Invalid strategy: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                if (strcmp(optarg, "balanced") == 0) {
+                    mttkrp_set_schedule(MTTKRP_SCHEDULE_BALANCED);
+                } else if (strcmp(optarg, "dynamic") == 0) {
+                    mttkrp_set_schedule(MTTKRP_SCHEDULE_DYNAMIC);
+                } else if (strcmp(optarg, "static") == 0) {
+                    mttkrp_set_schedule(MTTKRP_SCHEDULE_STATIC);
+                } else {
+                    fprintf(stderr, "Invalid schedule: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'N':
+                if (strcmp(optarg, "off") == 0) {
+                    mttkrp_set_numa(MTTKRP_NUMA_OFF);
+                } else if (strcmp(optarg, "interleave") == 0) {
+                    mttkrp_set_numa(MTTKRP_NUMA_INTERLEAVE);
+                } else if (strcmp(optarg, "replicate") == 0) {
+                    mttkrp_set_numa(MTTKRP_NUMA_REPLICATE);
+                } else {
+                    fprintf(stderr, "Invalid NUMA placement: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'k': {
+                int ret;
+                if (strcmp(optarg, "auto") == 0) {
+                    ret = mttkrp_set_kernel(MTTKRP_KERNEL_AUTO);
+                } else if (strcmp(optarg, "scalar") == 0) {
+                    ret = mttkrp_set_kernel(MTTKRP_KERNEL_SCALAR);
+                } else if (strcmp(optarg, "avx2") == 0) {
+                    ret = mttkrp_set_kernel(MTTKRP_KERNEL_AVX2);
+                } else if (strcmp(optarg, "avx512") == 0) {
+                    ret = mttkrp_set_kernel(MTTKRP_KERNEL_AVX512);
+                } else {
+                    fprintf(stderr, "Invalid kernel: %s\n", optarg);
+                    exit(1);
+                }
+                if (ret) {
+                    fprintf(stderr, "Kernel %s is not supported by this CPU\n", optarg);
+                    exit(1);
+                }
+                break;
+            }
+            case 's':
+                if (strcmp(optarg, "flat") == 0) {
+                    global_storage_flags = HACOO_FLAT;
+                } else if (strcmp(optarg, "chained") == 0) {
+                    global_storage_flags = HACOO_CHAINED;
+                } else {
+                    fprintf(stderr, "Invalid storage: %s\n", optarg);
+                    exit(1);
+                }
+                break;
             case 't':
                 num_threads = atoi(optarg);
                 if (num_threads <= 0) {
@@ -175,21 +278,62 @@ void CUnit_mttkrp_bench(const char *tensor_file, int alg, int zero_base, int tar
     } else if (alg == -2) {
         selected_mttkrp_func = mttkrp_serial;
         printf("Running Serial MTTKRP Benchmark %s.\n",tensor_file);
+    } else if (alg == -3) {
+        selected_mttkrp_func = mttkrp_owner;
+        printf("Running Owner-Computes MTTKRP Benchmark for %s.\n",tensor_file);
+    } else if (alg == -4) {
+        selected_mttkrp_func = NULL;
+        printf("Running Fused All-Modes MTTKRP Benchmark for %s.\n",tensor_file);
     } else {
-        fprintf(stderr, "Invalid algorithm value: %d. Expected -2 or -1.\n", alg);
+        fprintf(stderr, "Invalid algorithm value: %d. Expected -4, -3, -2 or -1.\n", alg);
         CU_cleanup_registry();
         return;
     }
 
     printf("Rank: %d\n", rank);
-    if (target_mode == -1 ) { printf("Target mode: all\n"); } 
+    printf("Kernel: %s%s\n", mttkrp_kernel_name(mttkrp_get_kernel()),
+           mttkrp_kernel_specialized(rank) ? " (rank specialized)" : "");
+    if (target_mode == -1 || alg == -4) { printf("Target mode: all\n"); } 
     else { printf("Mode: %d\n", target_mode); }
+    if (alg == -1 || alg == -4) {
+        printf("Schedule: %s\n", mttkrp_schedule_name(mttkrp_get_schedule()));
+        printf("NUMA placement: %s (%u node%s)\n", mttkrp_numa_name(mttkrp_get_numa()),
+               mttkrp_numa_nodes(), mttkrp_numa_nodes() > 1 ? "s" : "");
+    }
+    if (alg == -1) {
+        for (int i = 0; i < global_tensor->ndims; ++i) {
+            enum mttkrp_strategy s = mttkrp_get_strategy();
+            if (s == MTTKRP_AUTO) {
+                s = mttkrp_choose_strategy(global_tensor, i, rank, omp_get_max_threads());
+            }
+            printf("Mode %d strategy: %s\n", i, mttkrp_strategy_name(s));
+        }
+    }
     printf("--------------------------------------------\n");
 
     // Time each mode
     double total_time = 0.0;
 
-    if (target_mode!=-1) {
+    if (alg == -4) {
+        //one pass updates every mode, so it is timed as a whole
+        matrix_t *computed[global_tensor->ndims];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        int ret = mttkrp_all_modes(global_tensor, global_factors, computed);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double duration = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (ret == 0) {
+            printf("All modes MTTKRP Time: %.9f seconds\n", duration);
+            printf("Average MTTKRP Time across %d modes: %.9f seconds\n", global_tensor->ndims,
+                   duration / global_tensor->ndims);
+            for (int i = 0; i < global_tensor->ndims; ++i) {
+                free_matrix(computed[i]);
+            }
+        }
+    } else if (target_mode!=-1) {
         //run mttkrp over just that mode
             struct timespec start, end;
             clock_gettime(CLOCK_MONOTONIC, &start);
@@ -202,6 +346,10 @@ void CUnit_mttkrp_bench(const char *tensor_file, int alg, int zero_base, int tar
             total_time += duration;
 
             printf("Mode %d MTTKRP Time: %.9f seconds\n", target_mode, duration);
+            if (alg != -2) {
+                print_busy_times(target_mode);
+                print_node_work(target_mode, rank);
+            }
             free_matrix(computed);
     } else {
         for (int i = 0; i < global_tensor->ndims; ++i) {
@@ -216,6 +364,10 @@ void CUnit_mttkrp_bench(const char *tensor_file, int alg, int zero_base, int tar
             total_time += duration;
 
             printf("Mode %d MTTKRP Time: %.9f seconds\n", i, duration);
+            if (alg != -2) {
+                print_busy_times(i);
+                print_node_work(i, rank);
+            }
             free_matrix(computed);
         }
 
@@ -227,6 +379,65 @@ void CUnit_mttkrp_bench(const char *tensor_file, int alg, int zero_base, int tar
     CU_cleanup_registry();
 }
 
+/* Print how long each thread of the last MTTKRP worked, and the slowest
+ * thread against the mean */
+void print_busy_times(int mode) {
+    const double *busy;
+    int nthreads = mttkrp_busy_times(&busy);
+    double sum = 0.0, max = 0.0;
+
+    if (nthreads == 0) {
+        return;
+    }
+
+    printf("Mode %d thread busy times:", mode);
+    for (int t = 0; t < nthreads; t++) {
+        printf(" %.6f", busy[t]);
+        sum += busy[t];
+        max = busy[t] > max ? busy[t] : max;
+    }
+    printf(" seconds\n");
+    printf("Mode %d imbalance (max/mean): %.3f\n", mode,
+           sum > 0.0 ? max * nthreads / sum : 1.0);
+}
+
+/* Print the threads, nonzeros and busy time of the last MTTKRP on each
+ * NUMA node, with the memory bandwidth the node's threads sustained. Each
+ * nonzero reads its packed entry, a row of every other factor and a row
+ * of the result, and writes the result row back. */
+void print_node_work(int mode, int rank) {
+    const double *busy;
+    const size_t *nnz;
+    const int *node;
+    int nthreads = mttkrp_busy_times(&busy);
+    unsigned int nnodes = mttkrp_numa_nodes();
+    double entry = 2 * sizeof(double) + (global_tensor->flags & HACOO_WIDE ? sizeof(double) : 0);
+    double bytes = entry + (global_tensor->ndims + 1) * rank * sizeof(double);
+
+    if (nthreads == 0 || mttkrp_thread_work(&nnz, &node) != nthreads) {
+        return;
+    }
+
+    for (unsigned int d = 0; d < nnodes; d++) {
+        int threads = 0;
+        size_t work = 0;
+        double max = 0.0;
+
+        for (int t = 0; t < nthreads; t++) {
+            if (node[t] == d) {
+                threads++;
+                work += nnz[t];
+                max = busy[t] > max ? busy[t] : max;
+            }
+        }
+        if (threads == 0) {
+            continue;
+        }
+        printf("Mode %d node %u: %d threads, %zu nonzeros, %.6f seconds, %.2f GB/s\n",
+               mode, d, threads, work, max, max > 0.0 ? work * bytes / max / 1e9 : 0.0);
+    }
+}
+
 /* Suite initialization: read all input files */
 int suite_bench_init(const char *tensor_filename, int zero_base, int rank) {
 
@@ -236,9 +447,15 @@ int suite_bench_init(const char *tensor_filename, int zero_base, int rank) {
         perror("Error opening tensor file");
         exit(1);
     }
-    global_tensor = read_tensor_file_with_base(file, zero_base);
+    global_tensor = read_tensor_file_flags(file, zero_base, global_storage_flags |
+                                           (global_zorder ? HACOO_ZORDER : 0) |
+                                           (global_csf ? HACOO_CSF : 0));
     fclose(file);
     if (!global_tensor) return 1;
+    if (global_freeze && hacoo_freeze(global_tensor)) {
+        fprintf(stderr, "Error freezing tensor\n");
+        return 1;
+    }
 
     /* Allocate and generate factor matrices*/
     global_matrix_count = global_tensor->ndims;
@@ -279,6 +496,12 @@ void CUnit_verify_mttkrp(const char *tensor_file, const char *factor_file, const
     } else if (alg == -1) {
         selected_mttkrp_func = mttkrp;
         printf("Running Parallel MTTKRP Test\n");
+    } else if (alg == -3) {
+        selected_mttkrp_func = mttkrp_owner;
+        printf("Running Owner-Computes MTTKRP Test\n");
+    } else if (alg == -4) {
+        selected_mttkrp_func = NULL;
+        printf("Running Fused All-Modes MTTKRP Test\n");
     } else {
         printf("Invalid algorithm option. Quitting.\n");
         CU_cleanup_registry();
@@ -341,9 +564,13 @@ void verify_mttkrp_mode(int mode) {
     free_matrix(computed);
 }
 
-/* Compute MTTKRP over all modes */
+/* Compute MTTKRP over all modes, in one pass if f is NULL */
 matrix_t **get_mttkrp_results(struct hacoo_tensor *t, matrix_t **factor_matrices, int matrix_count, mttkrp_func_t f) {
     matrix_t **results = (matrix_t **)malloc(sizeof(matrix_t *) * t->ndims);
+    if (!f) {
+        mttkrp_all_modes(t, factor_matrices, results);
+        return results;
+    }
     for (int i = 0; i < matrix_count; i++) {
         results[i] = f(t, factor_matrices, i);
     }
@@ -359,9 +586,15 @@ int suite_verify_init(const char *tensor_filename, const char *factor_filename,
         perror("Error opening tensor file");
         exit(1);
     }
-    global_tensor = read_tensor_file_with_base(file, zero_base);
+    global_tensor = read_tensor_file_flags(file, zero_base, global_storage_flags |
+                                           (global_zorder ? HACOO_ZORDER : 0) |
+                                           (global_csf ? HACOO_CSF : 0));
     fclose(file);
     if (!global_tensor) return 1;
+    if (global_freeze && hacoo_freeze(global_tensor)) {
+        fprintf(stderr, "Error freezing tensor\n");
+        return 1;
+    }
 
     // Read factor matrices
     global_matrix_count = read_matrices_from_file(factor_filename, &global_factors);
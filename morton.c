@@ -0,0 +1,774 @@
+/* File: morton.c
+ * Purpose: Morton encoding and decoding with runtime CPU dispatch.
+ */
+#include "morton.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <immintrin.h>
+
+/* Spreading b <= 32 bits takes at most 5 shift-and-mask steps */
+#define MAX_LEVELS 5
+
+/* Precomputed masks for one value of n */
+struct morton_codec {
+  unsigned int bits;                 /* bits per mode */
+  unsigned int levels;               /* magic-bits steps */
+  uint64_t low;                      /* the low bits bits of an index */
+  uint64_t mode_mask[MORTON_MAX_MODES]; /* bits of mode i within a code */
+  uint64_t spread[MAX_LEVELS + 1];   /* mask after each magic-bits step */
+  unsigned int shift[MAX_LEVELS];    /* shift of each magic-bits step */
+};
+
+static struct morton_codec codecs[MORTON_MAX_MODES + 1];
+static pthread_once_t codec_once = PTHREAD_ONCE_INIT;
+static enum morton_impl current_impl = MORTON_AUTO;
+static enum morton_batch_impl current_batch_impl = MORTON_BATCH_AUTO;
+
+/* Implementations */
+static uint64_t encode_loop(unsigned int n, const unsigned int *index);
+static void decode_loop(uint64_t morton, unsigned int n, unsigned int *index);
+static uint64_t encode_magic(unsigned int n, const unsigned int *index);
+static void decode_magic(uint64_t morton, unsigned int n, unsigned int *index);
+static uint64_t encode_bmi2(unsigned int n, const unsigned int *index);
+static void decode_bmi2(uint64_t morton, unsigned int n, unsigned int *index);
+
+static uint64_t layout_encode_loop(const struct morton_layout *l,
+                                   const unsigned int *index, uint64_t *hi);
+static void layout_decode_loop(const struct morton_layout *l, uint64_t lo,
+                               uint64_t hi, unsigned int *index);
+static uint64_t layout_encode_bmi2(const struct morton_layout *l,
+                                   const unsigned int *index, uint64_t *hi);
+static void layout_decode_bmi2(const struct morton_layout *l, uint64_t lo,
+                               uint64_t hi, unsigned int *index);
+
+static void decode_batch_layout_bmi2(const struct morton_layout *l,
+                                     const uint64_t *lo, const uint64_t *hi,
+                                     size_t count, unsigned int **out);
+static void decode_batch_scalar(const uint64_t *codes, size_t count,
+                                unsigned int n, unsigned int **out);
+static void decode_batch_avx2(const uint64_t *codes, size_t count,
+                              unsigned int n, unsigned int **out);
+static void decode_batch_avx512(const uint64_t *codes, size_t count,
+                                unsigned int n, unsigned int **out);
+
+/* Dispatch targets start out pointing at trampolines that set things up */
+static uint64_t encode_first(unsigned int n, const unsigned int *index);
+static void decode_first(uint64_t morton, unsigned int n, unsigned int *index);
+
+static uint64_t (*encode_fn)(unsigned int, const unsigned int *) = encode_first;
+static void (*decode_fn)(uint64_t, unsigned int, unsigned int *) = decode_first;
+static void (*decode_batch_fn)(const uint64_t *, size_t, unsigned int,
+                               unsigned int **) = decode_batch_scalar;
+
+static void codec_init(void);
+static int have_bmi2(void);
+static int have_fast_bmi2(void);
+static int have_avx2(void);
+static int have_avx512(void);
+static enum morton_batch_impl best_batch_impl(void);
+
+uint64_t morton_encode(unsigned int n, const unsigned int *index)
+{
+  return encode_fn(n, index);
+}
+
+void morton_decode(uint64_t morton, unsigned int n, unsigned int *index)
+{
+  decode_fn(morton, n, index);
+}
+
+void morton_decode_batch(const uint64_t *codes, size_t count, unsigned int n,
+                         unsigned int **out)
+{
+  pthread_once(&codec_once, codec_init);
+
+  if (n == 0 || n > MORTON_MAX_MODES) {
+    decode_batch_scalar(codes, count, n, out);
+    return;
+  }
+  decode_batch_fn(codes, count, n, out);
+}
+
+unsigned int morton_bits(unsigned int n)
+{
+  size_t b1 = sizeof(uint64_t) * 8 / n;
+  size_t b2 = sizeof(unsigned int) * 8;
+
+  return b1 < b2 ? b1 : b2;
+}
+
+/* Interleave the bits level by level: bit k of each mode that has one,
+ * in mode order, then bit k + 1, and so on. */
+int morton_layout_init(struct morton_layout *l, unsigned int n,
+                       const unsigned int *bits)
+{
+  unsigned int total = 0, max_bits = 0;
+
+  pthread_once(&codec_once, codec_init);
+
+  if (n == 0 || n > MORTON_MAX_MODES) {
+    return -1;
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    if (bits[i] > 32) {
+      return -1;
+    }
+    total += bits[i];
+    max_bits = bits[i] > max_bits ? bits[i] : max_bits;
+  }
+  if (total > 128) {
+    return -1;
+  }
+
+  l->ndims = n;
+  l->words = total > 64 ? 2 : 1;
+  for (unsigned int i = 0; i < n; i++) {
+    l->bits[i] = bits[i];
+    l->mask[0][i] = l->mask[1][i] = 0;
+  }
+
+  // If every mode fits in the n-mode codec, take its layout. Dropping the
+  // bits that are always zero turns it into the packed one below, so codes
+  // sort the same, and the magic-bits and vector paths apply.
+  l->uniform = max_bits <= morton_bits(n);
+  if (l->uniform) {
+    l->words = 1;
+    l->width = 0;
+    for (unsigned int i = 0; i < n; i++) {
+      l->mask[0][i] = codecs[n].mode_mask[i];
+      if (bits[i] && (bits[i] - 1) * n + i + 1 > l->width) {
+        l->width = (bits[i] - 1) * n + i + 1;
+      }
+    }
+  } else {
+    unsigned int pos = 0;
+    for (unsigned int k = 0; k < max_bits; k++) {
+      for (unsigned int i = 0; i < n; i++) {
+        if (k < bits[i]) {
+          l->mask[pos / 64][i] |= 1ULL << (pos % 64);
+          pos++;
+        }
+      }
+    }
+    l->width = total;
+  }
+
+  for (unsigned int i = 0; i < n; i++) {
+    l->split[i] = __builtin_popcountll(l->mask[0][i]);
+  }
+  return 0;
+}
+
+/* Layouts that match the n-mode codec use it, so they keep the magic-bits
+ * and vector paths. Others, where one mode needs more bits than the codec
+ * gives it, use pdep/pext, or a loop over the mask bits when pext is not
+ * the selected implementation. */
+uint64_t morton_layout_encode(const struct morton_layout *l,
+                              const unsigned int *index, uint64_t *hi)
+{
+  if (l->uniform) {
+    if (hi) {
+      *hi = 0;
+    }
+    return morton_encode(l->ndims, index);
+  }
+  if (current_impl == MORTON_BMI2) {
+    return layout_encode_bmi2(l, index, hi);
+  }
+  return layout_encode_loop(l, index, hi);
+}
+
+void morton_layout_decode(const struct morton_layout *l, uint64_t lo,
+                          uint64_t hi, unsigned int *index)
+{
+  if (l->uniform) {
+    morton_decode(lo, l->ndims, index);
+  } else if (current_impl == MORTON_BMI2) {
+    layout_decode_bmi2(l, lo, hi, index);
+  } else {
+    layout_decode_loop(l, lo, hi, index);
+  }
+}
+
+void morton_layout_decode_batch(const struct morton_layout *l,
+                                const uint64_t *lo, const uint64_t *hi,
+                                size_t count, unsigned int **out)
+{
+  if (l->uniform) {
+    morton_decode_batch(lo, count, l->ndims, out);
+    return;
+  }
+
+  if (current_impl == MORTON_BMI2) {
+    decode_batch_layout_bmi2(l, lo, hi, count, out);
+    return;
+  }
+
+  unsigned int index[l->ndims];
+  for (size_t z = 0; z < count; z++) {
+    layout_decode_loop(l, lo[z], hi ? hi[z] : 0, index);
+    for (unsigned int i = 0; i < l->ndims; i++) {
+      out[i][z] = index[i];
+    }
+  }
+}
+
+int morton_set_impl(enum morton_impl impl)
+{
+  pthread_once(&codec_once, codec_init);
+
+  if (impl == MORTON_AUTO) {
+    impl = have_fast_bmi2() ? MORTON_BMI2 : MORTON_MAGIC;
+  }
+
+  switch (impl) {
+  case MORTON_LOOP:
+    encode_fn = encode_loop;
+    decode_fn = decode_loop;
+    break;
+  case MORTON_MAGIC:
+    encode_fn = encode_magic;
+    decode_fn = decode_magic;
+    break;
+  case MORTON_BMI2:
+    if (!have_bmi2()) {
+      return -1;
+    }
+    encode_fn = encode_bmi2;
+    decode_fn = decode_bmi2;
+    break;
+  default:
+    return -1;
+  }
+
+  current_impl = impl;
+  return 0;
+}
+
+enum morton_impl morton_get_impl(void)
+{
+  pthread_once(&codec_once, codec_init);
+  return current_impl;
+}
+
+const char *morton_impl_name(enum morton_impl impl)
+{
+  switch (impl) {
+  case MORTON_LOOP:
+    return "loop";
+  case MORTON_MAGIC:
+    return "magic";
+  case MORTON_BMI2:
+    return "bmi2";
+  default:
+    return "auto";
+  }
+}
+
+int morton_set_batch_impl(enum morton_batch_impl impl)
+{
+  pthread_once(&codec_once, codec_init);
+
+  if (impl == MORTON_BATCH_AUTO) {
+    impl = best_batch_impl();
+  }
+
+  switch (impl) {
+  case MORTON_BATCH_SCALAR:
+    decode_batch_fn = decode_batch_scalar;
+    break;
+  case MORTON_BATCH_AVX2:
+    if (!have_avx2()) {
+      return -1;
+    }
+    decode_batch_fn = decode_batch_avx2;
+    break;
+  case MORTON_BATCH_AVX512:
+    if (!have_avx512()) {
+      return -1;
+    }
+    decode_batch_fn = decode_batch_avx512;
+    break;
+  default:
+    return -1;
+  }
+
+  current_batch_impl = impl;
+  return 0;
+}
+
+enum morton_batch_impl morton_get_batch_impl(void)
+{
+  pthread_once(&codec_once, codec_init);
+  return current_batch_impl;
+}
+
+const char *morton_batch_impl_name(enum morton_batch_impl impl)
+{
+  switch (impl) {
+  case MORTON_BATCH_SCALAR:
+    return "scalar";
+  case MORTON_BATCH_AVX2:
+    return "avx2";
+  case MORTON_BATCH_AVX512:
+    return "avx512";
+  default:
+    return "auto";
+  }
+}
+
+/* Helper function implementations. */
+
+static int have_bmi2(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("bmi2");
+#else
+  return 0;
+#endif
+}
+
+/* Zen 1 and Zen 2 implement pdep/pext in microcode, hundreds of cycles */
+static int have_fast_bmi2(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return have_bmi2() && !__builtin_cpu_is("znver1") &&
+         !__builtin_cpu_is("znver2");
+#else
+  return 0;
+#endif
+}
+
+static int have_avx2(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+static int have_avx512(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return __builtin_cpu_supports("avx512f");
+#else
+  return 0;
+#endif
+}
+
+/* Build the masks for every n and pick the default implementation. Bit k of an index moves to k * n in log2(b)
+ * steps; the step for level j shifts indices with bit j set by 2^j (n-1). */
+static void codec_init(void)
+{
+  for (unsigned int n = 1; n <= MORTON_MAX_MODES; n++) {
+    struct morton_codec *c = &codecs[n];
+
+    c->bits = morton_bits(n);
+    c->low = c->bits < 64 ? (1ULL << c->bits) - 1 : ~0ULL;
+    c->levels = 0;
+    while ((1u << c->levels) < c->bits) {
+      c->levels++;
+    }
+
+    for (int j = c->levels; j >= 0; j--) {
+      uint64_t mask = 0;
+      for (unsigned int k = 0; k < c->bits; k++) {
+        unsigned int high = k & ~((1u << j) - 1);
+        mask |= 1ULL << (k + high * (n - 1));
+      }
+      c->spread[j] = mask;
+      if (j < c->levels) {
+        c->shift[j] = (1u << j) * (n - 1);
+      }
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+      c->mode_mask[i] = c->spread[0] << i;
+    }
+
+  }
+
+  // Default to the fastest implementations this CPU supports
+  if (have_fast_bmi2()) {
+    encode_fn = encode_bmi2;
+    decode_fn = decode_bmi2;
+    current_impl = MORTON_BMI2;
+  } else {
+    encode_fn = encode_magic;
+    decode_fn = decode_magic;
+    current_impl = MORTON_MAGIC;
+  }
+
+  current_batch_impl = best_batch_impl();
+  switch (current_batch_impl) {
+  case MORTON_BATCH_AVX512:
+    decode_batch_fn = decode_batch_avx512;
+    break;
+  case MORTON_BATCH_AVX2:
+    decode_batch_fn = decode_batch_avx2;
+    break;
+  default:
+    decode_batch_fn = decode_batch_scalar;
+    break;
+  }
+}
+
+/* A fast pext decodes a block quicker than the vector magic-bits kernels;
+ * without one the vector kernels win. */
+static enum morton_batch_impl best_batch_impl(void)
+{
+  if (have_fast_bmi2()) {
+    return MORTON_BATCH_SCALAR;
+  }
+  if (have_avx512()) {
+    return MORTON_BATCH_AVX512;
+  }
+  if (have_avx2()) {
+    return MORTON_BATCH_AVX2;
+  }
+  return MORTON_BATCH_SCALAR;
+}
+
+static uint64_t encode_first(unsigned int n, const unsigned int *index)
+{
+  pthread_once(&codec_once, codec_init);
+  return encode_fn(n, index);
+}
+
+static void decode_first(uint64_t morton, unsigned int n, unsigned int *index)
+{
+  pthread_once(&codec_once, codec_init);
+  decode_fn(morton, n, index);
+}
+
+static uint64_t encode_loop(unsigned int n, const unsigned int *index)
+{
+  uint64_t m = 0;
+  size_t max_bits = morton_bits(n);
+
+  for (unsigned int bit = 0; bit < max_bits; bit++) {
+    for (unsigned int i = 0; i < n; i++) {
+      m |= ((uint64_t)((index[i] >> bit) & 1)) << (bit * n + i);
+    }
+  }
+
+  return m;
+}
+
+static void decode_loop(uint64_t morton, unsigned int n, unsigned int *index)
+{
+  size_t max_bits = morton_bits(n);
+
+  for (unsigned int i = 0; i < n; i++) {
+    index[i] = 0;
+  }
+
+  for (unsigned int bit = 0; bit < max_bits; bit++) {
+    for (unsigned int i = 0; i < n; i++) {
+      index[i] |= ((morton >> (bit * n + i)) & 1) << bit;
+    }
+  }
+}
+
+static uint64_t encode_magic(unsigned int n, const unsigned int *index)
+{
+  if (n == 0 || n > MORTON_MAX_MODES) {
+    return encode_loop(n, index);
+  }
+
+  const struct morton_codec *c = &codecs[n];
+  uint64_t m = 0;
+
+  for (unsigned int i = 0; i < n; i++) {
+    uint64_t x = index[i] & c->low;
+    for (int j = c->levels - 1; j >= 0; j--) {
+      x = (x | (x << c->shift[j])) & c->spread[j];
+    }
+    m |= x << i;
+  }
+
+  return m;
+}
+
+/* Gather the bits of mode i from a code with the magic-bits steps */
+static inline unsigned int compact_magic(const struct morton_codec *c,
+                                         uint64_t morton, unsigned int i)
+{
+  uint64_t x = (morton >> i) & c->spread[0];
+  for (unsigned int j = 0; j < c->levels; j++) {
+    x = (x | (x >> c->shift[j])) & c->spread[j + 1];
+  }
+  return x;
+}
+
+static void decode_magic(uint64_t morton, unsigned int n, unsigned int *index)
+{
+  if (n == 0 || n > MORTON_MAX_MODES) {
+    decode_loop(morton, n, index);
+    return;
+  }
+
+  const struct morton_codec *c = &codecs[n];
+
+  for (unsigned int i = 0; i < n; i++) {
+    index[i] = compact_magic(c, morton, i);
+  }
+}
+
+__attribute__((target("bmi2")))
+static uint64_t encode_bmi2(unsigned int n, const unsigned int *index)
+{
+  if (n == 0 || n > MORTON_MAX_MODES) {
+    return encode_loop(n, index);
+  }
+
+  const uint64_t *mask = codecs[n].mode_mask;
+  uint64_t m = 0;
+
+  for (unsigned int i = 0; i < n; i++) {
+    m |= _pdep_u64(index[i], mask[i]);
+  }
+
+  return m;
+}
+
+__attribute__((target("bmi2")))
+static void decode_bmi2(uint64_t morton, unsigned int n, unsigned int *index)
+{
+  if (n == 0 || n > MORTON_MAX_MODES) {
+    decode_loop(morton, n, index);
+    return;
+  }
+
+  const uint64_t *mask = codecs[n].mode_mask;
+
+  for (unsigned int i = 0; i < n; i++) {
+    index[i] = _pext_u64(morton, mask[i]);
+  }
+}
+
+/* Scatter the bits of each index to the set bits of its masks, lowest
+ * first */
+static uint64_t layout_encode_loop(const struct morton_layout *l,
+                                   const unsigned int *index, uint64_t *hi)
+{
+  uint64_t code[2] = {0, 0};
+
+  for (unsigned int i = 0; i < l->ndims; i++) {
+    uint64_t x = index[i];
+    for (unsigned int w = 0; w < l->words; w++) {
+      for (uint64_t m = l->mask[w][i]; m; m &= m - 1) {
+        if (x & 1) {
+          code[w] |= m & -m;
+        }
+        x >>= 1;
+      }
+    }
+  }
+
+  if (hi) {
+    *hi = code[1];
+  }
+  return code[0];
+}
+
+static void layout_decode_loop(const struct morton_layout *l, uint64_t lo,
+                               uint64_t hi, unsigned int *index)
+{
+  uint64_t code[2] = {lo, hi};
+
+  for (unsigned int i = 0; i < l->ndims; i++) {
+    unsigned int x = 0, bit = 0;
+    for (unsigned int w = 0; w < l->words; w++) {
+      for (uint64_t m = l->mask[w][i]; m; m &= m - 1, bit++) {
+        if (code[w] & m & -m) {
+          x |= 1u << bit;
+        }
+      }
+    }
+    index[i] = x;
+  }
+}
+
+__attribute__((target("bmi2")))
+static uint64_t layout_encode_bmi2(const struct morton_layout *l,
+                                   const unsigned int *index, uint64_t *hi)
+{
+  uint64_t lo = 0, h = 0;
+
+  for (unsigned int i = 0; i < l->ndims; i++) {
+    lo |= _pdep_u64(index[i], l->mask[0][i]);
+  }
+  if (l->words > 1) {
+    for (unsigned int i = 0; i < l->ndims; i++) {
+      h |= _pdep_u64((uint64_t)index[i] >> l->split[i], l->mask[1][i]);
+    }
+  }
+
+  if (hi) {
+    *hi = h;
+  }
+  return lo;
+}
+
+__attribute__((target("bmi2")))
+static void layout_decode_bmi2(const struct morton_layout *l, uint64_t lo,
+                               uint64_t hi, unsigned int *index)
+{
+  for (unsigned int i = 0; i < l->ndims; i++) {
+    index[i] = _pext_u64(lo, l->mask[0][i]);
+  }
+  if (l->words > 1) {
+    for (unsigned int i = 0; i < l->ndims; i++) {
+      index[i] |= _pext_u64(hi, l->mask[1][i]) << l->split[i];
+    }
+  }
+}
+
+/* Batch decoders. These walk one mode at a time so each output array is
+ * written sequentially; a block of codes stays in cache across modes. */
+
+__attribute__((target("bmi2")))
+static void decode_batch_bmi2(const uint64_t *codes, size_t count,
+                              unsigned int n, unsigned int **out)
+{
+  const uint64_t *mask = codecs[n].mode_mask;
+
+  for (unsigned int i = 0; i < n; i++) {
+    unsigned int *o = out[i];
+    for (size_t z = 0; z < count; z++) {
+      o[z] = _pext_u64(codes[z], mask[i]);
+    }
+  }
+}
+
+__attribute__((target("bmi2")))
+static void decode_batch_layout_bmi2(const struct morton_layout *l,
+                                     const uint64_t *lo, const uint64_t *hi,
+                                     size_t count, unsigned int **out)
+{
+  for (unsigned int i = 0; i < l->ndims; i++) {
+    const uint64_t mask = l->mask[0][i];
+    unsigned int *o = out[i];
+    for (size_t z = 0; z < count; z++) {
+      o[z] = _pext_u64(lo[z], mask);
+    }
+  }
+
+  if (l->words > 1 && hi) {
+    for (unsigned int i = 0; i < l->ndims; i++) {
+      const uint64_t mask = l->mask[1][i];
+      const unsigned int split = l->split[i];
+      unsigned int *o = out[i];
+      for (size_t z = 0; z < count; z++) {
+        o[z] |= _pext_u64(hi[z], mask) << split;
+      }
+    }
+  }
+}
+
+static void decode_batch_scalar(const uint64_t *codes, size_t count,
+                                unsigned int n, unsigned int **out)
+{
+  if (n > 0 && n <= MORTON_MAX_MODES) {
+    if (decode_fn == decode_bmi2) {
+      decode_batch_bmi2(codes, count, n, out);
+      return;
+    }
+
+    if (decode_fn == decode_magic) {
+      const struct morton_codec *c = &codecs[n];
+      for (unsigned int i = 0; i < n; i++) {
+        unsigned int *o = out[i];
+        for (size_t z = 0; z < count; z++) {
+          o[z] = compact_magic(c, codes[z], i);
+        }
+      }
+      return;
+    }
+  }
+
+  unsigned int index[n];
+  for (size_t z = 0; z < count; z++) {
+    decode_fn(codes[z], n, index);
+    for (unsigned int i = 0; i < n; i++) {
+      out[i][z] = index[i];
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void decode_batch_avx2(const uint64_t *codes, size_t count,
+                              unsigned int n, unsigned int **out)
+{
+  const struct morton_codec *c = &codecs[n];
+  __m256i spread[MAX_LEVELS + 1];
+  __m128i shift[MAX_LEVELS];
+  const __m256i low_dwords = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+  for (unsigned int j = 0; j <= c->levels; j++) {
+    spread[j] = _mm256_set1_epi64x(c->spread[j]);
+    if (j < c->levels) {
+      shift[j] = _mm_cvtsi32_si128(c->shift[j]);
+    }
+  }
+
+  for (unsigned int i = 0; i < n; i++) {
+    const __m128i mode = _mm_cvtsi32_si128(i);
+    unsigned int *o = out[i];
+    size_t z = 0;
+
+    for (; z + 4 <= count; z += 4) {
+      __m256i x = _mm256_loadu_si256((const __m256i *)&codes[z]);
+      x = _mm256_and_si256(_mm256_srl_epi64(x, mode), spread[0]);
+      for (unsigned int j = 0; j < c->levels; j++) {
+        x = _mm256_or_si256(x, _mm256_srl_epi64(x, shift[j]));
+        x = _mm256_and_si256(x, spread[j + 1]);
+      }
+      // narrow the four 64-bit lanes to 32-bit indices
+      x = _mm256_permutevar8x32_epi32(x, low_dwords);
+      _mm_storeu_si128((__m128i *)&o[z], _mm256_castsi256_si128(x));
+    }
+
+    for (; z < count; z++) {
+      o[z] = compact_magic(c, codes[z], i);
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static void decode_batch_avx512(const uint64_t *codes, size_t count,
+                                unsigned int n, unsigned int **out)
+{
+  const struct morton_codec *c = &codecs[n];
+  __m512i spread[MAX_LEVELS + 1];
+  __m128i shift[MAX_LEVELS];
+
+  for (unsigned int j = 0; j <= c->levels; j++) {
+    spread[j] = _mm512_set1_epi64(c->spread[j]);
+    if (j < c->levels) {
+      shift[j] = _mm_cvtsi32_si128(c->shift[j]);
+    }
+  }
+
+  for (unsigned int i = 0; i < n; i++) {
+    const __m128i mode = _mm_cvtsi32_si128(i);
+    unsigned int *o = out[i];
+    size_t z = 0;
+
+    for (; z + 8 <= count; z += 8) {
+      __m512i x = _mm512_loadu_si512((const void *)&codes[z]);
+      x = _mm512_and_si512(_mm512_srl_epi64(x, mode), spread[0]);
+      for (unsigned int j = 0; j < c->levels; j++) {
+        x = _mm512_or_si512(x, _mm512_srl_epi64(x, shift[j]));
+        x = _mm512_and_si512(x, spread[j + 1]);
+      }
+      _mm256_storeu_si256((__m256i *)&o[z], _mm512_cvtepi64_epi32(x));
+    }
+
+    for (; z < count; z++) {
+      o[z] = compact_magic(c, codes[z], i);
+    }
+  }
+}
@@ -0,0 +1,100 @@
+/* File: morton.h
+ * Purpose: Morton (Z-order) encoding and decoding of tensor indices.
+ *
+ * The n-mode codec gives each mode morton_bits(n) bits, and bit b of mode i
+ * lands at bit b * n + i of the code. Three implementations are provided
+ * and the fastest one supported by the CPU is picked on first use:
+ *   MORTON_LOOP  - one bit at a time (the original implementation)
+ *   MORTON_MAGIC - shift-and-mask "magic bits" spreading, per-ndims masks
+ *   MORTON_BMI2  - _pdep_u64/_pext_u64 with per-ndims masks
+ *
+ * Blocks of codes can also be decoded at once into per-mode arrays, using
+ * AVX-512 or AVX2 versions of the magic-bits decode when available.
+ *
+ * A tensor can also use its own layout that gives each mode only the bits
+ * it needs. Levels are interleaved in order, so bit k of every mode that
+ * has k + 1 bits comes before bit k + 1 of any mode. Codes of more than
+ * 64 bits take two words (low word first). When every mode fits in
+ * morton_bits(n) bits the layout is the codec's, which orders codes the
+ * same way with the unused bits left as zeros.
+ */
+#ifndef MORTON_H
+#define MORTON_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define MORTON_MAX_MODES 64
+
+enum morton_impl {
+  MORTON_AUTO = 0,
+  MORTON_LOOP,
+  MORTON_MAGIC,
+  MORTON_BMI2
+};
+
+enum morton_batch_impl {
+  MORTON_BATCH_AUTO = 0,
+  MORTON_BATCH_SCALAR,
+  MORTON_BATCH_AVX2,
+  MORTON_BATCH_AVX512
+};
+
+/* Encode an n-mode index into a morton code */
+uint64_t morton_encode(unsigned int n, const unsigned int *index);
+
+/* Decode a morton code into an n-mode index */
+void morton_decode(uint64_t morton, unsigned int n, unsigned int *index);
+
+/* Decode count codes into per-mode arrays: out[i][z] is mode i of codes[z] */
+void morton_decode_batch(const uint64_t *codes, size_t count, unsigned int n,
+                         unsigned int **out);
+
+/* Number of bits each mode gets in an n-mode code */
+unsigned int morton_bits(unsigned int n);
+
+/* Code layout of one tensor */
+struct morton_layout {
+  unsigned int ndims;
+  unsigned int words;                  /* 1 or 2 64-bit words per code */
+  unsigned int uniform;                /* same as the n-mode codec above */
+  unsigned int width;                  /* bits below the highest one used */
+  unsigned int bits[MORTON_MAX_MODES]; /* bits given to mode i */
+  uint64_t mask[2][MORTON_MAX_MODES];  /* bits of mode i in each word */
+  unsigned int split[MORTON_MAX_MODES]; /* bits of mode i in the low word */
+};
+
+/* Build the layout for n modes of bits[i] bits each. Returns -1 if there are
+ * too many modes, a mode has more than 32 bits or the total exceeds 128. */
+int morton_layout_init(struct morton_layout *l, unsigned int n,
+                       const unsigned int *bits);
+
+/* Encode an index with a layout, returning the low word. The high word is
+ * stored in *hi if hi is not NULL. */
+uint64_t morton_layout_encode(const struct morton_layout *l,
+                              const unsigned int *index, uint64_t *hi);
+
+/* Decode a code, hi is ignored by one-word layouts */
+void morton_layout_decode(const struct morton_layout *l, uint64_t lo,
+                          uint64_t hi, unsigned int *index);
+
+/* Decode count codes into per-mode arrays, hi may be NULL for one-word
+ * layouts */
+void morton_layout_decode_batch(const struct morton_layout *l,
+                                const uint64_t *lo, const uint64_t *hi,
+                                size_t count, unsigned int **out);
+
+/* Select an implementation. MORTON_AUTO picks the fastest supported one.
+ * Returns -1 if the CPU does not support the requested implementation. */
+int morton_set_impl(enum morton_impl impl);
+
+/* Currently selected implementation */
+enum morton_impl morton_get_impl(void);
+const char *morton_impl_name(enum morton_impl impl);
+
+/* Same for the batch decoder. MORTON_BATCH_SCALAR runs the selected
+ * single-code implementation over the block. */
+int morton_set_batch_impl(enum morton_batch_impl impl);
+enum morton_batch_impl morton_get_batch_impl(void);
+const char *morton_batch_impl_name(enum morton_batch_impl impl);
+
+#endif
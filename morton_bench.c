@@ -0,0 +1,286 @@
+/* Microbenchmark for the morton encode/decode implementations.
+ *
+ * Encodes and decodes a batch of random indices with every implementation
+ * the CPU supports and reports the time per nonzero.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "morton.h"
+
+#define DEFAULT_COUNT (1 << 22)
+#define BLOCK 256
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [--count <nonzeros>] [--ndims <modes>] [--dims <I,J,K,...>]\n",
+           program_name);
+}
+
+static double elapsed(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Time encode and decode of count indices with one implementation */
+static void bench_impl(enum morton_impl impl, unsigned int ndims, size_t count,
+                       unsigned int *indices, uint64_t *codes, uint64_t *expected)
+{
+    struct timespec start, end;
+    unsigned int *idx = malloc(ndims * sizeof(unsigned int));
+    unsigned long long check = 0;
+
+    if (morton_set_impl(impl)) {
+        printf("%-8s not supported on this CPU\n", morton_impl_name(impl));
+        free(idx);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t z = 0; z < count; z++) {
+        codes[z] = morton_encode(ndims, &indices[z * ndims]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t_encode = elapsed(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t z = 0; z < count; z++) {
+        morton_decode(codes[z], ndims, idx);
+        for (unsigned int i = 0; i < ndims; i++) {
+            check += idx[i];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t_decode = elapsed(&start, &end);
+
+    int ok = memcmp(codes, expected, count * sizeof(uint64_t)) == 0;
+
+    printf("%-8s encode %8.2f ns/nnz   decode %8.2f ns/nnz   %s (checksum %llu)\n",
+           morton_impl_name(impl), t_encode * 1e9 / count, t_decode * 1e9 / count,
+           ok ? "ok" : "MISMATCH", check);
+    free(idx);
+}
+
+/* Time block-at-a-time decode into per-mode arrays */
+static void bench_batch(enum morton_batch_impl impl, unsigned int ndims, size_t count,
+                        unsigned int *indices, uint64_t *codes)
+{
+    struct timespec start, end;
+    unsigned int *soa = malloc(ndims * BLOCK * sizeof(unsigned int));
+    unsigned int *out[ndims];
+    int ok = 1;
+
+    for (unsigned int i = 0; i < ndims; i++) {
+        out[i] = &soa[i * BLOCK];
+    }
+
+    if (morton_set_batch_impl(impl)) {
+        printf("%-8s not supported on this CPU\n", morton_batch_impl_name(impl));
+        free(soa);
+        return;
+    }
+
+    unsigned long long check = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t z = 0; z < count; z += BLOCK) {
+        size_t n = count - z < BLOCK ? count - z : BLOCK;
+        morton_decode_batch(&codes[z], n, ndims, out);
+        check += out[ndims - 1][n - 1];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // verify outside the timed loop
+    for (size_t z = 0; z < count; z += BLOCK) {
+        size_t n = count - z < BLOCK ? count - z : BLOCK;
+        morton_decode_batch(&codes[z], n, ndims, out);
+        for (size_t k = 0; k < n; k++) {
+            for (unsigned int i = 0; i < ndims; i++) {
+                ok &= out[i][k] == indices[(z + k) * ndims + i];
+            }
+        }
+    }
+
+    printf("%-8s batch decode %8.2f ns/nnz   %s (checksum %llu)\n",
+           morton_batch_impl_name(impl), elapsed(&start, &end) * 1e9 / count,
+           ok ? "ok" : "MISMATCH", check);
+    free(soa);
+}
+
+/* Time encode and decode with a per-mode layout */
+static void bench_layout(enum morton_impl impl, const struct morton_layout *l,
+                         size_t count, unsigned int *indices, uint64_t *lo,
+                         uint64_t *hi)
+{
+    struct timespec start, end;
+    unsigned int *idx = malloc(l->ndims * sizeof(unsigned int));
+    unsigned long long check = 0;
+    int ok = 1;
+
+    if (morton_set_impl(impl)) {
+        printf("%-8s not supported on this CPU\n", morton_impl_name(impl));
+        free(idx);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t z = 0; z < count; z++) {
+        lo[z] = morton_layout_encode(l, &indices[z * l->ndims], &hi[z]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t_encode = elapsed(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t z = 0; z < count; z++) {
+        morton_layout_decode(l, lo[z], hi[z], idx);
+        for (unsigned int i = 0; i < l->ndims; i++) {
+            check += idx[i];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t_decode = elapsed(&start, &end);
+
+    // verify outside the timed loop
+    for (size_t z = 0; z < count; z++) {
+        morton_layout_decode(l, lo[z], hi[z], idx);
+        for (unsigned int i = 0; i < l->ndims; i++) {
+            ok &= idx[i] == indices[z * l->ndims + i];
+        }
+    }
+
+    printf("%-8s encode %8.2f ns/nnz   decode %8.2f ns/nnz   %s (checksum %llu)\n",
+           morton_impl_name(impl), t_encode * 1e9 / count, t_decode * 1e9 / count,
+           ok ? "ok" : "MISMATCH", check);
+    free(idx);
+}
+
+/* Benchmark the layout hacoo_alloc would build for a tensor of these dims */
+static int run_layout(const char *dims_str, size_t count)
+{
+    unsigned int dims[MORTON_MAX_MODES], bits[MORTON_MAX_MODES];
+    unsigned int ndims = 0, total = 0;
+    struct morton_layout l;
+
+    for (const char *p = dims_str; *p && ndims < MORTON_MAX_MODES; ndims++) {
+        char *next;
+        dims[ndims] = strtoul(p, &next, 10);
+        p = *next == ',' ? next + 1 : next;
+        bits[ndims] = 0;
+        while (bits[ndims] < 32 && (dims[ndims] >> bits[ndims])) {
+            bits[ndims]++;
+        }
+        total += bits[ndims];
+    }
+
+    if (morton_layout_init(&l, ndims, bits)) {
+        fprintf(stderr, "Error: %u modes of %u bits do not fit in a morton code.\n",
+                ndims, total);
+        return 1;
+    }
+
+    unsigned int *indices = malloc(count * ndims * sizeof(unsigned int));
+    uint64_t *lo = malloc(count * sizeof(uint64_t));
+    uint64_t *hi = malloc(count * sizeof(uint64_t));
+    if (!indices || !lo || !hi) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
+    }
+
+    srand(12345);
+    for (size_t z = 0; z < count; z++) {
+        for (unsigned int i = 0; i < ndims; i++) {
+            unsigned int r = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+            indices[z * ndims + i] = dims[i] ? r % dims[i] : 0;
+        }
+    }
+
+    printf("Layout benchmark: %zu nonzeros, %u modes, %u bits in %u word(s), bits per mode:",
+           count, ndims, total, l.words);
+    for (unsigned int i = 0; i < ndims; i++) {
+        printf(" %u", bits[i]);
+    }
+    printf("\n");
+    bench_layout(MORTON_LOOP, &l, count, indices, lo, hi);
+    bench_layout(MORTON_BMI2, &l, count, indices, lo, hi);
+
+    free(indices);
+    free(lo);
+    free(hi);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = DEFAULT_COUNT;
+    unsigned int ndims = 4;
+    const char *dims_str = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+        {
+            count = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--ndims") == 0 && i + 1 < argc)
+        {
+            ndims = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--dims") == 0 && i + 1 < argc)
+        {
+            dims_str = argv[++i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (dims_str && count) {
+        return run_layout(dims_str, count);
+    }
+
+    if (ndims == 0 || ndims > MORTON_MAX_MODES || count == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    unsigned int bits = morton_bits(ndims);
+    unsigned int *indices = malloc(count * ndims * sizeof(unsigned int));
+    uint64_t *codes = malloc(count * sizeof(uint64_t));
+    uint64_t *expected = malloc(count * sizeof(uint64_t));
+    if (!indices || !codes || !expected) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
+    }
+
+    // Random indices that fit the per-mode bit budget
+    srand(12345);
+    for (size_t z = 0; z < count * ndims; z++) {
+        unsigned int r = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+        indices[z] = bits < 32 ? r & ((1u << bits) - 1) : r;
+    }
+
+    morton_set_impl(MORTON_LOOP);
+    for (size_t z = 0; z < count; z++) {
+        expected[z] = morton_encode(ndims, &indices[z * ndims]);
+    }
+
+    printf("Morton benchmark: %zu nonzeros, %u modes, %u bits per mode\n",
+           count, ndims, bits);
+    bench_impl(MORTON_LOOP, ndims, count, indices, codes, expected);
+    bench_impl(MORTON_MAGIC, ndims, count, indices, codes, expected);
+    bench_impl(MORTON_BMI2, ndims, count, indices, codes, expected);
+
+    morton_set_impl(MORTON_AUTO);
+    printf("Batch decode, blocks of %d, scalar uses %s:\n", BLOCK,
+           morton_impl_name(morton_get_impl()));
+    bench_batch(MORTON_BATCH_SCALAR, ndims, count, indices, expected);
+    bench_batch(MORTON_BATCH_AVX2, ndims, count, indices, expected);
+    bench_batch(MORTON_BATCH_AVX512, ndims, count, indices, expected);
+
+    free(indices);
+    free(codes);
+    free(expected);
+    return 0;
+}
@@ -18,128 +18,1846 @@ Returns:
 #include "hacoo.h"
 #include "matrix.h"
 #include <omp.h>
-#include <cblas.h>
 #include <stdio.h>
+#include <string.h>
+#include <immintrin.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#define TILES_PER_THREAD 8 /* row tiles handed out per thread by MTTKRP_TILED */
+#define PRIVATE_SHARE 64 /* privatize while the partials hold at most one row
+                            per 64 nonzeros */
+#define PRIVATE_MAX_BYTES (1UL << 30) /* never privatize past this much */
+#define DENSE_ROW 8 /* nonzeros per row above which atomics would conflict */
+#define CHUNKS_PER_THREAD 16 /* ranges per thread for MTTKRP_SCHEDULE_DYNAMIC */
+#define FUSED_AHEAD 4 /* nonzeros ahead whose rows the fused kernels prefetch */
+#define NUMA_MAX_NODES 64 /* nodes a placement can spread over */
+
+/* Strategy the parallel MTTKRP uses for every mode */
+static enum mttkrp_strategy current_strategy = MTTKRP_AUTO;
+
+/* Adds a block of count decoded nonzeros into their rows of res. idx[d][k]
+ * holds the mode-d index of nonzero k. */
+typedef void (*mttkrp_kernel_fn)(struct hacoo_tensor *h, matrix_t **u,
+                                 unsigned int n, unsigned int fmax,
+                                 unsigned int **idx, const double *value,
+                                 size_t count, matrix_t *res);
+
+/* Adds a block of count decoded nonzeros into their rows of the result of
+ * every mode, res[d] for mode d, with atomic updates in the modes where
+ * atomic[d] is set. prefix has room for ndims rank vectors. */
+typedef void (*fused_kernel_fn)(struct hacoo_tensor *h, matrix_t **u,
+                                unsigned int fmax, unsigned int **idx,
+                                const double *value, size_t count,
+                                matrix_t **res, const int *atomic,
+                                double *prefix);
+
+/* Kernel set the parallel MTTKRP uses */
+static enum mttkrp_kernel current_kernel = MTTKRP_KERNEL_AUTO;
+
+/* How the privatized and atomic MTTKRP split the nonzeros */
+static enum mttkrp_schedule current_schedule = MTTKRP_SCHEDULE_BALANCED;
+
+/* Where the factor matrices are placed */
+static enum mttkrp_numa current_numa = MTTKRP_NUMA_OFF;
+
+/* Online NUMA nodes, read once. numa_count is 0 until then. */
+static unsigned int numa_count;
+static unsigned long numa_mask;
+
+/* Busy time, nonzeros and node of each thread of the last parallel MTTKRP */
+static double *busy_times;
+static size_t *busy_nnz;
+static int *busy_node;
+static int busy_cap;
+static int busy_count;
+
+/* Ranges of nonzeros the threads of one parallel MTTKRP walk */
+struct mttkrp_work {
+    size_t nparts;
+    size_t *first; //bucket range of each part, NULL to split evenly
+    int dynamic; //parts go to whichever thread is free next
+    size_t next; //next free part of a dynamic schedule
+};
+
+/* Helper Function Prototypes */
+static struct mttkrp_ws *ws_alloc(struct hacoo_tensor *t, unsigned int rank,
+                                  int nthreads, unsigned int rows);
+static int ws_partials(struct mttkrp_ws *ws);
+static void zero_result(struct mttkrp_ws *ws, matrix_t *res);
+static int mttkrp_privatized(struct hacoo_tensor *h, matrix_t **u,
+                             unsigned int n, struct mttkrp_ws *ws,
+                             matrix_t *res);
+static void mttkrp_atomic(struct hacoo_tensor *h, matrix_t **u,
+                          unsigned int n, struct mttkrp_ws *ws, matrix_t *res);
+static int owner_run(struct hacoo_tensor *h, matrix_t **u, unsigned int n,
+                     unsigned int nparts, struct mttkrp_ws *ws, matrix_t *res);
+static int csf_run(struct hacoo_tensor *h, matrix_t **u, unsigned int n,
+                   struct mttkrp_ws *ws, matrix_t *res);
+static mttkrp_kernel_fn pick_kernel(struct hacoo_tensor *h, unsigned int fmax);
+static fused_kernel_fn pick_fused_kernel(struct hacoo_tensor *h, unsigned int fmax);
+static enum mttkrp_kernel best_kernel(void);
+static int have_avx2_fma(void);
+static int have_avx512(void);
+static void work_init(struct hacoo_tensor *h, struct mttkrp_work *w);
+static void work_cursor(struct hacoo_tensor *h, struct mttkrp_work *w,
+                        struct hacoo_cursor *c, size_t part);
+static size_t work_first(struct mttkrp_work *w);
+static size_t work_next(struct mttkrp_work *w, size_t part);
+static void busy_reset(void);
+static void busy_record(double seconds, size_t nnz);
+static int numa_node(void);
+static void numa_interleave(void *addr, size_t len);
+static int ws_place(struct mttkrp_ws *ws, matrix_t **u, unsigned int n);
+static void replicas_free(struct mttkrp_ws *ws);
+static int fused_privatize(struct hacoo_tensor *h, unsigned int n,
+                           unsigned int rank, int nthreads);
+static matrix_t **thread_factors(struct mttkrp_ws *ws, matrix_t **u, int tid);
+
+/* Last mode whose factor row a nonzero's product takes, other than n */
+static inline unsigned int last_factor(struct hacoo_tensor *h, unsigned int n)
+{
+    return n == h->ndims - 1 ? h->ndims - 2 : h->ndims - 1;
+}
+
+/* Portable kernel for any rank. Each column is the nonzero's value times
+ * its factor rows, added straight into the result. */
+static void kernel_scalar(struct hacoo_tensor *h, matrix_t **u, unsigned int n,
+                          unsigned int fmax, unsigned int **idx,
+                          const double *value, size_t count, matrix_t *res)
+{
+    for (size_t k = 0; k < count; k++) {
+        double *out = res->vals[idx[n][k]];
+
+        for (unsigned int f = 0; f < fmax; f++) {
+            double p = value[k];
+            for (unsigned int d = 0; d < h->ndims; d++) {
+                if (d == n) continue;
+                p *= u[d]->vals[idx[d][k]][f];
+            }
+            out[f] += p;
+        }
+    }
+}
+
+/* SIMD kernels keep the product of a nonzero in registers: it starts as
+ * the value, is multiplied by every factor row but the last, and the last
+ * is fused into the update of the result. Ranks 8, 16, 32 and 64 unroll
+ * fully; other ranks run vector-wide steps with a partial last step. */
+#define KERNEL_AVX512(R)                                                      \
+__attribute__((target("avx512f")))                                            \
+static void kernel_avx512_##R(struct hacoo_tensor *h, matrix_t **u,           \
+                              unsigned int n, unsigned int fmax,              \
+                              unsigned int **idx, const double *value,        \
+                              size_t count, matrix_t *res)                    \
+{                                                                             \
+    unsigned int last = last_factor(h, n);                                    \
+    (void)fmax; /* dispatch only picks this kernel when fmax is R */          \
+                                                                              \
+    for (size_t k = 0; k < count; k++) {                                      \
+        __m512d acc[R / 8];                                                   \
+        for (int j = 0; j < R / 8; j++) {                                     \
+            acc[j] = _mm512_set1_pd(value[k]);                                \
+        }                                                                     \
+        for (unsigned int d = 0; d < h->ndims; d++) {                         \
+            if (d == n || d == last) continue;                                \
+            const double *row = u[d]->vals[idx[d][k]];                        \
+            for (int j = 0; j < R / 8; j++) {                                 \
+                acc[j] = _mm512_mul_pd(acc[j], _mm512_loadu_pd(&row[8 * j])); \
+            }                                                                 \
+        }                                                                     \
+        const double *row = u[last]->vals[idx[last][k]];                      \
+        double *out = res->vals[idx[n][k]];                                   \
+        for (int j = 0; j < R / 8; j++) {                                     \
+            _mm512_storeu_pd(&out[8 * j],                                     \
+                             _mm512_fmadd_pd(acc[j],                          \
+                                             _mm512_loadu_pd(&row[8 * j]),    \
+                                             _mm512_loadu_pd(&out[8 * j])));  \
+        }                                                                     \
+    }                                                                         \
+}
+
+#define KERNEL_AVX2(R)                                                        \
+__attribute__((target("avx2,fma")))                                           \
+static void kernel_avx2_##R(struct hacoo_tensor *h, matrix_t **u,             \
+                            unsigned int n, unsigned int fmax,                \
+                            unsigned int **idx, const double *value,          \
+                            size_t count, matrix_t *res)                      \
+{                                                                             \
+    unsigned int last = last_factor(h, n);                                    \
+    (void)fmax; /* dispatch only picks this kernel when fmax is R */          \
+                                                                              \
+    for (size_t k = 0; k < count; k++) {                                      \
+        __m256d acc[R / 4];                                                   \
+        for (int j = 0; j < R / 4; j++) {                                     \
+            acc[j] = _mm256_set1_pd(value[k]);                                \
+        }                                                                     \
+        for (unsigned int d = 0; d < h->ndims; d++) {                         \
+            if (d == n || d == last) continue;                                \
+            const double *row = u[d]->vals[idx[d][k]];                        \
+            for (int j = 0; j < R / 4; j++) {                                 \
+                acc[j] = _mm256_mul_pd(acc[j], _mm256_loadu_pd(&row[4 * j])); \
+            }                                                                 \
+        }                                                                     \
+        const double *row = u[last]->vals[idx[last][k]];                      \
+        double *out = res->vals[idx[n][k]];                                   \
+        for (int j = 0; j < R / 4; j++) {                                     \
+            _mm256_storeu_pd(&out[4 * j],                                     \
+                             _mm256_fmadd_pd(acc[j],                          \
+                                             _mm256_loadu_pd(&row[4 * j]),    \
+                                             _mm256_loadu_pd(&out[4 * j])));  \
+        }                                                                     \
+    }                                                                         \
+}
+
+KERNEL_AVX512(8)
+KERNEL_AVX512(16)
+KERNEL_AVX512(32)
+KERNEL_AVX512(64)
+KERNEL_AVX2(8)
+KERNEL_AVX2(16)
+KERNEL_AVX2(32)
+KERNEL_AVX2(64)
+
+/* Any rank, eight columns at a time with a masked last step */
+__attribute__((target("avx512f")))
+static void kernel_avx512_any(struct hacoo_tensor *h, matrix_t **u,
+                              unsigned int n, unsigned int fmax,
+                              unsigned int **idx, const double *value,
+                              size_t count, matrix_t *res)
+{
+    unsigned int last = last_factor(h, n);
+
+    for (size_t k = 0; k < count; k++) {
+        const double *row = u[last]->vals[idx[last][k]];
+        double *out = res->vals[idx[n][k]];
+
+        for (unsigned int f = 0; f < fmax; f += 8) {
+            __mmask8 m = fmax - f >= 8 ? 0xff : (1u << (fmax - f)) - 1;
+            __m512d acc = _mm512_set1_pd(value[k]);
+            for (unsigned int d = 0; d < h->ndims; d++) {
+                if (d == n || d == last) continue;
+                acc = _mm512_mul_pd(acc, _mm512_maskz_loadu_pd(m, &u[d]->vals[idx[d][k]][f]));
+            }
+            acc = _mm512_fmadd_pd(acc, _mm512_maskz_loadu_pd(m, &row[f]),
+                                  _mm512_maskz_loadu_pd(m, &out[f]));
+            _mm512_mask_storeu_pd(&out[f], m, acc);
+        }
+    }
+}
+
+/* Any rank, four columns at a time with the rest one by one */
+__attribute__((target("avx2,fma")))
+static void kernel_avx2_any(struct hacoo_tensor *h, matrix_t **u,
+                            unsigned int n, unsigned int fmax,
+                            unsigned int **idx, const double *value,
+                            size_t count, matrix_t *res)
+{
+    unsigned int last = last_factor(h, n);
+
+    for (size_t k = 0; k < count; k++) {
+        const double *row = u[last]->vals[idx[last][k]];
+        double *out = res->vals[idx[n][k]];
+        unsigned int f = 0;
+
+        for (; f + 4 <= fmax; f += 4) {
+            __m256d acc = _mm256_set1_pd(value[k]);
+            for (unsigned int d = 0; d < h->ndims; d++) {
+                if (d == n || d == last) continue;
+                acc = _mm256_mul_pd(acc, _mm256_loadu_pd(&u[d]->vals[idx[d][k]][f]));
+            }
+            _mm256_storeu_pd(&out[f], _mm256_fmadd_pd(acc, _mm256_loadu_pd(&row[f]),
+                                                      _mm256_loadu_pd(&out[f])));
+        }
+        for (; f < fmax; f++) {
+            double p = value[k];
+            for (unsigned int d = 0; d < h->ndims; d++) {
+                if (d == n) continue;
+                p *= u[d]->vals[idx[d][k]][f];
+            }
+            out[f] += p;
+        }
+    }
+}
+
+/* Add the contribution of nonzero k of a decoded block to its row of res,
+ * which other threads update at the same time */
+static inline void mttkrp_nonzero_atomic(struct hacoo_tensor *h, matrix_t **u,
+                                         unsigned int n, unsigned int fmax,
+                                         unsigned int **idx, size_t k,
+                                         double value, double *rank_vec,
+                                         matrix_t *res)
+{
+    for (int f = 0; f < fmax; f++) {
+        rank_vec[f] = value;
+    }
+
+    for (int d = 0; d < h->ndims; d++) {
+        if (d == n) continue;
+        double *vec_d = u[d]->vals[idx[d][k]];
+        for (int f = 0; f < fmax; f++) {
+            rank_vec[f] *= vec_d[f];
+        }
+    }
+
+    double *out = res->vals[idx[n][k]];
+    for (int f = 0; f < fmax; f++) {
+        #pragma omp atomic
+        out[f] += rank_vec[f];
+    }
+}
+
+/* Fused kernels for mttkrp_all_modes. With prefix[d] the product of the
+ * factor rows of modes 0..d-1, a walk down the modes keeps the value times
+ * the rows of modes d+1..N-1, so each mode's update is prefix[d] times that
+ * and costs three multiplies per column instead of N-1. The rows of a
+ * nonzero are looked up once, before any of its updates. A nonzero touches
+ * twice as many rows as in a one-mode kernel, so the AVX-512 kernels
+ * prefetch the rows of the nonzero FUSED_AHEAD places on. */
+static void fused_scalar(struct hacoo_tensor *h, matrix_t **u,
+                         unsigned int fmax, unsigned int **idx,
+                         const double *value, size_t count, matrix_t **res,
+                         const int *atomic, double *prefix)
+{
+    unsigned int nd = h->ndims;
+    const double *row[nd];
+    double *out[nd];
+
+    for (size_t k = 0; k < count; k++) {
+        for (unsigned int d = 0; d < nd; d++) {
+            row[d] = u[d]->vals[idx[d][k]];
+            out[d] = res[d]->vals[idx[d][k]];
+        }
+        for (unsigned int f = 0; f < fmax; f++) {
+            double suffix = value[k];
+
+            prefix[0] = 1.0;
+            for (unsigned int d = 1; d < nd; d++) {
+                prefix[d] = prefix[d - 1] * row[d - 1][f];
+            }
+            for (unsigned int d = nd; d-- > 0;) {
+                if (atomic[d]) {
+                    #pragma omp atomic
+                    out[d][f] += prefix[d] * suffix;
+                } else {
+                    out[d][f] += prefix[d] * suffix;
+                }
+                suffix *= row[d][f];
+            }
+        }
+    }
+}
+
+/* Eight columns at a time with a masked last step. Atomic modes go through
+ * prefix, which the vector steps don't use. */
+__attribute__((target("avx512f")))
+static void fused_avx512(struct hacoo_tensor *h, matrix_t **u,
+                         unsigned int fmax, unsigned int **idx,
+                         const double *value, size_t count, matrix_t **res,
+                         const int *atomic, double *prefix)
+{
+    unsigned int nd = h->ndims;
+    const double *row[nd];
+    double *out[nd];
+    __m512d pre[nd];
+
+    for (size_t k = 0; k < count; k++) {
+        for (unsigned int d = 0; d < nd; d++) {
+            row[d] = u[d]->vals[idx[d][k]];
+            out[d] = res[d]->vals[idx[d][k]];
+        }
+        if (k + FUSED_AHEAD < count) {
+            for (unsigned int d = 0; d < nd; d++) {
+                const double *r = u[d]->vals[idx[d][k + FUSED_AHEAD]];
+                const double *o = res[d]->vals[idx[d][k + FUSED_AHEAD]];
+                for (unsigned int f = 0; f < fmax; f += 8) {
+                    _mm_prefetch((const char *)&r[f], _MM_HINT_T0);
+                    _mm_prefetch((const char *)&o[f], _MM_HINT_T0);
+                }
+            }
+        }
+        for (unsigned int f = 0; f < fmax; f += 8) {
+            __mmask8 m = fmax - f >= 8 ? 0xff : (1u << (fmax - f)) - 1;
+            __m512d suffix = _mm512_set1_pd(value[k]);
+
+            pre[0] = _mm512_set1_pd(1.0);
+            for (unsigned int d = 1; d < nd; d++) {
+                pre[d] = _mm512_mul_pd(pre[d - 1], _mm512_maskz_loadu_pd(m, &row[d - 1][f]));
+            }
+            for (unsigned int d = nd; d-- > 0;) {
+                if (atomic[d]) {
+                    _mm512_mask_storeu_pd(prefix, m, _mm512_mul_pd(pre[d], suffix));
+                    for (unsigned int j = 0; j < 8 && f + j < fmax; j++) {
+                        #pragma omp atomic
+                        out[d][f + j] += prefix[j];
+                    }
+                } else {
+                    _mm512_mask_storeu_pd(&out[d][f], m,
+                                          _mm512_fmadd_pd(pre[d], suffix,
+                                                          _mm512_maskz_loadu_pd(m, &out[d][f])));
+                }
+                suffix = _mm512_mul_pd(suffix, _mm512_maskz_loadu_pd(m, &row[d][f]));
+            }
+        }
+    }
+}
+
+/* Ranks 8, 16, 32 and 64 unroll fully. The prefix products go to the
+ * scratch and the suffix stays in registers. The first two modes share a
+ * prefix row, so these need two or more modes, as pick_fused_kernel
+ * checks. */
+#define FUSED_AVX512(R)                                                       \
+__attribute__((target("avx512f")))                                            \
+static void fused_avx512_##R(struct hacoo_tensor *h, matrix_t **u,            \
+                             unsigned int fmax, unsigned int **idx,           \
+                             const double *value, size_t count,               \
+                             matrix_t **res, const int *atomic,               \
+                             double *prefix)                                  \
+{                                                                             \
+    unsigned int nd = h->ndims;                                               \
+    (void)fmax; /* dispatch only picks this kernel when fmax is R */          \
+    if (nd < 2) {                                                             \
+        return;                                                               \
+    }                                                                         \
+    const double *row[nd];                                                    \
+    double *out[nd];                                                          \
+                                                                              \
+    for (size_t k = 0; k < count; k++) {                                      \
+        __m512d suffix[R / 8];                                                \
+        for (unsigned int d = 0; d < nd; d++) {                               \
+            row[d] = u[d]->vals[idx[d][k]];                                   \
+            out[d] = res[d]->vals[idx[d][k]];                                 \
+        }                                                                     \
+        if (k + FUSED_AHEAD < count) {                                        \
+            for (unsigned int d = 0; d < nd; d++) {                           \
+                const double *r = u[d]->vals[idx[d][k + FUSED_AHEAD]];        \
+                const double *o = res[d]->vals[idx[d][k + FUSED_AHEAD]];      \
+                for (int j = 0; j < R / 8; j++) {                             \
+                    _mm_prefetch((const char *)&r[8 * j], _MM_HINT_T0);       \
+                    _mm_prefetch((const char *)&o[8 * j], _MM_HINT_T0);       \
+                }                                                             \
+            }                                                                 \
+        }                                                                     \
+        for (int j = 0; j < R / 8; j++) {                                     \
+            suffix[j] = _mm512_loadu_pd(&row[0][8 * j]);                      \
+            _mm512_storeu_pd(&prefix[R + 8 * j], suffix[j]);                  \
+            suffix[j] = _mm512_set1_pd(value[k]);                             \
+        }                                                                     \
+        for (unsigned int d = 2; d < nd; d++) {                               \
+            for (int j = 0; j < R / 8; j++) {                                 \
+                _mm512_storeu_pd(&prefix[d * R + 8 * j],                      \
+                    _mm512_mul_pd(_mm512_loadu_pd(&prefix[(d - 1) * R + 8 * j]),\
+                                  _mm512_loadu_pd(&row[d - 1][8 * j])));      \
+            }                                                                 \
+        }                                                                     \
+        for (unsigned int d = nd; d-- > 0;) {                                 \
+            for (int j = 0; j < R / 8; j++) {                                 \
+                __m512d p = d ? _mm512_mul_pd(_mm512_loadu_pd(&prefix[d * R + 8 * j]),\
+                                              suffix[j]) : suffix[j];         \
+                if (atomic[d]) {                                              \
+                    double part[8];                                           \
+                    _mm512_storeu_pd(part, p);                                \
+                    for (int i = 0; i < 8; i++) {                             \
+                        _Pragma("omp atomic")                                 \
+                        out[d][8 * j + i] += part[i];                         \
+                    }                                                         \
+                } else {                                                      \
+                    _mm512_storeu_pd(&out[d][8 * j],                          \
+                        _mm512_add_pd(p, _mm512_loadu_pd(&out[d][8 * j])));   \
+                }                                                             \
+                if (d) {                                                      \
+                    suffix[j] = _mm512_mul_pd(suffix[j],                      \
+                                              _mm512_loadu_pd(&row[d][8 * j]));\
+                }                                                             \
+            }                                                                 \
+        }                                                                     \
+    }                                                                         \
+}
+
+FUSED_AVX512(8)
+FUSED_AVX512(16)
+FUSED_AVX512(32)
+FUSED_AVX512(64)
+
+/* Four columns at a time, the rest through the scalar steps */
+__attribute__((target("avx2,fma")))
+static void fused_avx2(struct hacoo_tensor *h, matrix_t **u,
+                       unsigned int fmax, unsigned int **idx,
+                       const double *value, size_t count, matrix_t **res,
+                       const int *atomic, double *prefix)
+{
+    unsigned int nd = h->ndims;
+    const double *row[nd];
+    double *out[nd];
+    __m256d pre[nd];
+
+    for (size_t k = 0; k < count; k++) {
+        unsigned int f = 0;
+
+        for (unsigned int d = 0; d < nd; d++) {
+            row[d] = u[d]->vals[idx[d][k]];
+            out[d] = res[d]->vals[idx[d][k]];
+        }
+        for (; f + 4 <= fmax; f += 4) {
+            __m256d suffix = _mm256_set1_pd(value[k]);
+
+            pre[0] = _mm256_set1_pd(1.0);
+            for (unsigned int d = 1; d < nd; d++) {
+                pre[d] = _mm256_mul_pd(pre[d - 1], _mm256_loadu_pd(&row[d - 1][f]));
+            }
+            for (unsigned int d = nd; d-- > 0;) {
+                if (atomic[d]) {
+                    _mm256_storeu_pd(prefix, _mm256_mul_pd(pre[d], suffix));
+                    for (unsigned int j = 0; j < 4; j++) {
+                        #pragma omp atomic
+                        out[d][f + j] += prefix[j];
+                    }
+                } else {
+                    _mm256_storeu_pd(&out[d][f], _mm256_fmadd_pd(pre[d], suffix,
+                                                                 _mm256_loadu_pd(&out[d][f])));
+                }
+                suffix = _mm256_mul_pd(suffix, _mm256_loadu_pd(&row[d][f]));
+            }
+        }
+        for (; f < fmax; f++) {
+            double suffix = value[k];
+
+            prefix[0] = 1.0;
+            for (unsigned int d = 1; d < nd; d++) {
+                prefix[d] = prefix[d - 1] * row[d - 1][f];
+            }
+            for (unsigned int d = nd; d-- > 0;) {
+                if (atomic[d]) {
+                    #pragma omp atomic
+                    out[d][f] += prefix[d] * suffix;
+                } else {
+                    out[d][f] += prefix[d] * suffix;
+                }
+                suffix *= row[d][f];
+            }
+        }
+    }
+}
+
+/* Start walking part of nparts of the nonzeros: a range of the Z-order
+ * stream if the tensor has one, a range of buckets otherwise */
+static void mttkrp_cursor_init(struct hacoo_tensor *h, struct hacoo_cursor *c,
+                               size_t part, size_t nparts)
+{
+    if (h->zorder_value) {
+        hacoo_zorder_cursor_init(h, c, h->nnz * part / nparts,
+                                 h->nnz * (part + 1) / nparts);
+        return;
+    }
+
+    size_t chunk = (h->nbuckets + nparts - 1) / nparts;
+    hacoo_cursor_init(h, c, part * chunk, (part + 1) * chunk);
+}
+
+/* Split the nonzeros for the threads of the next parallel region by the
+ * current schedule. Without a split, parts get equal bucket ranges. */
+static void work_init(struct hacoo_tensor *h, struct mttkrp_work *w)
+{
+    int nthreads = omp_get_max_threads();
+
+    w->dynamic = current_schedule == MTTKRP_SCHEDULE_DYNAMIC;
+    w->nparts = w->dynamic ? (size_t)nthreads * CHUNKS_PER_THREAD : nthreads;
+    w->first = NULL;
+    w->next = 0;
+
+    // The Z-order stream is split by nonzero count as it is
+    if (h->zorder_value || current_schedule == MTTKRP_SCHEDULE_STATIC) {
+        return;
+    }
+
+    w->first = malloc((w->nparts + 1) * sizeof(size_t));
+    if (!w->first || hacoo_split_buckets(h, w->nparts, w->first)) {
+        fprintf(stderr, "Warning: Balanced split failed, using equal bucket ranges.\n");
+        free(w->first);
+        w->first = NULL;
+    }
+}
+
+static void work_cursor(struct hacoo_tensor *h, struct mttkrp_work *w,
+                        struct hacoo_cursor *c, size_t part)
+{
+    if (w->first && !h->zorder_value) {
+        hacoo_cursor_init(h, c, w->first[part], w->first[part + 1]);
+    } else {
+        mttkrp_cursor_init(h, c, part, w->nparts);
+    }
+}
+
+/* First part of the calling thread. Static schedules deal the parts out
+ * round robin; a dynamic one hands the next free part to each thread
+ * that asks. */
+static size_t work_first(struct mttkrp_work *w)
+{
+    size_t part;
+
+    if (!w->dynamic) {
+        return omp_get_thread_num();
+    }
+    #pragma omp atomic capture
+    part = w->next++;
+    return part;
+}
+
+static size_t work_next(struct mttkrp_work *w, size_t part)
+{
+    if (!w->dynamic) {
+        return part + omp_get_num_threads();
+    }
+    #pragma omp atomic capture
+    part = w->next++;
+    return part;
+}
+
+/* Make room for the busy time of every thread of the next region */
+static void busy_reset(void)
+{
+    int nthreads = omp_get_max_threads();
+
+    if (nthreads > busy_cap) {
+        double *b = realloc(busy_times, nthreads * sizeof(double));
+        if (b) {
+            busy_times = b;
+        }
+        size_t *z = realloc(busy_nnz, nthreads * sizeof(size_t));
+        if (z) {
+            busy_nnz = z;
+        }
+        int *d = realloc(busy_node, nthreads * sizeof(int));
+        if (d) {
+            busy_node = d;
+        }
+        if (b && z && d) {
+            busy_cap = nthreads;
+        }
+    }
+    busy_count = 0;
+}
+
+/* Record the calling thread's busy time, its nonzeros and its node */
+static void busy_record(double seconds, size_t nnz)
+{
+    int tid = omp_get_thread_num();
+
+    if (tid < busy_cap) {
+        busy_times[tid] = seconds;
+        busy_nnz[tid] = nnz;
+        busy_node[tid] = numa_node();
+    }
+    if (tid == 0) {
+        int nthreads = omp_get_num_threads();
+        busy_count = nthreads < busy_cap ? nthreads : busy_cap;
+    }
+}
+
+/* Node the calling thread is running on, 0 where it cannot be found */
+static int numa_node(void)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned int cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 &&
+        node < mttkrp_numa_nodes()) {
+        return node;
+    }
+#endif
+    return 0;
+}
+
+/* Ask the kernel to spread the pages of addr..addr+len over the online
+ * nodes, moving those already faulted in. The pages at either end are
+ * shared with whatever sits next to the buffer. Best effort: a kernel
+ * without NUMA support leaves the pages where they are. */
+static void numa_interleave(void *addr, size_t len)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page - 1);
+    unsigned long mask = numa_mask;
+
+    if (len == 0 || mttkrp_numa_nodes() == 0) {
+        return;
+    }
+    syscall(SYS_mbind, start, (uintptr_t)addr + len - start, MPOL_INTERLEAVE,
+            &mask, sizeof(mask) * 8, MPOL_MF_MOVE);
+#else
+    (void)addr;
+    (void)len;
+#endif
+}
+
+/* Put the factors where the placement wants them before a run of mode n.
+ * Interleaving moves each factor once, when it is first seen. Replicas
+ * are copied afresh every run since ALS changes the factors in between,
+ * each by the threads of its node. If a replica cannot be made the
+ * factors are interleaved instead. Returns 0. */
+static int ws_place(struct mttkrp_ws *ws, matrix_t **u, unsigned int n)
+{
+    struct hacoo_tensor *h = ws->t;
+    int failed = 0;
+
+    if (current_numa == MTTKRP_NUMA_INTERLEAVE || ws->unreplicated) {
+        for (unsigned int d = 0; d < h->ndims; d++) {
+            if (d != n && ws->placed[d] != u[d]->data) {
+                numa_interleave(u[d]->data,
+                                (size_t)u[d]->rows * u[d]->cols * sizeof(double));
+                ws->placed[d] = u[d]->data;
+            }
+        }
+        return 0;
+    }
+    if (current_numa != MTTKRP_NUMA_REPLICATE || ws->nnodes < 2) {
+        return 0;
+    }
+
+    #pragma omp parallel num_threads(ws->nthreads)
+    {
+        ws->thread_node[omp_get_thread_num()] = numa_node();
+    }
+
+    #pragma omp parallel num_threads(ws->nthreads)
+    {
+        int tid = omp_get_thread_num();
+        int node = ws->thread_node[tid];
+        int share = 0, nshares = 0;
+
+        for (int i = 0; i < ws->nthreads; i++) {
+            if (ws->thread_node[i] == node) {
+                share += i < tid;
+                nshares++;
+            }
+        }
+
+        // The first thread of a node makes its replicas
+        if (share == 0 && !ws->replica[node]) {
+            matrix_t **r = calloc(h->ndims, sizeof(matrix_t *));
+            int made = r != NULL;
+            for (unsigned int d = 0; made && d < h->ndims; d++) {
+                r[d] = new_matrix(h->dims[d], ws->rank);
+                made = r[d] != NULL;
+            }
+            if (!made) {
+                for (unsigned int d = 0; r && d < h->ndims && r[d]; d++) {
+                    free_matrix(r[d]);
+                }
+                free(r);
+                r = NULL;
+                #pragma omp atomic write
+                failed = 1;
+            }
+            ws->replica[node] = r;
+        }
+        #pragma omp barrier
+
+        // Then each thread of the node copies its share of the rows
+        for (unsigned int d = 0; ws->replica[node] && d < h->ndims; d++) {
+            size_t len = (size_t)h->dims[d] * ws->rank;
+            size_t lo = len * share / nshares;
+            size_t hi = len * (share + 1) / nshares;
+
+            if (d != n) {
+                memcpy(&ws->replica[node][d]->data[lo], &u[d]->data[lo],
+                       (hi - lo) * sizeof(double));
+            }
+        }
+    }
+
+    // Without a full set of replicas every node reads the one copy, spread
+    // over the nodes
+    if (failed) {
+        fprintf(stderr, "Warning: Factor replicas could not be made, "
+                "interleaving the factors instead.\n");
+        replicas_free(ws);
+        ws->unreplicated = 1;
+        return ws_place(ws, u, n);
+    }
+    return 0;
+}
+
+/* Free every node's replicas */
+static void replicas_free(struct mttkrp_ws *ws)
+{
+    for (unsigned int i = 0; ws->replica && i < ws->nnodes; i++) {
+        for (size_t d = 0; ws->replica[i] && d < ws->t->ndims; d++) {
+            if (ws->replica[i][d]) {
+                free_matrix(ws->replica[i][d]);
+            }
+        }
+        free(ws->replica[i]);
+        ws->replica[i] = NULL;
+    }
+}
+
+/* Factors thread tid reads: its node's replicas when there are any */
+static matrix_t **thread_factors(struct mttkrp_ws *ws, matrix_t **u, int tid)
+{
+    if (current_numa == MTTKRP_NUMA_REPLICATE && ws->nnodes > 1 &&
+        ws->replica[ws->thread_node[tid]]) {
+        return ws->replica[ws->thread_node[tid]];
+    }
+    return u;
+}
+
+/* Sort the nonzeros into Z-order first if the tensor asks for it */
+static void mttkrp_prepare(struct hacoo_tensor *h)
+{
+    // The bucket walk needs every entry in the current table
+    hacoo_finish_rehash(h);
+
+    if ((h->flags & HACOO_ZORDER) && hacoo_zorder(h)) {
+        fprintf(stderr, "Warning: Z-order sort failed, using hash order.\n");
+    }
+}
+
+/* Sum over the subtree of node f of a fiber index level into acc[level].
+ * Each child's sum is multiplied by its own factor row once, so a product
+ * along a fiber is shared by every nonzero below it. acc holds a rank
+ * vector per level. */
+static void csf_subtree(const struct hacoo_csf *csf, matrix_t **u,
+                        unsigned int fmax, unsigned int level, size_t f,
+                        double **acc)
+{
+    double *sum = acc[level];
+    unsigned int child = level + 1;
+    matrix_t *uc = u[csf->mode[child]];
+
+    for (unsigned int r = 0; r < fmax; r++) {
+        sum[r] = 0.0;
+    }
+
+    if (child == csf->nlevels - 1) {
+        for (size_t z = csf->fptr[level][f]; z < csf->fptr[level][f + 1]; z++) {
+            double *row = uc->vals[csf->fids[child][z]];
+            double value = csf->value[z];
+            for (unsigned int r = 0; r < fmax; r++) {
+                sum[r] += value * row[r];
+            }
+        }
+        return;
+    }
+
+    for (size_t c = csf->fptr[level][f]; c < csf->fptr[level][f + 1]; c++) {
+        csf_subtree(csf, u, fmax, child, c, acc);
+        double *row = uc->vals[csf->fids[child][c]];
+        for (unsigned int r = 0; r < fmax; r++) {
+            sum[r] += acc[child][r] * row[r];
+        }
+    }
+}
+
+matrix_t *mttkrp_csf(struct hacoo_tensor *h, matrix_t **u, unsigned int n)
+{
+    struct mttkrp_ws *ws = ws_alloc(h, u[0]->cols, omp_get_max_threads(), 0);
+    matrix_t *res = NULL;
+
+    if (!ws) {
+        return NULL;
+    }
+
+    res = new_matrix(h->dims[n], ws->rank);
+    if (csf_run(h, u, n, ws, res)) {
+        free_matrix(res);
+        res = NULL;
+    }
+    mttkrp_ws_free(ws);
+    return res;
+}
+
+/* MTTKRP where each thread owns a range of output rows and handles the
+ * nonzeros that fall in it (see hacoo_rowpart), so it writes the result
+ * directly with no partial matrices to zero or merge. */
+matrix_t *mttkrp_owner(struct hacoo_tensor *h, matrix_t **u, unsigned int n)
+{
+    struct mttkrp_ws *ws = ws_alloc(h, u[0]->cols, omp_get_max_threads(), 0);
+    matrix_t *res = NULL;
+
+    if (!ws) {
+        return NULL;
+    }
+
+    res = new_matrix(h->dims[n], ws->rank);
+    if (owner_run(h, u, n, ws->nthreads, ws, res)) {
+        free_matrix(res);
+        res = NULL;
+    }
+    mttkrp_ws_free(ws);
+    return res;
+}
+
+/* Choose by comparing what each strategy adds to the nnz * rank updates
+ * every one of them makes. Privatizing costs zeroing and merging nthreads
+ * partials of dims[n] rows. Atomics cost little while rows are sparse,
+ * but conflict when many nonzeros share a row, and row tiles need none of
+ * either once the partition is cached. */
+enum mttkrp_strategy mttkrp_choose_strategy(struct hacoo_tensor *t,
+                                            unsigned int n, unsigned int rank,
+                                            int nthreads)
+{
+    double partials = (double)nthreads * t->dims[n];
+
+    if (nthreads <= 1) {
+        return MTTKRP_PRIVATIZE;
+    }
+    if (partials * PRIVATE_SHARE <= t->nnz &&
+        partials * rank * sizeof(double) <= PRIVATE_MAX_BYTES) {
+        return MTTKRP_PRIVATIZE;
+    }
+    if (t->nnz > (size_t)DENSE_ROW * t->dims[n]) {
+        return MTTKRP_TILED;
+    }
+    return MTTKRP_ATOMIC;
+}
+
+int mttkrp_set_strategy(enum mttkrp_strategy s)
+{
+    if (s < MTTKRP_AUTO || s > MTTKRP_ATOMIC) {
+        return -1;
+    }
+    current_strategy = s;
+    return 0;
+}
+
+enum mttkrp_strategy mttkrp_get_strategy(void)
+{
+    return current_strategy;
+}
+
+const char *mttkrp_strategy_name(enum mttkrp_strategy s)
+{
+    switch (s) {
+    case MTTKRP_PRIVATIZE:
+        return "privatize";
+    case MTTKRP_TILED:
+        return "tiled";
+    case MTTKRP_ATOMIC:
+        return "atomic";
+    default:
+        return "auto";
+    }
+}
+
+int mttkrp_set_kernel(enum mttkrp_kernel k)
+{
+    if (k == MTTKRP_KERNEL_AUTO) {
+        current_kernel = k;
+        return 0;
+    }
+
+    switch (k) {
+    case MTTKRP_KERNEL_SCALAR:
+        break;
+    case MTTKRP_KERNEL_AVX2:
+        if (!have_avx2_fma()) {
+            return -1;
+        }
+        break;
+    case MTTKRP_KERNEL_AVX512:
+        if (!have_avx512()) {
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    current_kernel = k;
+    return 0;
+}
+
+enum mttkrp_kernel mttkrp_get_kernel(void)
+{
+    return current_kernel == MTTKRP_KERNEL_AUTO ? best_kernel() : current_kernel;
+}
+
+const char *mttkrp_kernel_name(enum mttkrp_kernel k)
+{
+    switch (k) {
+    case MTTKRP_KERNEL_SCALAR:
+        return "scalar";
+    case MTTKRP_KERNEL_AVX2:
+        return "avx2";
+    case MTTKRP_KERNEL_AVX512:
+        return "avx512";
+    default:
+        return "auto";
+    }
+}
+
+int mttkrp_kernel_specialized(unsigned int rank)
+{
+    return mttkrp_get_kernel() != MTTKRP_KERNEL_SCALAR &&
+           (rank == 8 || rank == 16 || rank == 32 || rank == 64);
+}
+
+int mttkrp_set_schedule(enum mttkrp_schedule s)
+{
+    if (s < MTTKRP_SCHEDULE_BALANCED || s > MTTKRP_SCHEDULE_STATIC) {
+        return -1;
+    }
+    current_schedule = s;
+    return 0;
+}
+
+enum mttkrp_schedule mttkrp_get_schedule(void)
+{
+    return current_schedule;
+}
+
+const char *mttkrp_schedule_name(enum mttkrp_schedule s)
+{
+    switch (s) {
+    case MTTKRP_SCHEDULE_DYNAMIC:
+        return "dynamic";
+    case MTTKRP_SCHEDULE_STATIC:
+        return "static";
+    default:
+        return "balanced";
+    }
+}
+
+int mttkrp_busy_times(const double **busy)
+{
+    *busy = busy_times;
+    return busy_count;
+}
+
+int mttkrp_set_numa(enum mttkrp_numa m)
+{
+    if (m < MTTKRP_NUMA_OFF || m > MTTKRP_NUMA_REPLICATE) {
+        return -1;
+    }
+    current_numa = m;
+    return 0;
+}
+
+enum mttkrp_numa mttkrp_get_numa(void)
+{
+    return current_numa;
+}
+
+const char *mttkrp_numa_name(enum mttkrp_numa m)
+{
+    switch (m) {
+    case MTTKRP_NUMA_OFF:
+        return "off";
+    case MTTKRP_NUMA_INTERLEAVE:
+        return "interleave";
+    case MTTKRP_NUMA_REPLICATE:
+        return "replicate";
+    }
+    return "unknown";
+}
+
+/* Nodes from the kernel's list of online nodes, such as "0-1" or "0,2".
+ * Node numbers past NUMA_MAX_NODES are left out. */
+unsigned int mttkrp_numa_nodes(void)
+{
+    if (numa_count) {
+        return numa_count;
+    }
+
+    numa_count = 1;
+    numa_mask = 1;
+#ifdef __linux__
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    unsigned int lo, hi, last = 0;
+    unsigned long mask = 0;
+
+    if (!f) {
+        return numa_count;
+    }
+    while (fscanf(f, "%u", &lo) == 1) {
+        hi = lo;
+        int c = fgetc(f);
+        if (c == '-') {
+            if (fscanf(f, "%u", &hi) != 1) {
+                break;
+            }
+            c = fgetc(f);
+        }
+        for (unsigned int i = lo; i <= hi && i < NUMA_MAX_NODES; i++) {
+            mask |= 1UL << i;
+            last = i;
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    if (mask) {
+        numa_count = last + 1;
+        numa_mask = mask;
+    }
+#endif
+    return numa_count;
+}
+
+int mttkrp_thread_work(const size_t **nnz, const int **node)
+{
+    *nnz = busy_nnz;
+    *node = busy_node;
+    return busy_count;
+}
+
+/* MTTKRP along every mode in one pass. Threads walk their share of the
+ * nonzeros as in mttkrp_privatized, decoding each once and updating the
+ * row of every mode with a fused kernel. Each mode adds into per-thread
+ * partials or, where those would be too big for it, atomically into the
+ * result. */
+int mttkrp_all_modes(struct hacoo_tensor *h, matrix_t **u, matrix_t **out)
+{
+    unsigned int nd = h->ndims;
+    unsigned int fmax = u[0]->cols;
+    int nthreads = omp_get_max_threads();
+    struct mttkrp_ws *ws = ws_alloc(h, fmax, nthreads, 0);
+    matrix_t **partials = NULL;
+    int atomic[nd];
+    int failed = 0;
+    struct mttkrp_work work;
+    fused_kernel_fn kernel = pick_fused_kernel(h, fmax);
+
+    for (unsigned int d = 0; d < nd; d++) {
+        out[d] = NULL;
+    }
+    if (!ws) {
+        return -1;
+    }
+
+    // Partial of mode d for thread tid at partials[tid * nd + d]
+    partials = calloc((size_t)ws->nthreads * nd, sizeof(matrix_t *));
+    if (!partials) {
+        goto error;
+    }
+    for (unsigned int d = 0; d < nd; d++) {
+        atomic[d] = !fused_privatize(h, d, fmax, ws->nthreads);
+        out[d] = new_matrix(h->dims[d], fmax);
+        if (!out[d]) {
+            goto error;
+        }
+        zero_result(ws, out[d]);
+        partials[d] = out[d];
+    }
+    if (ws_place(ws, u, nd)) {
+        goto error;
+    }
+
+    mttkrp_prepare(h);
+    work_init(h, &work);
+    busy_reset();
+
+    #pragma omp parallel num_threads(ws->nthreads)
+    {
+        int tid = omp_get_thread_num();
+        matrix_t **local_res = &partials[tid * nd];
+        matrix_t **uf = thread_factors(ws, u, tid);
+        double *prefix = ws->scratch[tid];
+        size_t nnz = 0;
+
+        struct hacoo_cursor cursor;
+        struct hacoo_block *block = ws->block[tid];
+        unsigned int *idx[nd];
+
+        for (unsigned int d = 0; d < nd; d++) {
+            idx[d] = &ws->idx_buf[tid][d * HACOO_BLOCK];
+        }
+
+        // The first thread adds into the results, the others make their
+        // own partials, and every thread adds atomically where there are none
+        for (unsigned int d = 0; tid && d < nd; d++) {
+            local_res[d] = atomic[d] ? out[d] : new_matrix(h->dims[d], fmax);
+            if (!local_res[d]) {
+                #pragma omp atomic write
+                failed = 1;
+            } else if (!atomic[d]) {
+                memset(local_res[d]->data, 0,
+                       (size_t)h->dims[d] * fmax * sizeof(double));
+            }
+        }
+        #pragma omp barrier
+        int skip = failed;
+
+        double t_busy = omp_get_wtime();
+        for (size_t p = work_first(&work); !skip && p < work.nparts;
+             p = work_next(&work, p)) {
+            work_cursor(h, &work, &cursor, p);
+            while (hacoo_next_block(h, &cursor, block)) {
+                hacoo_block_indices(h, block, idx);
+                kernel(h, uf, fmax, idx, block->value, block->count, local_res,
+                       atomic, prefix);
+                nnz += block->count;
+            }
+        }
+        busy_record(omp_get_wtime() - t_busy, nnz);
+    }
+    free(work.first);
+    if (failed) {
+        goto error;
+    }
+
+    // Sum the partials of each privatized mode into its result
+    for (unsigned int d = 0; d < nd; d++) {
+        if (atomic[d] || ws->nthreads == 1) {
+            continue;
+        }
+        #pragma omp parallel for schedule(static) num_threads(ws->nthreads)
+        for (unsigned int i = 0; i < h->dims[d]; i++) {
+            double *row = out[d]->vals[i];
+            for (int t = 1; t < ws->nthreads; t++) {
+                double *part = partials[t * nd + d]->vals[i];
+                for (unsigned int f = 0; f < fmax; f++) {
+                    row[f] += part[f];
+                }
+            }
+        }
+    }
+
+    for (int t = 1; t < ws->nthreads; t++) {
+        for (unsigned int d = 0; d < nd; d++) {
+            if (!atomic[d] && partials[t * nd + d]) {
+                free_matrix(partials[t * nd + d]);
+            }
+        }
+    }
+    free(partials);
+    mttkrp_ws_free(ws);
+    return 0;
+
+error:
+    fprintf(stderr, "Error: Memory allocation failed.\n");
+    for (int t = 1; partials && t < ws->nthreads; t++) {
+        for (unsigned int d = 0; d < nd; d++) {
+            if (!atomic[d] && partials[t * nd + d]) {
+                free_matrix(partials[t * nd + d]);
+            }
+        }
+    }
+    for (unsigned int d = 0; d < nd; d++) {
+        if (out[d]) {
+            free_matrix(out[d]);
+            out[d] = NULL;
+        }
+    }
+    free(partials);
+    mttkrp_ws_free(ws);
+    return -1;
+}
 
 /* Parallel MTTKRP */
 matrix_t *mttkrp(struct hacoo_tensor *h, matrix_t **u, unsigned int n)
 {
-    unsigned int fmax = u[0]->cols;
+    // A one-off workspace whose partials only need this mode's rows
+    struct mttkrp_ws *ws = ws_alloc(h, u[0]->cols, omp_get_max_threads(),
+                                    h->dims[n]);
+    matrix_t *res;
 
-    // Allocate the final output matrix (global result)
-    matrix_t *res = new_matrix(h->dims[n], fmax);
+    if (!ws) {
+        return NULL;
+    }
+
+    res = mttkrp_ws_run(ws, u, n);
+    if (res) {
+        ws->res[n] = NULL;
+    }
+    mttkrp_ws_free(ws);
+    return res;
+}
+
+struct mttkrp_ws *mttkrp_ws_alloc(struct hacoo_tensor *t, unsigned int rank,
+                                  int nthreads)
+{
+    unsigned int rows = 0;
+
+    for (size_t i = 0; i < t->ndims; i++) {
+        rows = t->dims[i] > rows ? t->dims[i] : rows;
+    }
+    return ws_alloc(t, rank, nthreads, rows);
+}
+
+void mttkrp_ws_free(struct mttkrp_ws *ws)
+{
+    if (ws->res) {
+        for (size_t i = 0; i < ws->t->ndims; i++) {
+            if (ws->res[i]) {
+                free_matrix(ws->res[i]);
+            }
+        }
+    }
+    for (int i = 0; i < ws->nthreads; i++) {
+        if (ws->partials && ws->partials[i]) {
+            free_matrix(ws->partials[i]);
+        }
+        if (ws->touched) {
+            free(ws->touched[i]);
+        }
+        if (ws->block) {
+            free(ws->block[i]);
+        }
+        if (ws->idx_buf) {
+            free(ws->idx_buf[i]);
+        }
+        if (ws->scratch) {
+            free(ws->scratch[i]);
+        }
+    }
+    replicas_free(ws);
+    free(ws->res);
+    free(ws->partials);
+    free(ws->touched);
+    free(ws->block);
+    free(ws->idx_buf);
+    free(ws->scratch);
+    free(ws->thread_node);
+    free(ws->replica);
+    free(ws->placed);
+    free(ws);
+}
+
+/* Same dispatch as mttkrp used to make on every call, with the result and
+ * the buffers taken from the workspace */
+matrix_t *mttkrp_ws_run(struct mttkrp_ws *ws, matrix_t **u, unsigned int n)
+{
+    struct hacoo_tensor *h = ws->t;
+
+    if (n >= h->ndims || u[0]->cols != ws->rank) {
+        fprintf(stderr, "Error: MTTKRP workspace is for rank %u.\n", ws->rank);
+        return NULL;
+    }
+
+    // Clearing a new result too spreads its first touch over the threads
+    if (!ws->res[n]) {
+        ws->res[n] = new_matrix(h->dims[n], ws->rank);
+        if (!ws->res[n]) {
+            return NULL;
+        }
+    }
+    zero_result(ws, ws->res[n]);
+    matrix_t *res = ws->res[n];
+
+    if (ws_place(ws, u, n)) {
+        return NULL;
+    }
+
+    // Tensors with fiber indexes need no per-thread results
+    if (h->flags & HACOO_CSF) {
+        if (csf_run(h, u, n, ws, res) == 0) {
+            return res;
+        }
+        fprintf(stderr, "Warning: No fiber index, using hash order.\n");
+    }
+
+    enum mttkrp_strategy s = current_strategy;
+    if (s == MTTKRP_AUTO) {
+        s = mttkrp_choose_strategy(h, n, ws->rank, ws->nthreads);
+    }
+
+    switch (s) {
+    case MTTKRP_TILED:
+        if (owner_run(h, u, n, ws->nthreads * TILES_PER_THREAD, ws, res) == 0) {
+            return res;
+        }
+        fprintf(stderr, "Warning: No row tiles, privatizing.\n");
+        break;
+    case MTTKRP_ATOMIC:
+        mttkrp_atomic(h, u, n, ws, res);
+        return res;
+    default:
+        break;
+    }
+    if (mttkrp_privatized(h, u, n, ws, res)) {
+        return NULL;
+    }
+    return res;
+}
+
+/* Workspace whose partials have room for rows rows */
+static struct mttkrp_ws *ws_alloc(struct hacoo_tensor *t, unsigned int rank,
+                                  int nthreads, unsigned int rows)
+{
+    struct mttkrp_ws *ws = calloc(1, sizeof(struct mttkrp_ws));
+    int failed = 0;
+
+    if (!ws) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return NULL;
+    }
+
+    ws->t = t;
+    ws->rank = rank;
+    ws->nthreads = nthreads < 1 ? 1 : nthreads;
+    ws->rows = rows;
+    ws->res = calloc(t->ndims, sizeof(matrix_t *));
+    ws->block = calloc(ws->nthreads, sizeof(struct hacoo_block *));
+    ws->idx_buf = calloc(ws->nthreads, sizeof(unsigned int *));
+    ws->scratch = calloc(ws->nthreads, sizeof(double *));
+    ws->nnodes = mttkrp_numa_nodes();
+    ws->thread_node = calloc(ws->nthreads, sizeof(int));
+    ws->replica = calloc(ws->nnodes, sizeof(matrix_t **));
+    ws->placed = calloc(t->ndims, sizeof(double *));
+    if (!ws->res || !ws->block || !ws->idx_buf || !ws->scratch ||
+        !ws->thread_node || !ws->replica || !ws->placed) {
+        goto error;
+    }
+
+    // Each thread makes its own buffers so they are first touched on its
+    // node. Scratch holds a rank vector per fiber index level.
+    #pragma omp parallel num_threads(ws->nthreads)
+    {
+        int i = omp_get_thread_num();
+
+        ws->block[i] = malloc(sizeof(struct hacoo_block));
+        ws->idx_buf[i] = malloc(t->ndims * HACOO_BLOCK * sizeof(unsigned int));
+        ws->scratch[i] = calloc(t->ndims * rank, sizeof(double));
+        if (!ws->block[i] || !ws->idx_buf[i] || !ws->scratch[i]) {
+            #pragma omp atomic write
+            failed = 1;
+        } else {
+            memset(ws->idx_buf[i], 0, t->ndims * HACOO_BLOCK * sizeof(unsigned int));
+        }
+    }
+    if (failed) {
+        goto error;
+    }
+
+    return ws;
+
+error:
+    fprintf(stderr, "Error: Memory allocation failed.\n");
+    mttkrp_ws_free(ws);
+    return NULL;
+}
+
+/* Partial results of all threads but the first, which adds straight into
+ * the result. They are made on the first privatized run, each by its own
+ * thread, and kept zeroed outside the rows marked in touched. */
+static int ws_partials(struct mttkrp_ws *ws)
+{
+    int failed = 0;
+
+    if (ws->partials) {
+        return 0;
+    }
+
+    ws->partials = calloc(ws->nthreads, sizeof(matrix_t *));
+    ws->touched = calloc(ws->nthreads, sizeof(unsigned char *));
+    if (!ws->partials || !ws->touched) {
+        goto error;
+    }
+
+    // Writing the zeros faults the pages in on the owner's node
+    #pragma omp parallel num_threads(ws->nthreads)
+    {
+        int i = omp_get_thread_num();
+
+        if (i > 0) {
+            ws->partials[i] = new_matrix(ws->rows, ws->rank);
+            ws->touched[i] = malloc(ws->rows);
+            if (!ws->partials[i] || !ws->touched[i]) {
+                #pragma omp atomic write
+                failed = 1;
+            } else {
+                memset(ws->partials[i]->data, 0,
+                       (size_t)ws->rows * ws->rank * sizeof(double));
+                memset(ws->touched[i], 0, ws->rows);
+            }
+        }
+    }
+    if (failed) {
+        goto error;
+    }
+    return 0;
 
-    int num_threads = omp_get_max_threads();
+error:
+    fprintf(stderr, "Error: Memory allocation failed.\n");
+    for (int i = 0; i < ws->nthreads; i++) {
+        if (ws->partials && ws->partials[i]) {
+            free_matrix(ws->partials[i]);
+        }
+        if (ws->touched) {
+            free(ws->touched[i]);
+        }
+    }
+    free(ws->partials);
+    free(ws->touched);
+    ws->partials = NULL;
+    ws->touched = NULL;
+    return -1;
+}
 
-    matrix_t **partials = malloc(num_threads * sizeof(matrix_t *));
+/* Clear a result left by an earlier run, split over the threads */
+static void zero_result(struct mttkrp_ws *ws, matrix_t *res)
+{
+    size_t len = (size_t)res->rows * res->cols;
 
-    #pragma omp parallel
+    #pragma omp parallel num_threads(ws->nthreads)
     {
         int tid = omp_get_thread_num();
         int nthreads = omp_get_num_threads();
+        size_t lo = len * tid / nthreads;
+        size_t hi = len * (tid + 1) / nthreads;
 
-        //if (tid == 0) {
-            //printf("Number of threads: %d\n", nthreads);
-        //}
-
-        partials[tid] = new_matrix(h->dims[n], fmax);
-        matrix_t *local_res = partials[tid];
+        memset(&res->data[lo], 0, (hi - lo) * sizeof(double));
+    }
+}
 
-        int chunk = (h->nbuckets + nthreads - 1) / nthreads;
-        int start = tid * chunk;
-        int end = (start + chunk > h->nbuckets) ? h->nbuckets : start + chunk;
+/* The first thread adds into the result and the others into their own
+ * partial, marking each row they write. The partials are then summed into
+ * the result row by row, and only marked rows are read and cleared. */
+static int mttkrp_privatized(struct hacoo_tensor *h, matrix_t **u,
+                             unsigned int n, struct mttkrp_ws *ws,
+                             matrix_t *res)
+{
+    unsigned int fmax = ws->rank;
+    mttkrp_kernel_fn kernel = pick_kernel(h, fmax);
+    struct mttkrp_work work;
 
-        unsigned int *idx = malloc(h->ndims * sizeof(unsigned int));
-        double *rank_vec = malloc(fmax * sizeof(double));
+    if (ws_partials(ws)) {
+        return -1;
+    }
 
-        // Loop over assigned bucket vectors
-        for (int i = start; i < end; i++) {
-            bucket_vector *vec = &h->buckets[i];
-            if (vec->size == 0)
-                continue;
+    mttkrp_prepare(h);
+    work_init(h, &work);
+    busy_reset();
 
-            for (size_t j = 0; j < vec->size; j++) {
-                struct hacoo_bucket *cur = &vec->data[j];
+    #pragma omp parallel num_threads(ws->nthreads)
+    {
+        int tid = omp_get_thread_num();
+        matrix_t *local_res = tid ? ws->partials[tid] : res;
+        unsigned char *touched = ws->touched[tid];
+        matrix_t **uf = thread_factors(ws, u, tid);
+        size_t nnz = 0;
 
-                // Get full index array from compressed HaCOO format
-                hacoo_extract_index(cur, h->ndims, idx);
+        struct hacoo_cursor cursor;
+        struct hacoo_block *block = ws->block[tid];
+        unsigned int *idx[h->ndims];
 
-                // Initialize rank vector with cur->value
-                for (int f = 0; f < fmax; f++) {
-                    rank_vec[f] = cur->value;
-                }
+        for (int d = 0; d < h->ndims; d++) {
+            idx[d] = &ws->idx_buf[tid][d * HACOO_BLOCK];
+        }
 
-                // Multiply by the appropriate row from each factor matrix, skipping mode n
-                for (int d = 0; d < h->ndims; d++) {
-                    if (d == n) continue;
-                    double *vec_d = u[d]->vals[idx[d]];
-                    for (int f = 0; f < fmax; f++) {
-                        rank_vec[f] *= vec_d[f];
+        // Walk the assigned nonzeros a block at a time
+        double t_busy = omp_get_wtime();
+        for (size_t p = work_first(&work); p < work.nparts; p = work_next(&work, p)) {
+            work_cursor(h, &work, &cursor, p);
+            while (hacoo_next_block(h, &cursor, block)) {
+                // Get full index arrays for the block from compressed HaCOO format
+                hacoo_block_indices(h, block, idx);
+                kernel(h, uf, n, fmax, idx, block->value, block->count, local_res);
+                nnz += block->count;
+                if (touched) {
+                    for (size_t k = 0; k < block->count; k++) {
+                        touched[idx[n][k]] = 1;
                     }
                 }
-
-                // Accumulate into the local result row using daxpy
-                cblas_daxpy(fmax, 1.0, rank_vec, 1, local_res->vals[idx[n]], 1);
             }
         }
-
-        free(rank_vec); // Free thread-local buffer
-        free(idx);
+        busy_record(omp_get_wtime() - t_busy, nnz);
     }
+    free(work.first);
 
-    /* Time merge step */
-    double t_start = omp_get_wtime();
+    // Merge the partials into the result, each thread taking a range of rows
+    #pragma omp parallel for schedule(static) num_threads(ws->nthreads)
+    for (unsigned int i = 0; i < h->dims[n]; i++) {
+        double *out = res->vals[i];
 
-    // Merge all thread-local results into the global result
-    /* Hybrid */
-    /*#pragma omp parallel for
-    for (int i = 0; i < h->dims[n]; i++) {
-        for (int f = 0; f < fmax; f++) {
-            double sum = 0.0;
-            for (int t = 0; t < num_threads; t++) {
-                sum += partials[t]->vals[i][f];
+        for (int t = 1; t < ws->nthreads; t++) {
+            if (!ws->touched[t][i]) {
+                continue;
+            }
+            double *row = ws->partials[t]->vals[i];
+            for (unsigned int f = 0; f < fmax; f++) {
+                out[f] += row[f];
+                row[f] = 0.0;
             }
-            res->vals[i][f] = sum;
+            ws->touched[t][i] = 0;
         }
-    }*/
+    }
+
+    return 0;
+}
+
+/* Threads walk their share of the nonzeros as in mttkrp_privatized and
+ * add into the one result with atomic updates */
+static void mttkrp_atomic(struct hacoo_tensor *h, matrix_t **u,
+                          unsigned int n, struct mttkrp_ws *ws, matrix_t *res)
+{
+    unsigned int fmax = ws->rank;
+    struct mttkrp_work work;
+
+    mttkrp_prepare(h);
+    work_init(h, &work);
+    busy_reset();
 
-    /* Parallel over threads */
-    #pragma omp parallel
+    #pragma omp parallel num_threads(ws->nthreads)
     {
         int tid = omp_get_thread_num();
-        int chunk = (h->dims[n] + num_threads - 1) / num_threads;
-        int start = tid * chunk;
-        int end = (start + chunk > h->dims[n]) ? h->dims[n] : start + chunk;
-
-        for (int i = start; i < end; i++) {
-            for (int f = 0; f < fmax; f++) {
-                for (int t = 0; t < num_threads; t++) {
-                    res->vals[i][f] += partials[t]->vals[i][f];
+        struct hacoo_cursor cursor;
+        struct hacoo_block *block = ws->block[tid];
+        unsigned int *idx[h->ndims];
+        double *rank_vec = ws->scratch[tid];
+        matrix_t **uf = thread_factors(ws, u, tid);
+        size_t nnz = 0;
+
+        for (int d = 0; d < h->ndims; d++) {
+            idx[d] = &ws->idx_buf[tid][d * HACOO_BLOCK];
+        }
+
+        double t_busy = omp_get_wtime();
+        for (size_t p = work_first(&work); p < work.nparts; p = work_next(&work, p)) {
+            work_cursor(h, &work, &cursor, p);
+            while (hacoo_next_block(h, &cursor, block)) {
+                hacoo_block_indices(h, block, idx);
+
+                for (size_t k = 0; k < block->count; k++) {
+                    mttkrp_nonzero_atomic(h, uf, n, fmax, idx, k, block->value[k],
+                                          rank_vec, res);
                 }
+                nnz += block->count;
             }
         }
+        busy_record(omp_get_wtime() - t_busy, nnz);
     }
 
-    /*for collapse ver */
-    /*pragma omp parallel for collapse(2)
-    for (int i = 0; i < h->dims[n]; i++) {
-        for (int f = 0; f < fmax; f++) {
-            for (int t = 0; t < num_threads; t++) {
-                res->vals[i][f] += partials[t]->vals[i][f];
+    free(work.first);
+}
+
+/* Hand out the nparts row ranges of a row partition one at a time. The
+ * thread holding a range is the only one writing its rows. Returns -1 if
+ * the partition cannot be built. */
+static int owner_run(struct hacoo_tensor *h, matrix_t **u, unsigned int n,
+                     unsigned int nparts, struct mttkrp_ws *ws, matrix_t *res)
+{
+    unsigned int fmax = ws->rank;
+    struct hacoo_rowpart *rp = hacoo_rowpart(h, n, nparts);
+
+    if (!rp) {
+        return -1;
+    }
+
+    mttkrp_kernel_fn kernel = pick_kernel(h, fmax);
+
+    busy_reset();
+
+    #pragma omp parallel num_threads(ws->nthreads)
+    {
+        int tid = omp_get_thread_num();
+        struct hacoo_block *block = ws->block[tid];
+        unsigned int *idx[h->ndims];
+        matrix_t **uf = thread_factors(ws, u, tid);
+        size_t nnz = 0;
+
+        for (int d = 0; d < h->ndims; d++) {
+            idx[d] = &ws->idx_buf[tid][d * HACOO_BLOCK];
+        }
+
+        double t_busy = omp_get_wtime();
+        #pragma omp for schedule(dynamic, 1) nowait
+        for (unsigned int p = 0; p < rp->nparts; p++) {
+            for (size_t z = rp->start[p]; z < rp->start[p + 1]; z += block->count) {
+                block->count = rp->start[p + 1] - z < HACOO_BLOCK ?
+                               rp->start[p + 1] - z : HACOO_BLOCK;
+                block->morton = &rp->morton[z];
+                block->morton_hi = rp->morton_hi ? &rp->morton_hi[z] : NULL;
+                block->value = &rp->value[z];
+                hacoo_block_indices(h, block, idx);
+                kernel(h, uf, n, fmax, idx, block->value, block->count, res);
             }
+            nnz += rp->start[p + 1] - rp->start[p];
         }
-    }*/
+        busy_record(omp_get_wtime() - t_busy, nnz);
+    }
+
+    return 0;
+}
 
-    double t_end = omp_get_wtime();
-    printf("Merge time: %.6f seconds\n", t_end - t_start);
+/* MTTKRP over the fiber index rooted at mode n. Every root node is a
+ * different output row, so threads take whole rows and write the result
+ * directly. Returns -1 if the index cannot be built. */
+static int csf_run(struct hacoo_tensor *h, matrix_t **u, unsigned int n,
+                   struct mttkrp_ws *ws, matrix_t *res)
+{
+    unsigned int fmax = ws->rank;
+    struct hacoo_csf *csf = hacoo_csf(h, n);
 
-    for (int t = 0; t < num_threads; t++) {
-        free_matrix(partials[t]);
+    if (!csf) {
+        return -1;
     }
 
-    free(partials);
+    // A one-mode tensor is its own result
+    if (csf->nlevels == 1) {
+        for (size_t z = 0; z < csf->nfibers[0]; z++) {
+            for (unsigned int r = 0; r < fmax; r++) {
+                res->vals[csf->fids[0][z]][r] = csf->value[z];
+            }
+        }
+        return 0;
+    }
 
-    return res;
+    busy_reset();
+
+    #pragma omp parallel num_threads(ws->nthreads)
+    {
+        int tid = omp_get_thread_num();
+        double *acc[csf->nlevels];
+        matrix_t **uf = thread_factors(ws, u, tid);
+        size_t nnz = 0;
+
+        // The thread's scratch holds a rank vector per level
+        for (unsigned int l = 0; l < csf->nlevels; l++) {
+            acc[l] = &ws->scratch[tid][l * fmax];
+        }
+
+        // Rows differ a lot in size, so hand them out a few at a time
+        double t_busy = omp_get_wtime();
+        #pragma omp for schedule(dynamic, 16) nowait
+        for (size_t f = 0; f < csf->nfibers[0]; f++) {
+            csf_subtree(csf, uf, fmax, 0, f, acc);
+            double *out = res->vals[csf->fids[0][f]];
+
+            // The row's nonzeros are the leaves under its root
+            size_t lo = f, hi = f + 1;
+            for (unsigned int l = 0; l + 1 < csf->nlevels; l++) {
+                lo = csf->fptr[l][lo];
+                hi = csf->fptr[l][hi];
+            }
+            nnz += hi - lo;
+            for (unsigned int r = 0; r < fmax; r++) {
+                out[r] = acc[0][r];
+            }
+        }
+        busy_record(omp_get_wtime() - t_busy, nnz);
+    }
+
+    return 0;
+}
+
+/* Whether the fused pass should give mode n per-thread partials. Modes the
+ * strategy would privatize are privatized; ones it would tile can't be
+ * tiled by a pass over every mode, so they are privatized too while the
+ * partials fit under PRIVATE_MAX_BYTES. */
+static int fused_privatize(struct hacoo_tensor *h, unsigned int n,
+                           unsigned int rank, int nthreads)
+{
+    enum mttkrp_strategy s = current_strategy;
+
+    if (s == MTTKRP_AUTO) {
+        s = mttkrp_choose_strategy(h, n, rank, nthreads);
+    }
+    return s == MTTKRP_PRIVATIZE ||
+           (s == MTTKRP_TILED && (double)nthreads * h->dims[n] * rank *
+                                 sizeof(double) <= PRIVATE_MAX_BYTES);
+}
+
+/* Kernel of the selected set for rank fmax. The SIMD kernels take at
+ * least one factor row, so one-mode tensors use the scalar kernel. */
+static mttkrp_kernel_fn pick_kernel(struct hacoo_tensor *h, unsigned int fmax)
+{
+    if (h->ndims < 2) {
+        return kernel_scalar;
+    }
+
+    switch (mttkrp_get_kernel()) {
+    case MTTKRP_KERNEL_AVX512:
+        switch (fmax) {
+        case 8: return kernel_avx512_8;
+        case 16: return kernel_avx512_16;
+        case 32: return kernel_avx512_32;
+        case 64: return kernel_avx512_64;
+        default: return kernel_avx512_any;
+        }
+    case MTTKRP_KERNEL_AVX2:
+        switch (fmax) {
+        case 8: return kernel_avx2_8;
+        case 16: return kernel_avx2_16;
+        case 32: return kernel_avx2_32;
+        case 64: return kernel_avx2_64;
+        default: return kernel_avx2_any;
+        }
+    default:
+        return kernel_scalar;
+    }
+}
+
+/* Fused kernel of the selected set */
+static fused_kernel_fn pick_fused_kernel(struct hacoo_tensor *h, unsigned int fmax)
+{
+    if (h->ndims < 2) {
+        return fused_scalar;
+    }
+
+    switch (mttkrp_get_kernel()) {
+    case MTTKRP_KERNEL_AVX512:
+        switch (fmax) {
+        case 8: return fused_avx512_8;
+        case 16: return fused_avx512_16;
+        case 32: return fused_avx512_32;
+        case 64: return fused_avx512_64;
+        default: return fused_avx512;
+        }
+    case MTTKRP_KERNEL_AVX2:
+        return fused_avx2;
+    default:
+        return fused_scalar;
+    }
+}
+
+static enum mttkrp_kernel best_kernel(void)
+{
+    if (have_avx512()) {
+        return MTTKRP_KERNEL_AVX512;
+    }
+    if (have_avx2_fma()) {
+        return MTTKRP_KERNEL_AVX2;
+    }
+    return MTTKRP_KERNEL_SCALAR;
+}
+
+static int have_avx2_fma(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    return 0;
+#endif
+}
+
+static int have_avx512(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx512f");
+#else
+    return 0;
+#endif
+}
+
+/* Compute column f of the product for nonzero k of a decoded block */
+static int serial_nonzero(struct hacoo_tensor *h, matrix_t **u, unsigned int n,
+                          unsigned int f, unsigned int **idx, size_t k,
+                          double value, double *t, unsigned int *tind)
+{
+    *t = value;
+    *tind = idx[n][k];
+
+    for (int d = 0; d < h->ndims; d++) {
+        if (d == n) continue;
+
+        if (idx[d][k] >= u[d]->rows) {
+            fprintf(stderr, "Error: idx[%d] out of bounds for u[%d] (rows = %d).\n",
+                    d, d, u[d]->rows);
+            return -1;
+        }
+
+        *t *= u[d]->vals[idx[d][k]][f];
+    }
+
+    return 0;
 }
 
 matrix_t *mttkrp_serial(struct hacoo_tensor *h, matrix_t **u, unsigned int n)
@@ -147,50 +1865,40 @@ matrix_t *mttkrp_serial(struct hacoo_tensor *h, matrix_t **u, unsigned int n)
     unsigned int fmax = u[0]->cols;
     matrix_t *res = new_matrix(h->dims[n], fmax);
 
-    unsigned int *idx = malloc(sizeof(unsigned int) * h->ndims);
+    mttkrp_prepare(h);
+
+    struct hacoo_cursor cursor;
+    struct hacoo_block *block = malloc(sizeof(struct hacoo_block));
+    unsigned int *idx_buf = malloc(h->ndims * HACOO_BLOCK * sizeof(unsigned int));
+    unsigned int **idx = malloc(h->ndims * sizeof(unsigned int *));
     unsigned int *tind = malloc(sizeof(unsigned int) * h->nnz);
     double *t = malloc(sizeof(double) * h->nnz);
 
-    if (tind == NULL || t == NULL) {
+    if (!block || !idx_buf || !idx || tind == NULL || t == NULL) {
         fprintf(stderr, "Error: Memory allocation failed.\n");
         return NULL;
     }
 
+    for (int d = 0; d < h->ndims; d++) {
+        idx[d] = &idx_buf[d * HACOO_BLOCK];
+    }
+
     for (int f = 0; f < fmax; f++) {
         int z = 0; // tracks the current nonzero
 
-        for (int m = 0; m < h->nbuckets; m++) {
-            bucket_vector *vec = &h->buckets[m];
-            if (vec->size == 0) continue;
-
-            for (size_t j = 0; j < vec->size; j++) {
-                struct hacoo_bucket *cur = &vec->data[j];
-
-                hacoo_extract_index(cur, h->ndims, idx);
-
-                if (cur == NULL) {
-                    fprintf(stderr, "Error: cur is NULL.\n");
-                    return NULL;
-                }
+        mttkrp_cursor_init(h, &cursor, 0, 1);
+        while (hacoo_next_block(h, &cursor, block)) {
+            hacoo_block_indices(h, block, idx);
 
+            for (size_t k = 0; k < block->count; k++) {
                 if (z >= h->nnz) {
                     fprintf(stderr, "Error: z exceeds nnz.\n");
                     return NULL;
                 }
 
-                t[z] = cur->value;
-                tind[z] = idx[n];
-
-                for (int d = 0; d < h->ndims; d++) {
-                    if (d == n) continue;
-
-                    if (idx[d] >= u[d]->rows) {
-                        fprintf(stderr, "Error: idx[%d] out of bounds for u[%d] (rows = %d).\n",
-                                d, d, u[d]->rows);
-                        return NULL;
-                    }
-
-                    t[z] *= u[d]->vals[idx[d]][f];
+                if (serial_nonzero(h, u, n, f, idx, k, block->value[k],
+                                   &t[z], &tind[z])) {
+                    return NULL;
                 }
 
                 z++;
@@ -209,6 +1917,8 @@ matrix_t *mttkrp_serial(struct hacoo_tensor *h, matrix_t **u, unsigned int n)
         }
     }
 
+    free(block);
+    free(idx_buf);
     free(idx);
     free(tind);
     free(t);
@@ -4,9 +4,160 @@
 #include "hacoo.h"
 #include "matrix.h"
 
+/* How the parallel MTTKRP keeps threads from updating a row at once:
+ *   MTTKRP_PRIVATIZE - every thread adds into its own copy of the result,
+ *                      and the copies are summed
+ *   MTTKRP_TILED     - threads take row tiles of a row partition (see
+ *                      hacoo_rowpart) and are the only writers of their rows
+ *   MTTKRP_ATOMIC    - threads add into the result with atomic updates
+ * MTTKRP_AUTO picks one per mode with mttkrp_choose_strategy. */
+enum mttkrp_strategy {
+    MTTKRP_AUTO = 0,
+    MTTKRP_PRIVATIZE,
+    MTTKRP_TILED,
+    MTTKRP_ATOMIC
+};
+
+/* Kernels that add blocks of nonzeros into the result in the privatized
+ * and tiled strategies. The SIMD sets have kernels unrolled for ranks 8,
+ * 16, 32 and 64 that keep each nonzero's product in registers and fuse the
+ * last multiply into the update, and a kernel for any other rank.
+ * MTTKRP_KERNEL_AUTO takes the widest set the CPU supports. */
+enum mttkrp_kernel {
+    MTTKRP_KERNEL_AUTO = 0,
+    MTTKRP_KERNEL_SCALAR,
+    MTTKRP_KERNEL_AVX2,   /* AVX2 and FMA */
+    MTTKRP_KERNEL_AVX512  /* AVX-512F */
+};
+
+/* How the privatized and atomic strategies split the nonzeros:
+ *   MTTKRP_SCHEDULE_BALANCED - one range of buckets per thread, cut from a
+ *                              prefix sum of the bucket sizes so every
+ *                              thread gets about the same nonzeros
+ *   MTTKRP_SCHEDULE_DYNAMIC  - CHUNKS_PER_THREAD times as many balanced
+ *                              ranges, each taken by the next free thread
+ *   MTTKRP_SCHEDULE_STATIC   - the same number of buckets per thread
+ * A Z-order stream is always split by nonzero count. */
+enum mttkrp_schedule {
+    MTTKRP_SCHEDULE_BALANCED = 0,
+    MTTKRP_SCHEDULE_DYNAMIC,
+    MTTKRP_SCHEDULE_STATIC
+};
+
+/* Where the factor matrices live on machines with several NUMA nodes:
+ *   MTTKRP_NUMA_OFF        - wherever the caller put them
+ *   MTTKRP_NUMA_INTERLEAVE - pages spread round-robin over the nodes
+ *   MTTKRP_NUMA_REPLICATE  - a copy on every node the threads run on,
+ *                            refreshed at the start of each run
+ * Per-thread buffers and partials are first touched by the thread that
+ * uses them in every mode. */
+enum mttkrp_numa {
+    MTTKRP_NUMA_OFF = 0,
+    MTTKRP_NUMA_INTERLEAVE,
+    MTTKRP_NUMA_REPLICATE
+};
+
 /* Perform MTTKRP on sparse HaCOO tensor t */
 matrix_t *mttkrp(struct hacoo_tensor *t, matrix_t **u, unsigned int n);
 
+/* MTTKRP along every mode of t in one pass over the nonzeros, each
+ * decoded once and its factor rows shared between the modes through
+ * prefix and suffix products. Sets out[n] to the result of mode n, as
+ * mttkrp(t, u, n). Returns -1 with every out[n] NULL if a buffer cannot be
+ * made, 0 otherwise. */
+int mttkrp_all_modes(struct hacoo_tensor *t, matrix_t **u, matrix_t **out);
+
+/* Buffers of the parallel MTTKRP kept from one call to the next, for loops
+ * such as CPD's that run it over and over on one tensor at one rank.
+ * Results are kept per mode and the per-thread partials are sized for the
+ * longest mode, so nothing is allocated or faulted in after the first run
+ * of each mode. */
+struct mttkrp_ws {
+    struct hacoo_tensor *t;
+    unsigned int rank;
+    int nthreads; //threads every run uses
+    unsigned int rows; //rows of each partial
+    matrix_t **res; //result of each mode, NULL until its first run
+    matrix_t **partials; //partial of each thread but the first, NULL
+                         //until the first privatized run
+    unsigned char **touched; //rows written to each partial since its merge
+    struct hacoo_block **block; //block buffer of each thread
+    unsigned int **idx_buf; //decoded indices of each thread's block
+    double **scratch; //ndims rank vectors per thread
+    unsigned int nnodes; //NUMA nodes of the machine
+    int *thread_node; //node each thread ran on at the last placement
+    matrix_t ***replica; //factors copied to each node, NULL until the
+                         //first replicated run with threads on the node
+    double **placed; //factor data last interleaved for each mode
+    int unreplicated; //replicas could not be made, interleave instead
+};
+
+/* Workspace for MTTKRP of t at the given rank on nthreads threads. Returns
+ * NULL on allocation failure. */
+struct mttkrp_ws *mttkrp_ws_alloc(struct hacoo_tensor *t, unsigned int rank,
+                                  int nthreads);
+void mttkrp_ws_free(struct mttkrp_ws *ws);
+
+/* MTTKRP of the workspace's tensor along mode n, as mttkrp. The result
+ * belongs to the workspace and is overwritten by the next run of the same
+ * mode. Returns NULL if u has the wrong rank or a buffer cannot be made. */
+matrix_t *mttkrp_ws_run(struct mttkrp_ws *ws, matrix_t **u, unsigned int n);
+
+/* MTTKRP over the fiber index rooted at mode n (see hacoo_csf), built on
+ * first use. Threads own whole output rows. Returns NULL if the index
+ * cannot be built. */
+matrix_t *mttkrp_csf(struct hacoo_tensor *t, matrix_t **u, unsigned int n);
+
+/* MTTKRP with the nonzeros partitioned by output row range (see
+ * hacoo_rowpart), one range per thread. No per-thread results are needed.
+ * Returns NULL if the partition cannot be built. */
+matrix_t *mttkrp_owner(struct hacoo_tensor *t, matrix_t **u, unsigned int n);
+
+/* Strategy for mode n of t at the given rank and thread count, from the
+ * size of the partials against the work and the nonzeros per row */
+enum mttkrp_strategy mttkrp_choose_strategy(struct hacoo_tensor *t,
+                                            unsigned int n, unsigned int rank,
+                                            int nthreads);
+
+/* Force a strategy for every mode, MTTKRP_AUTO to choose per mode again.
+ * Returns -1 for an unknown strategy. */
+int mttkrp_set_strategy(enum mttkrp_strategy s);
+enum mttkrp_strategy mttkrp_get_strategy(void);
+const char *mttkrp_strategy_name(enum mttkrp_strategy s);
+
+/* Select a kernel set. Returns -1 if the CPU does not support it. */
+int mttkrp_set_kernel(enum mttkrp_kernel k);
+
+/* Kernel set in use, never MTTKRP_KERNEL_AUTO */
+enum mttkrp_kernel mttkrp_get_kernel(void);
+const char *mttkrp_kernel_name(enum mttkrp_kernel k);
+
+/* Whether the kernel set in use has a kernel unrolled for rank */
+int mttkrp_kernel_specialized(unsigned int rank);
+
+/* Select a schedule. Returns -1 for an unknown schedule. */
+int mttkrp_set_schedule(enum mttkrp_schedule s);
+enum mttkrp_schedule mttkrp_get_schedule(void);
+const char *mttkrp_schedule_name(enum mttkrp_schedule s);
+
+/* Seconds each thread of the last parallel MTTKRP spent on its nonzeros,
+ * not counting the merge of partials. Returns the number of threads and
+ * points *busy at their times, which the next MTTKRP overwrites. */
+int mttkrp_busy_times(const double **busy);
+
+/* Select a factor placement. Returns -1 for an unknown placement. */
+int mttkrp_set_numa(enum mttkrp_numa m);
+enum mttkrp_numa mttkrp_get_numa(void);
+const char *mttkrp_numa_name(enum mttkrp_numa m);
+
+/* Number of NUMA nodes of the machine, 1 where it cannot be found */
+unsigned int mttkrp_numa_nodes(void);
+
+/* Nonzeros each thread of the last parallel MTTKRP walked and the node it
+ * ran on, in the order of mttkrp_busy_times. Returns the number of
+ * threads. */
+int mttkrp_thread_work(const size_t **nnz, const int **node);
+
 /* Serial version of MTTKRP */
 matrix_t *mttkrp_serial(struct hacoo_tensor *h, matrix_t **u, unsigned int n);
 
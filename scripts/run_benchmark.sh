@@ -5,12 +5,14 @@ tensor_file="$HOME/haccoo-c/tensors/${tensor}.tns"
 binary="$HOME/haccoo-c/hacoo_mttkrp"
 rank=16
 num_iterations=5
+schedule="balanced"  # balanced, dynamic or static
 
 # Create timestamped log directory
 timestamp=$(date +%Y%m%d_%H%M%S)
 log_dir="$HOME/haccoo-c/benchmarking_logs/${tensor}_r${rank}_$timestamp"
 mkdir -p "$log_dir"
 results_file="$log_dir/results_${tensor}_r${rank}_$timestamp.tsv"
+imbalance_file="$log_dir/imbalance_${tensor}_r${rank}_$timestamp.tsv"
 
 echo -e "Tensor: $tensor\n"
 echo "Saving raw logs to $log_dir"
@@ -35,6 +37,13 @@ num_modes=${#temp_modes[@]}
   done
   echo -e "$header"
 } > "$results_file"
+{
+  echo "# Tensor: $tensor"
+  echo "# Rank: $rank"
+  echo "# Schedule: $schedule"
+  echo "# Slowest thread's busy time over the mean, per mode"
+  echo -e "$header"
+} > "$imbalance_file"
 
 # SERIAL TEST
 echo "Running serial MTTKRP..."
@@ -80,7 +89,7 @@ for threads in 1 2 4 8 16 32 64 128; do
 
     for ((i=1; i<=num_iterations; i++)); do
         log_file="$log_dir/parallel_t${threads}_iter${i}.txt"
-        cmd="$binary -i \"$tensor_file\" -b -a -1 -r $rank -t $threads"
+        cmd="$binary -i \"$tensor_file\" -b -a -1 -r $rank -t $threads -P $schedule"
         echo "Running: $cmd"
         eval $cmd > "$log_file" 2>&1
         output=$(awk '/Mode [0-9]+ MTTKRP Time:/ { print $(NF-1) }' "$log_file")
@@ -93,6 +102,14 @@ for threads in 1 2 4 8 16 32 64 128; do
             parallel_totals[$j]=$(echo "${parallel_totals[$j]} + $val" | bc)
         done
         echo >> "$results_file"
+
+        output=$(awk '/Mode [0-9]+ imbalance/ { print $NF }' "$log_file")
+        readarray -t imbalance <<< "$output"
+        printf "%d\titeration %d" "$threads" "$i" >> "$imbalance_file"
+        for ((j=0; j<num_modes; j++)); do
+            printf "\t%s" "${imbalance[j]}" >> "$imbalance_file"
+        done
+        echo >> "$imbalance_file"
     done
 
     printf "%d\taverage" "$threads" >> "$results_file"
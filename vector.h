@@ -7,7 +7,104 @@
 
 #define VECTOR_INIT_CAPACITY 4
 
-// Define a vector for a specific type
+/* Arena for vector storage. Blocks come in power of two size classes and
+ * are carved out of large slabs. A block released by a growing vector goes
+ * on the free list of its class, and vector_arena_clear() returns every
+ * slab at once, so vectors living in an arena never need freeing one by
+ * one. An arena is not thread safe. */
+#define VECTOR_ARENA_MIN 32            /* bytes in the smallest block */
+#define VECTOR_ARENA_CLASSES 48
+#define VECTOR_SLAB_SIZE (256 * 1024)  /* bytes in a shared slab */
+
+struct vector_slab {
+    struct vector_slab *next;
+    size_t pad;                        /* keeps blocks 16 byte aligned */
+};
+
+struct vector_arena {
+    struct vector_slab *slabs;
+    char *next;                        /* unused part of the newest slab */
+    char *end;
+    void *free[VECTOR_ARENA_CLASSES];  /* released blocks of each class */
+    size_t nslabs;
+};
+
+static inline void vector_arena_init(struct vector_arena *a) {
+    memset(a, 0, sizeof(*a));
+}
+
+/* Free every slab, invalidating all vectors stored in the arena */
+static inline void vector_arena_clear(struct vector_arena *a) {
+    while (a->slabs) {
+        struct vector_slab *s = a->slabs;
+        a->slabs = s->next;
+        free(s);
+    }
+    vector_arena_init(a);
+}
+
+static inline unsigned int vector_arena_class(size_t bytes) {
+    unsigned int c = 0;
+    while (((size_t)VECTOR_ARENA_MIN << c) < bytes) {
+        c++;
+    }
+    return c;
+}
+
+/* Get a block of at least bytes, its full size is stored in *got */
+static inline void *vector_arena_alloc(struct vector_arena *a, size_t bytes,
+                                       size_t *got) {
+    unsigned int c = vector_arena_class(bytes);
+    size_t size = (size_t)VECTOR_ARENA_MIN << c;
+    char *block;
+
+    if (c >= VECTOR_ARENA_CLASSES) {
+        return NULL;
+    }
+    *got = size;
+
+    if (a->free[c]) {
+        block = a->free[c];
+        a->free[c] = *(void **)block;
+        return block;
+    }
+
+    if ((size_t)(a->end - a->next) < size) {
+        // Blocks too big to share a slab get one of their own
+        size_t slab = size > VECTOR_SLAB_SIZE / 4 ? size : VECTOR_SLAB_SIZE;
+        struct vector_slab *s = malloc(sizeof(struct vector_slab) + slab);
+        if (!s) {
+            return NULL;
+        }
+        s->next = a->slabs;
+        a->slabs = s;
+        a->nslabs++;
+        block = (char *)(s + 1);
+        if (slab == size) {
+            return block;
+        }
+        a->next = block;
+        a->end = block + slab;
+    }
+
+    block = a->next;
+    a->next += size;
+    return block;
+}
+
+/* Hand a block of bytes (as requested or as reported by the alloc) back
+ * for reuse */
+static inline void vector_arena_release(struct vector_arena *a, void *block,
+                                        size_t bytes) {
+    if (block) {
+        unsigned int c = vector_arena_class(bytes);
+        *(void **)block = a->free[c];
+        a->free[c] = block;
+    }
+}
+
+// Define a vector for a specific type. The _in functions take an arena
+// to keep the elements in, or NULL for plain malloc storage.
 #define DEFINE_VECTOR_TYPE(TYPE, NAME)                                          \
 typedef struct {                                                                \
     TYPE *data;                                                                 \
@@ -25,7 +122,7 @@ static inline NAME NAME##_create() {
                                                                                 \
 static inline void NAME##_push_back(NAME *vec, TYPE value) {                    \
     if (vec->size == vec->capacity) {                                           \
-        vec->capacity *= 2;                                                     \
+        vec->capacity = vec->capacity ? vec->capacity * 2 : VECTOR_INIT_CAPACITY; \
         vec->data = realloc(vec->data, vec->capacity * sizeof(TYPE));          \
         assert(vec->data != NULL);                                              \
     }                                                                           \
@@ -37,9 +134,84 @@ static inline TYPE NAME##_get(NAME *vec, size_t index) {
     return vec->data[index];                                                    \
 }                                                                               \
                                                                                 \
+static inline void NAME##_erase(NAME *vec, size_t index) {                     \
+    assert(index < vec->size);                                                  \
+    memmove(&vec->data[index], &vec->data[index + 1],                           \
+            (vec->size - index - 1) * sizeof(TYPE));                            \
+    vec->size--;                                                                \
+}                                                                               \
+                                                                                \
 static inline void NAME##_free(NAME *vec) {                                     \
     free(vec->data);                                                            \
     vec->data = NULL;                                                           \
     vec->size = vec->capacity = 0;                                              \
+}                                                                               \
+                                                                                \
+/* Give back unused capacity of a malloc vector */                              \
+static inline void NAME##_shrink_to_fit(NAME *vec) {                            \
+    if (vec->size == vec->capacity) {                                           \
+        return;                                                                 \
+    }                                                                           \
+    if (vec->size == 0) {                                                       \
+        NAME##_free(vec);                                                       \
+        return;                                                                 \
+    }                                                                           \
+    TYPE *data = realloc(vec->data, vec->size * sizeof(TYPE));                  \
+    if (data) {                                                                 \
+        vec->data = data;                                                       \
+        vec->capacity = vec->size;                                              \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+/* Make room for at least n elements, returns -1 if allocation fails */         \
+static inline int NAME##_reserve_in(NAME *vec, size_t n,                        \
+                                    struct vector_arena *a) {                   \
+    if (n <= vec->capacity) {                                                   \
+        return 0;                                                               \
+    }                                                                           \
+    if (n < VECTOR_INIT_CAPACITY) {                                             \
+        n = VECTOR_INIT_CAPACITY;                                               \
+    }                                                                           \
+    if (!a) {                                                                   \
+        TYPE *data = realloc(vec->data, n * sizeof(TYPE));                      \
+        if (!data) {                                                            \
+            return -1;                                                          \
+        }                                                                       \
+        vec->data = data;                                                       \
+        vec->capacity = n;                                                      \
+        return 0;                                                               \
+    }                                                                           \
+    size_t got;                                                                 \
+    TYPE *data = vector_arena_alloc(a, n * sizeof(TYPE), &got);                 \
+    if (!data) {                                                                \
+        return -1;                                                              \
+    }                                                                           \
+    if (vec->size) {                                                            \
+        memcpy(data, vec->data, vec->size * sizeof(TYPE));                      \
+    }                                                                           \
+    vector_arena_release(a, vec->data, vec->capacity * sizeof(TYPE));           \
+    vec->data = data;                                                           \
+    vec->capacity = got / sizeof(TYPE);                                         \
+    return 0;                                                                   \
+}                                                                               \
+                                                                                \
+static inline void NAME##_push_back_in(NAME *vec, TYPE value,                   \
+                                       struct vector_arena *a) {                \
+    if (vec->size == vec->capacity) {                                           \
+        int err = NAME##_reserve_in(vec, vec->capacity * 2 + !vec->capacity, a); \
+        assert(err == 0);                                                       \
+        (void)err;                                                              \
+    }                                                                           \
+    vec->data[vec->size++] = value;                                             \
+}                                                                               \
+                                                                                \
+static inline void NAME##_free_in(NAME *vec, struct vector_arena *a) {          \
+    if (a) {                                                                    \
+        vector_arena_release(a, vec->data, vec->capacity * sizeof(TYPE));       \
+        vec->data = NULL;                                                       \
+        vec->size = vec->capacity = 0;                                          \
+    } else {                                                                    \
+        NAME##_free(vec);                                                       \
+    }                                                                           \
 }
 #endif // VECTOR_H
@@ -0,0 +1,224 @@
+/* File: window.c
+ * Purpose: Sliding time-window tensors, one hacoo tensor per epoch.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "window.h"
+#include "mttkrp.h"
+
+/* Helper Function Prototypes */
+static void window_drop(struct hacoo_window *w, long long epoch);
+static matrix_t *window_mttkrp(void *data, matrix_t **u, unsigned int n);
+
+struct hacoo_window *hacoo_window_alloc(unsigned int ndims, unsigned int *dims,
+                                        unsigned int time_mode,
+                                        unsigned int epoch_len,
+                                        unsigned int nepochs,
+                                        unsigned int flags)
+{
+  struct hacoo_window *w = calloc(1, sizeof(struct hacoo_window));
+
+  if (w == NULL) {
+    goto error;
+  }
+
+  if (time_mode >= ndims || epoch_len == 0 || nepochs == 0 ||
+      (unsigned long long)epoch_len * nepochs > 0xffffffffULL) {
+    fprintf(stderr, "Error: Invalid time mode or window size.\n");
+    goto error;
+  }
+
+  w->ndims = ndims;
+  w->time_mode = time_mode;
+  w->epoch_len = epoch_len;
+  w->nepochs = nepochs;
+  w->flags = flags | HACOO_ARENA;
+  w->newest = -1;
+
+  w->dims = malloc(ndims * sizeof(unsigned int));
+  w->segments = calloc(nepochs, sizeof(struct hacoo_tensor *));
+  if (!w->dims || !w->segments) {
+    goto error;
+  }
+  memcpy(w->dims, dims, ndims * sizeof(unsigned int));
+  w->dims[time_mode] = epoch_len * nepochs;
+
+  return w;
+
+error:
+  if (w) {
+    hacoo_window_free(w);
+  }
+  return NULL;
+}
+
+void hacoo_window_free(struct hacoo_window *w)
+{
+  if (w->segments) {
+    for (unsigned int i = 0; i < w->nepochs; i++) {
+      if (w->segments[i]) {
+        hacoo_free(w->segments[i]);
+      }
+    }
+  }
+  free(w->segments);
+  free(w->dims);
+  free(w);
+}
+
+void hacoo_window_advance(struct hacoo_window *w, long long epoch)
+{
+  if (epoch <= w->newest) {
+    return;
+  }
+
+  // Only the epochs that were live can hold a segment
+  long long first = w->newest - w->nepochs + 1;
+  long long last = epoch - w->nepochs;
+  if (last > w->newest) {
+    last = w->newest;
+  }
+  for (long long e = first < 0 ? 0 : first; e <= last; e++) {
+    window_drop(w, e);
+  }
+  w->newest = epoch;
+}
+
+int hacoo_window_accumulate(struct hacoo_window *w, unsigned int *index,
+                            double value, hacoo_combiner combine)
+{
+  unsigned int time = index[w->time_mode];
+  long long epoch = time / w->epoch_len;
+
+  if (epoch > w->newest) {
+    hacoo_window_advance(w, epoch);
+  } else if (epoch <= w->newest - w->nepochs) {
+    return -1;
+  }
+
+  struct hacoo_tensor **seg = &w->segments[epoch % w->nepochs];
+  if (!*seg) {
+    *seg = hacoo_alloc_flags(w->ndims, w->dims, 128, 70, w->flags);
+    if (!*seg) {
+      return -1;
+    }
+  }
+
+  // The segment sees time as a row of the window
+  unsigned int local[w->ndims];
+  memcpy(local, index, w->ndims * sizeof(unsigned int));
+  local[w->time_mode] = time % w->dims[w->time_mode];
+  hacoo_accumulate(*seg, local, value, combine);
+  return 0;
+}
+
+int hacoo_window_set(struct hacoo_window *w, unsigned int *index, double value)
+{
+  return hacoo_window_accumulate(w, index, value, NULL);
+}
+
+double hacoo_window_get(struct hacoo_window *w, unsigned int *index)
+{
+  unsigned int time = index[w->time_mode];
+  struct hacoo_tensor *seg = hacoo_window_segment(w, time / w->epoch_len);
+
+  if (!seg) {
+    return 0.0;
+  }
+
+  unsigned int local[w->ndims];
+  memcpy(local, index, w->ndims * sizeof(unsigned int));
+  local[w->time_mode] = time % w->dims[w->time_mode];
+  return hacoo_get(seg, local);
+}
+
+size_t hacoo_window_nnz(struct hacoo_window *w)
+{
+  size_t nnz = 0;
+
+  for (unsigned int i = 0; i < w->nepochs; i++) {
+    if (w->segments[i]) {
+      nnz += w->segments[i]->nnz;
+    }
+  }
+  return nnz;
+}
+
+struct hacoo_tensor *hacoo_window_segment(struct hacoo_window *w,
+                                          long long epoch)
+{
+  if (epoch < 0 || epoch > w->newest || epoch <= w->newest - w->nepochs) {
+    return NULL;
+  }
+  return w->segments[epoch % w->nepochs];
+}
+
+/* Sum of the segment products. Segments share the window's dims, so their
+ * results line up row for row. */
+matrix_t *hacoo_window_mttkrp(struct hacoo_window *w, matrix_t **u,
+                              unsigned int n)
+{
+  unsigned int fmax = u[0]->cols;
+  matrix_t *res = new_matrix(w->dims[n], fmax);
+
+  if (!res) {
+    return NULL;
+  }
+  for (unsigned int i = 0; i < w->nepochs; i++) {
+    if (!w->segments[i] || w->segments[i]->nnz == 0) {
+      continue;
+    }
+
+    matrix_t *part = mttkrp(w->segments[i], u, n);
+    if (!part) {
+      free_matrix(res);
+      return NULL;
+    }
+    for (unsigned int r = 0; r < res->rows; r++) {
+      for (unsigned int f = 0; f < fmax; f++) {
+        res->vals[r][f] += part->vals[r][f];
+      }
+    }
+    free_matrix(part);
+  }
+
+  return res;
+}
+
+double hacoo_window_norm(struct hacoo_window *w)
+{
+  double sum = 0.0;
+
+  for (unsigned int i = 0; i < w->nepochs; i++) {
+    if (w->segments[i]) {
+      double norm = frobenius_norm(w->segments[i]);
+      sum += norm * norm;
+    }
+  }
+  return sqrt(sum);
+}
+
+cpd_result_t *hacoo_window_cpd(struct hacoo_window *w, unsigned int rank,
+                               unsigned int max_iter, double tol)
+{
+  return cpd_generic(w->ndims, w->dims, window_mttkrp, w, rank, max_iter, tol);
+}
+
+/* Helper function implementations. */
+
+/* Free the segment of an expired epoch */
+static void window_drop(struct hacoo_window *w, long long epoch)
+{
+  struct hacoo_tensor **seg = &w->segments[epoch % w->nepochs];
+
+  if (*seg) {
+    hacoo_free(*seg);
+    *seg = NULL;
+  }
+}
+
+static matrix_t *window_mttkrp(void *data, matrix_t **u, unsigned int n)
+{
+  return hacoo_window_mttkrp(data, u, n);
+}
@@ -0,0 +1,68 @@
+/* File: window.h
+ * Purpose: Sliding time-window tensors.
+ *
+ * A window keeps the last nepochs epochs of a tensor with a time mode.
+ * Each epoch covers epoch_len consecutive time coordinates and lives in a
+ * hacoo tensor of its own, so moving the window forward drops an expired
+ * epoch by freeing one tensor.
+ *
+ * Time coordinates are absolute. Inside the window they wrap around, so
+ * mode time_mode has nepochs * epoch_len rows and time t lands in row
+ * t % (nepochs * epoch_len). Each row is used by one live time at a time.
+ */
+#ifndef WINDOW_H
+#define WINDOW_H
+#include "hacoo.h"
+#include "matrix.h"
+#include "cpd.h"
+
+struct hacoo_window {
+  unsigned int ndims;
+  unsigned int *dims;       //dims[time_mode] is the window length
+  unsigned int time_mode;
+  unsigned int epoch_len;   //time coordinates per epoch
+  unsigned int nepochs;     //epochs in the window
+  unsigned int flags;       //storage flags of the segments
+  long long newest;         //newest epoch seen, -1 before the first
+  struct hacoo_tensor **segments; //epoch e in segments[e % nepochs], or NULL
+};
+
+/* Allocate an empty window. dims[time_mode] is ignored. Segments use the
+ * given storage flags, with HACOO_ARENA added so each is freed in one go. */
+struct hacoo_window *hacoo_window_alloc(unsigned int ndims, unsigned int *dims,
+                                        unsigned int time_mode,
+                                        unsigned int epoch_len,
+                                        unsigned int nepochs,
+                                        unsigned int flags);
+void hacoo_window_free(struct hacoo_window *w);
+
+/* Move the window forward so epoch is the newest, dropping the epochs that
+ * fall out of it */
+void hacoo_window_advance(struct hacoo_window *w, long long epoch);
+
+/* Combine value into the entry at index, as hacoo_accumulate. A time in a
+ * newer epoch moves the window forward first. Returns -1 if the time is
+ * older than the window or a segment cannot be allocated, 0 otherwise. */
+int hacoo_window_accumulate(struct hacoo_window *w, unsigned int *index,
+                            double value, hacoo_combiner combine);
+int hacoo_window_set(struct hacoo_window *w, unsigned int *index, double value);
+
+/* Value at index, 0 if absent or outside the window */
+double hacoo_window_get(struct hacoo_window *w, unsigned int *index);
+
+/* Number of nonzeros in the live window */
+size_t hacoo_window_nnz(struct hacoo_window *w);
+
+/* Segment holding epoch, NULL if it is empty or outside the window */
+struct hacoo_tensor *hacoo_window_segment(struct hacoo_window *w,
+                                          long long epoch);
+
+/* MTTKRP, norm and CPD over the live window. The MTTKRP and CPD return
+ * NULL on failure. */
+matrix_t *hacoo_window_mttkrp(struct hacoo_window *w, matrix_t **u,
+                              unsigned int n);
+double hacoo_window_norm(struct hacoo_window *w);
+cpd_result_t *hacoo_window_cpd(struct hacoo_window *w, unsigned int rank,
+                               unsigned int max_iter, double tol);
+
+#endif
@@ -0,0 +1,182 @@
+/* Benchmark for sliding time-window tensors.
+ *
+ * Streams random events with increasing time into a window, then compares
+ * dropping an expired epoch against rebuilding a tensor of the live window
+ * from its events, and MTTKRP over the window against MTTKRP over the
+ * rebuilt tensor.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "window.h"
+#include "mttkrp.h"
+
+#define DEFAULT_COUNT (1 << 21)
+#define MAX_MODES 64
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [--count <events>] [--dims <I,J,T,...>] [--time-mode <mode>] "
+           "[--epochs <total>] [--window <epochs>] [--rank <rank>]\n",
+           program_name);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = DEFAULT_COUNT;
+    unsigned int dims[MAX_MODES] = {183, 24, 1140, 1717};
+    unsigned int ndims = 4;
+    unsigned int time_mode = 2;
+    unsigned int epochs = 64;
+    unsigned int nepochs = 8;
+    unsigned int rank = 16;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+        {
+            count = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--dims") == 0 && i + 1 < argc)
+        {
+            const char *p = argv[++i];
+            for (ndims = 0; *p && ndims < MAX_MODES; ndims++) {
+                char *next;
+                dims[ndims] = strtoul(p, &next, 10);
+                p = *next == ',' ? next + 1 : next;
+            }
+        }
+        else if (strcmp(argv[i], "--time-mode") == 0 && i + 1 < argc)
+        {
+            time_mode = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--epochs") == 0 && i + 1 < argc)
+        {
+            epochs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+        {
+            nepochs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rank") == 0 && i + 1 < argc)
+        {
+            rank = atoi(argv[++i]);
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // The time mode's size is the whole stream, split into epochs
+    if (ndims == 0 || time_mode >= ndims || count == 0 || epochs == 0 ||
+        nepochs == 0 || nepochs > epochs || dims[time_mode] < epochs) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    unsigned int epoch_len = dims[time_mode] / epochs;
+
+    unsigned int *idx = malloc(count * ndims * sizeof(unsigned int));
+    double *vals = malloc(count * sizeof(double));
+    if (!idx || !vals) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return 1;
+    }
+
+    srand(12345);
+    for (size_t z = 0; z < count; z++) {
+        for (unsigned int i = 0; i < ndims; i++) {
+            unsigned int r = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+            idx[z * ndims + i] = dims[i] ? r % dims[i] : 0;
+        }
+        idx[z * ndims + time_mode] = (unsigned int)(z * epochs / count) * epoch_len +
+                                     rand() % epoch_len;
+        vals[z] = (double)rand() / RAND_MAX;
+    }
+
+    struct hacoo_window *w = hacoo_window_alloc(ndims, dims, time_mode, epoch_len,
+                                                nepochs, HACOO_CHAINED);
+    if (!w) {
+        return 1;
+    }
+
+    // Ingest, timing each move of the window separately
+    double t_ingest = 0.0, t_drop = 0.0;
+    unsigned int drops = 0;
+    double start = omp_get_wtime();
+    for (size_t z = 0; z < count; z++) {
+        long long epoch = idx[z * ndims + time_mode] / epoch_len;
+        if (epoch > w->newest) {
+            double d0 = omp_get_wtime();
+            hacoo_window_advance(w, epoch);
+            t_drop += omp_get_wtime() - d0;
+            drops++;
+        }
+        hacoo_window_set(w, &idx[z * ndims], vals[z]);
+    }
+    t_ingest = omp_get_wtime() - start - t_drop;
+
+    // Rebuild the live window from its events, with times as window rows
+    size_t first = 0;
+    while (idx[first * ndims + time_mode] / epoch_len + nepochs <= w->newest) {
+        first++;
+    }
+    size_t live = count - first;
+    unsigned int *live_idx = malloc(live * ndims * sizeof(unsigned int));
+    memcpy(live_idx, &idx[first * ndims], live * ndims * sizeof(unsigned int));
+    for (size_t z = 0; z < live; z++) {
+        live_idx[z * ndims + time_mode] %= w->dims[time_mode];
+    }
+
+    start = omp_get_wtime();
+    struct hacoo_tensor *t = hacoo_build_from_coo(ndims, w->dims, live, live_idx,
+                                                  &vals[first], HACOO_CHAINED);
+    double t_rebuild = omp_get_wtime() - start;
+
+    matrix_t **u = malloc(ndims * sizeof(matrix_t *));
+    for (unsigned int i = 0; i < ndims; i++) {
+        u[i] = new_random_matrix(w->dims[i], rank, 0, 1);
+    }
+
+    start = omp_get_wtime();
+    matrix_t *mw = hacoo_window_mttkrp(w, u, 0);
+    double t_window = omp_get_wtime() - start;
+
+    start = omp_get_wtime();
+    matrix_t *mt = mttkrp(t, u, 0);
+    double t_tensor = omp_get_wtime() - start;
+
+    double diff = 0.0;
+    for (unsigned int r = 0; r < mw->rows; r++) {
+        for (unsigned int f = 0; f < rank; f++) {
+            diff = fmax(diff, fabs(mw->vals[r][f] - mt->vals[r][f]));
+        }
+    }
+
+    printf("Window benchmark: %zu events over %u epochs of %u, window of %u epochs\n",
+           count, epochs, epoch_len, nepochs);
+    printf("ingest          %8.3f s   %8.2f Mevents/s\n", t_ingest,
+           count / t_ingest / 1e6);
+    printf("advance         %8.3f ms per epoch (%u moves)\n", t_drop * 1e3 / drops,
+           drops);
+    printf("rebuild window  %8.3f ms (%zu live nnz, window holds %zu)\n",
+           t_rebuild * 1e3, (size_t)t->nnz, hacoo_window_nnz(w));
+    printf("mttkrp window   %8.3f ms   tensor %8.3f ms   max diff %g\n",
+           t_window * 1e3, t_tensor * 1e3, diff);
+
+    free_matrix(mw);
+    free_matrix(mt);
+    for (unsigned int i = 0; i < ndims; i++) {
+        free_matrix(u[i]);
+    }
+    free(u);
+    hacoo_free(t);
+    hacoo_window_free(w);
+    free(live_idx);
+    free(idx);
+    free(vals);
+    return 0;
+}
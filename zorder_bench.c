@@ -0,0 +1,242 @@
+/* Benchmark for Z-order MTTKRP.
+ *
+ * Runs MTTKRP over every mode of a tensor walking its nonzeros in hash
+ * order, then again walking the morton-sorted stream, and reports the time
+ * and cache misses of each. The tensor is read from a .tns file (such as
+ * nips or nell-2 from FROSTT) or made of random COO entries.
+ *
+ * Cache misses come from perf_event_open and are reported as n/a where
+ * hardware counters are not available.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <omp.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "hacoo.h"
+#include "matrix.h"
+#include "mttkrp.h"
+
+#define DEFAULT_COUNT (1 << 22)
+#define MAX_MODES 64
+
+struct run {
+    double time;
+    long long misses; //last level cache misses, -1 if not counted
+};
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [--input <file.tns>] [--zero-based] [--count <nonzeros>] "
+           "[--dims <I,J,K,...>] [--rank <rank>] [--storage chained|flat|frozen]\n",
+           program_name);
+}
+
+/* Open a counter of last level cache misses for this process, all threads
+ * included. Returns -1 if there is none. */
+static int open_miss_counter(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Time MTTKRP over every mode, summing the results into out */
+static struct run run_all_modes(struct hacoo_tensor *t, matrix_t **u,
+                                matrix_t **out, int counter)
+{
+    struct run r = {0.0, -1};
+    long long misses;
+
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = omp_get_wtime();
+    for (unsigned int n = 0; n < t->ndims; n++) {
+        out[n] = mttkrp(t, u, n);
+    }
+    r.time = omp_get_wtime() - start;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) == sizeof(misses)) {
+            r.misses = misses;
+        }
+    }
+    return r;
+}
+
+static void print_run(const char *name, struct run *r)
+{
+    if (r->misses >= 0) {
+        printf("%-14s %10.3f ms   %14lld LLC misses\n", name, r->time * 1e3,
+               r->misses);
+    } else {
+        printf("%-14s %10.3f ms   %14s LLC misses\n", name, r->time * 1e3, "n/a");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t count = DEFAULT_COUNT;
+    unsigned int dims[MAX_MODES] = {12092, 9184, 28818};
+    unsigned int ndims = 3;
+    unsigned int rank = 16;
+    unsigned int flags = HACOO_CHAINED;
+    const char *storage = "chained";
+    const char *input = NULL;
+    int zero_base = 0;
+    int freeze = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+        {
+            input = argv[++i];
+        }
+        else if (strcmp(argv[i], "--zero-based") == 0)
+        {
+            zero_base = 1;
+        }
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc)
+        {
+            count = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--dims") == 0 && i + 1 < argc)
+        {
+            const char *p = argv[++i];
+            for (ndims = 0; *p && ndims < MAX_MODES; ndims++) {
+                char *next;
+                dims[ndims] = strtoul(p, &next, 10);
+                p = *next == ',' ? next + 1 : next;
+            }
+        }
+        else if (strcmp(argv[i], "--rank") == 0 && i + 1 < argc)
+        {
+            rank = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc)
+        {
+            storage = argv[++i];
+            if (strcmp(storage, "flat") == 0) {
+                flags = HACOO_FLAT;
+            } else if (strcmp(storage, "frozen") == 0) {
+                freeze = 1;
+            } else if (strcmp(storage, "chained") != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (ndims == 0 || count == 0 || rank == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct hacoo_tensor *t;
+    if (input) {
+        FILE *file = fopen(input, "r");
+        if (!file) {
+            perror("Error opening tensor file");
+            return 1;
+        }
+        t = read_tensor_file_flags(file, zero_base, flags);
+        fclose(file);
+    } else {
+        unsigned int *idx = malloc(count * ndims * sizeof(unsigned int));
+        double *vals = malloc(count * sizeof(double));
+        if (!idx || !vals) {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            return 1;
+        }
+        srand(12345);
+        for (size_t z = 0; z < count; z++) {
+            for (unsigned int i = 0; i < ndims; i++) {
+                unsigned int r = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+                idx[z * ndims + i] = dims[i] ? r % dims[i] : 0;
+            }
+            vals[z] = (double)rand() / RAND_MAX;
+        }
+        t = hacoo_build_from_coo(ndims, dims, count, idx, vals, flags);
+        free(idx);
+        free(vals);
+    }
+    if (!t || (freeze && hacoo_freeze(t))) {
+        fprintf(stderr, "Error: Build failed.\n");
+        return 1;
+    }
+
+    matrix_t **u = malloc(t->ndims * sizeof(matrix_t *));
+    matrix_t **hash_res = malloc(t->ndims * sizeof(matrix_t *));
+    matrix_t **zorder_res = malloc(t->ndims * sizeof(matrix_t *));
+    for (unsigned int i = 0; i < t->ndims; i++) {
+        u[i] = new_random_matrix(t->dims[i], rank, 0, 1);
+    }
+
+    int counter = open_miss_counter();
+
+    // Warm up the factors, then time each order
+    for (unsigned int n = 0; n < t->ndims; n++) {
+        free_matrix(mttkrp(t, u, n));
+    }
+    struct run hash = run_all_modes(t, u, hash_res, counter);
+
+    double start = omp_get_wtime();
+    if (hacoo_zorder(t)) {
+        fprintf(stderr, "Error: Z-order sort failed.\n");
+        return 1;
+    }
+    double t_sort = omp_get_wtime() - start;
+    struct run zorder = run_all_modes(t, u, zorder_res, counter);
+
+    double diff = 0.0;
+    for (unsigned int n = 0; n < t->ndims; n++) {
+        for (unsigned int r = 0; r < hash_res[n]->rows; r++) {
+            for (unsigned int f = 0; f < rank; f++) {
+                diff = fmax(diff, fabs(hash_res[n]->vals[r][f] -
+                                       zorder_res[n]->vals[r][f]));
+            }
+        }
+    }
+
+    printf("Z-order benchmark: %s, %u nonzeros, %zu modes, rank %u, %s storage, "
+           "%d threads\n", input ? input : "random", t->nnz, t->ndims, rank,
+           storage, omp_get_max_threads());
+    printf("MTTKRP over all modes:\n");
+    print_run("hash order", &hash);
+    print_run("Z-order", &zorder);
+    printf("speedup        %10.2fx   sort %.3f ms   max diff %g\n",
+           hash.time / zorder.time, t_sort * 1e3, diff);
+
+    for (unsigned int i = 0; i < t->ndims; i++) {
+        free_matrix(u[i]);
+        free_matrix(hash_res[i]);
+        free_matrix(zorder_res[i]);
+    }
+    free(u);
+    free(hash_res);
+    free(zorder_res);
+    if (counter >= 0) {
+        close(counter);
+    }
+    hacoo_free(t);
+    return 0;
+}